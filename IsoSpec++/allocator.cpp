@@ -46,6 +46,18 @@ void Allocator<T>::shiftTables()
     currentId       = 0;
 }
 
+template <typename T>
+void Allocator<T>::clear()
+{
+    for(unsigned int i = 0; i < prevTabs.size(); ++i)
+        if(prevTabs[i] != currentTab)
+            delete [] prevTabs[i];
+
+    pod_vector<T*> empty;
+    prevTabs.swap(empty);
+    currentId = -1;
+}
+
 template class Allocator<int>;
 
 }  // namespace IsoSpec
@@ -47,6 +47,9 @@ template <typename T> class Allocator
 
     void shiftTables();
 
+    //! Free all the configurations handed out so far (invalidating them), keeping one table for reuse.
+    void clear();
+
     inline T* newConf()
     {
         currentId++;
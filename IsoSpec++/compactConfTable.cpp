@@ -0,0 +1,140 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+#include "compactConfTable.h"
+#include <limits>
+#include <utility>
+#include "misc.h"
+
+
+namespace IsoSpec
+{
+
+CompactConfTable::CompactConfTable(int _dim, const int* _base) :
+dim(_dim),
+base(array_copy<int>(_base, _dim)),
+width(1),
+no_confs(0),
+offsets(nullptr)
+{}
+
+CompactConfTable::CompactConfTable(int _dim, const int* _base, int _width, size_t _no_confs, const void* _offsets) :
+dim(_dim),
+base(array_copy<int>(_base, _dim)),
+width(_width),
+no_confs(_no_confs),
+offsets(_offsets)
+{}
+
+CompactConfTable::~CompactConfTable()
+{
+    delete[] base;
+}
+
+template<typename From, typename To> static void copy_offsets(const pod_vector<From>& from, pod_vector<To>& to)
+{
+    to.reserve(from.size());
+    for(size_t ii = 0; ii < from.size(); ii++)
+        to.push_back(from[ii]);
+}
+
+void CompactConfTable::widen(int new_width)
+{
+    pod_vector<int8_t> empty_narrow;
+    pod_vector<int16_t> empty_medium;
+
+    if(new_width == 2)
+        copy_offsets(narrow, medium);
+    else if(width == 1)
+        copy_offsets(narrow, wide);
+    else
+        copy_offsets(medium, wide);
+
+    // pod_vector can't shrink, so swap in empty ones to release the memory
+    if(width == 1)
+        narrow.swap(empty_narrow);
+    else
+        medium.swap(empty_medium);
+
+    width = new_width;
+}
+
+void CompactConfTable::update_offsets()
+{
+    switch(width)
+    {
+        case 1: offsets = narrow.data(); break;
+        case 2: offsets = medium.data(); break;
+        default: offsets = wide.data();
+    }
+}
+
+template<typename T> static bool fits(int offset)
+{
+    return offset >= std::numeric_limits<T>::min() && offset <= std::numeric_limits<T>::max();
+}
+
+void CompactConfTable::push_back(const int* conf)
+{
+    int needed = 1;
+    for(int ii = 0; ii < dim; ii++)
+    {
+        const int offset = conf[ii] - base[ii];
+        if(!fits<int16_t>(offset))
+            needed = 4;
+        else if(!fits<int8_t>(offset) && needed < 2)
+            needed = 2;
+    }
+
+    if(needed > width)
+        widen(needed);
+
+    switch(width)
+    {
+        case 1:
+            for(int ii = 0; ii < dim; ii++)
+                narrow.push_back(static_cast<int8_t>(conf[ii] - base[ii]));
+            break;
+        case 2:
+            for(int ii = 0; ii < dim; ii++)
+                medium.push_back(static_cast<int16_t>(conf[ii] - base[ii]));
+            break;
+        default:
+            for(int ii = 0; ii < dim; ii++)
+                wide.push_back(conf[ii] - base[ii]);
+    }
+
+    no_confs++;
+    update_offsets();
+}
+
+void CompactConfTable::reserve(size_t n)
+{
+    switch(width)
+    {
+        case 1: narrow.reserve(n*dim); break;
+        case 2: medium.reserve(n*dim); break;
+        default: wide.reserve(n*dim);
+    }
+    update_offsets();
+}
+
+size_t CompactConfTable::memory_usage() const
+{
+    return narrow.capacity() * sizeof(int8_t) + medium.capacity() * sizeof(int16_t) + wide.capacity() * sizeof(int32_t) + dim * sizeof(int);
+}
+
+}  // namespace IsoSpec
@@ -0,0 +1,106 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "platform.h"
+#include "pod_vector.h"
+
+namespace IsoSpec
+{
+
+//! A table of subisotopologues, stored as narrow offsets from a base subisotopologue (usually the mode).
+/*!
+    The isotope counts of the subisotopologues of a large marginal differ from those of its mode by small amounts,
+    so they are stored using 8 bits each as long as all the offsets fit, and the whole table is widened to 16
+    and then 32 bits once a subisotopologue further away from the base is added. The subisotopologues are
+    decoded into a caller-provided buffer.
+*/
+class ISOSPEC_EXPORT_SYMBOL CompactConfTable
+{
+ private:
+    const int dim;
+    int* base;
+    int width;                  /*!< The number of bytes per isotope count: 1, 2 or 4. */
+    size_t no_confs;
+    pod_vector<int8_t> narrow;
+    pod_vector<int16_t> medium;
+    pod_vector<int32_t> wide;
+    const void* offsets;        /*!< The data of the vector in use, or the offsets stored elsewhere (read-only tables). */
+
+    void widen(int new_width);
+    void update_offsets();
+
+    template<typename T> ISOSPEC_FORCE_INLINE void decode(const T* conf_offsets, int* space) const
+    {
+        for(int ii = 0; ii < dim; ii++)
+            space[ii] = base[ii] + conf_offsets[ii];
+    }
+
+ public:
+    //! Constructor.
+    /*!
+        \param _dim The number of isotopes.
+        \param _base The subisotopologue the offsets are taken from (copied).
+    */
+    CompactConfTable(int _dim, const int* _base);
+
+    //! Construct a read-only table on top of offsets stored elsewhere (e.g. in a mapped file), without copying them.
+    /*!
+        \param _width The number of bytes per isotope count: 1, 2 or 4.
+        \param _no_confs The number of subisotopologues.
+        \param _offsets The offsets from _base, _no_confs * _dim of them, _width bytes each. Must outlive the table.
+    */
+    CompactConfTable(int _dim, const int* _base, int _width, size_t _no_confs, const void* _offsets);
+
+    ~CompactConfTable();
+
+    CompactConfTable(const CompactConfTable& other) = delete;
+    CompactConfTable& operator=(const CompactConfTable& other) = delete;
+
+    //! Append a subisotopologue, widening the table if needed. Not available on read-only tables.
+    void push_back(const int* conf);
+
+    //! Reserve space for n subisotopologues at the current width. Not available on read-only tables.
+    void reserve(size_t n);
+
+    //! Decode the idx-th subisotopologue into space (of size dim).
+    ISOSPEC_FORCE_INLINE void get(size_t idx, int* space) const
+    {
+        switch(width)
+        {
+            case 1: decode(static_cast<const int8_t*>(offsets) + idx*dim, space); break;
+            case 2: decode(static_cast<const int16_t*>(offsets) + idx*dim, space); break;
+            default: decode(static_cast<const int32_t*>(offsets) + idx*dim, space);
+        }
+    }
+
+    inline size_t size() const { return no_confs; }
+
+    inline int bytes_per_count() const { return width; }
+
+    inline const int* get_base() const { return base; }
+
+    //! The stored offsets: size() * dim of them, bytes_per_count() bytes each.
+    inline const void* data() const { return offsets; }
+
+    //! The memory used by the stored offsets, in bytes.
+    size_t memory_usage() const;
+};
+
+}  // namespace IsoSpec
@@ -114,6 +114,11 @@ void get_conf_signature##generatorType(void* generator, int* space)\
 { reinterpret_cast<generatorType*>(generator)->get_conf_signature(space); }
 
 
+#define ISOSPEC_C_FN_CODE_FILL(generatorType)\
+size_t fill##generatorType(void* generator, double* masses, double* probs, double* lprobs, int* confs, size_t capacity)\
+{ return reinterpret_cast<generatorType*>(generator)->fill(masses, probs, lprobs, confs, capacity); }
+
+
 #define ISOSPEC_C_FN_DELETE(generatorType) void delete##generatorType(void* generator){ delete reinterpret_cast<generatorType*>(generator); }
 
 #define ISOSPEC_C_FN_CODES(generatorType)\
@@ -122,6 +127,7 @@ ISOSPEC_C_FN_CODE(generatorType, double, lprob) \
 ISOSPEC_C_FN_CODE(generatorType, double, prob) \
 ISOSPEC_C_FN_CODE_GET_CONF_SIGNATURE(generatorType) \
 ISOSPEC_C_FN_CODE(generatorType, bool, advanceToNextConfiguration) \
+ISOSPEC_C_FN_CODE_FILL(generatorType) \
 ISOSPEC_C_FN_DELETE(generatorType)
 
 
@@ -214,6 +220,24 @@ void* setupThresholdFixedEnvelope(void* iso,
     return reinterpret_cast<void*>(ret);
 }
 
+void* setupThresholdInMassRangeFixedEnvelope(void* iso,
+                     double threshold,
+                     double mass_lower,
+                     double mass_upper,
+                     bool absolute,
+                     bool get_confs)
+{
+    FixedEnvelope* ret = new FixedEnvelope(  // Use copy elision to allocate on heap with named constructor
+            FixedEnvelope::FromThresholdInMassRange(Iso(*reinterpret_cast<const Iso*>(iso), true),
+                                         threshold,
+                                         mass_lower,
+                                         mass_upper,
+                                         absolute,
+                                         get_confs));
+
+    return reinterpret_cast<void*>(ret);
+}
+
 void* setupTotalProbFixedEnvelope(void* iso,
                      double target_coverage,
                      bool optimize,
@@ -228,6 +252,18 @@ void* setupTotalProbFixedEnvelope(void* iso,
     return reinterpret_cast<void*>(ret);
 }
 
+void* setupTopKFixedEnvelope(void* iso,
+                     size_t k,
+                     bool get_confs)
+{
+    FixedEnvelope* ret = new FixedEnvelope(  // Use copy elision to allocate on heap with named constructor
+            FixedEnvelope::FromTopK(Iso(*reinterpret_cast<const Iso*>(iso), true),
+                                    k,
+                                    get_confs));
+
+    return reinterpret_cast<void*>(ret);
+}
+
 void* setupStochasticFixedEnvelope(void* iso,
                     size_t no_molecules,
                     double precision,
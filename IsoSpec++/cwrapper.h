@@ -56,12 +56,16 @@ ISOSPEC_C_API dataType method##generatorType(void* generator);
 #define ISOSPEC_C_FN_HEADER_GET_CONF_SIGNATURE(generatorType)\
 ISOSPEC_C_API void method##generatorType(void* generator);
 
+#define ISOSPEC_C_FN_HEADER_FILL(generatorType)\
+ISOSPEC_C_API size_t fill##generatorType(void* generator, double* masses, double* probs, double* lprobs, int* confs, size_t capacity);
+
 #define ISOSPEC_C_FN_HEADERS(generatorType)\
 ISOSPEC_C_FN_HEADER(generatorType, double, mass) \
 ISOSPEC_C_FN_HEADER(generatorType, double, lprob) \
 ISOSPEC_C_FN_HEADER(generatorType, double, prob) \
 ISOSPEC_C_FN_HEADER_GET_CONF_SIGNATURE(generatorType) \
 ISOSPEC_C_FN_HEADER(generatorType, bool, advanceToNextConfiguration) \
+ISOSPEC_C_FN_HEADER_FILL(generatorType) \
 ISOSPEC_C_FN_HEADER(generatorType, void, delete)
 
 
@@ -103,11 +107,22 @@ ISOSPEC_C_API void* setupThresholdFixedEnvelope(void* iso,
                               bool absolute,
                               bool get_confs);
 
+ISOSPEC_C_API void* setupThresholdInMassRangeFixedEnvelope(void* iso,
+                              double threshold,
+                              double mass_lower,
+                              double mass_upper,
+                              bool absolute,
+                              bool get_confs);
+
 ISOSPEC_C_API void* setupTotalProbFixedEnvelope(void* iso,
                               double taget_coverage,
                               bool optimize,
                               bool get_confs);
 
+ISOSPEC_C_API void* setupTopKFixedEnvelope(void* iso,
+                              size_t k,
+                              bool get_confs);
+
 ISOSPEC_C_API void* setupStochasticFixedEnvelope(void* iso,
                               size_t no_molecules,
                               double precision,
@@ -0,0 +1,247 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+/*
+ * Streaming enumeration of isotopologues, without storing them in a FixedEnvelope.
+ *
+ * The isotopologues are passed to a sink, which is a functor called either for each
+ * isotopologue (enumerate()) or for each chunk of them (enumerate_chunks()). The sink
+ * is a template parameter, so its call is inlined into the loop of the generator, and
+ * the memory used does not depend on the number of the isotopologues. The choice of the
+ * generator (and when to stop) is made by passing one of the policy objects below.
+ *
+ * Example:
+ *     std::vector<double> histogram(...);
+ *     enumerate(Iso("C100H202"), ThresholdPolicy(1e-6),
+ *               [&](double mass, double prob, const int*) { histogram[bin(mass)] += prob; });
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <limits>
+#include <utility>
+#include <algorithm>
+
+#include "platform.h"
+#include "isoSpec++.h"
+
+
+namespace IsoSpec
+{
+
+//! All the isotopologues above a threshold, in no particular order (see IsoThresholdGenerator).
+struct ThresholdPolicy
+{
+    double threshold;
+    bool absolute;
+
+    explicit ThresholdPolicy(double _threshold, bool _absolute = true) : threshold(_threshold), absolute(_absolute) {}
+};
+
+//! All the isotopologues above a threshold, by ascending mass (see IsoMassOrderedGenerator).
+struct MassOrderedThresholdPolicy
+{
+    double threshold;
+    bool absolute;
+
+    explicit MassOrderedThresholdPolicy(double _threshold, bool _absolute = true) : threshold(_threshold), absolute(_absolute) {}
+};
+
+//! Isotopologues of (at least) a given total probability (see IsoLayeredGenerator).
+/*!
+    The enumeration stops as soon as the target probability is reached. The set is not guaranteed
+    to be the smallest possible one: the last layer is not trimmed, as it is never stored.
+*/
+struct TotalProbPolicy
+{
+    double target_total_prob;
+
+    explicit TotalProbPolicy(double _target_total_prob) : target_total_prob(_target_total_prob) {}
+};
+
+//! The most probable isotopologues, by descending probability (see IsoOrderedGenerator).
+struct OrderedPolicy
+{
+    size_t max_confs;
+
+    explicit OrderedPolicy(size_t _max_confs = (std::numeric_limits<size_t>::max)()) : max_confs(_max_confs) {}
+};
+
+
+namespace detail
+{
+
+template<bool tgetConfs, bool tcheckProb, typename GenType, typename Sink>
+size_t enumerate_generator(GenType& gen, Sink& sink, size_t limit, ISOSPEC_MAYBE_UNUSED double target_prob)
+{
+    std::unique_ptr<int[]> conf;
+    constexpr_if(tgetConfs)
+        conf.reset(new int[gen.getAllDim()]);
+
+    size_t count = 0;
+    ISOSPEC_MAYBE_UNUSED double prob_so_far = 0.0;
+
+    while(count < limit && gen.GenType::advanceToNextConfiguration())
+    {
+        const double prob = gen.GenType::prob();
+        constexpr_if(tgetConfs)
+            gen.GenType::get_conf_signature(conf.get());
+        sink(gen.GenType::mass(), prob, const_cast<const int*>(conf.get()));
+        count++;
+        constexpr_if(tcheckProb)
+        {
+            prob_so_far += prob;
+            if(prob_so_far >= target_prob)
+                break;
+        }
+    }
+
+    return count;
+}
+
+template<bool tgetConfs, bool tcheckProb, typename GenType, typename Sink>
+size_t enumerate_generator_chunks(GenType& gen, Sink& sink, size_t chunk_size, size_t limit, ISOSPEC_MAYBE_UNUSED double target_prob)
+{
+    if(chunk_size == 0)
+        chunk_size = 1;
+
+    std::unique_ptr<double[]> masses(new double[chunk_size]);
+    std::unique_ptr<double[]> probs(new double[chunk_size]);
+    std::unique_ptr<int[]> confs;
+    constexpr_if(tgetConfs)
+        confs.reset(new int[chunk_size * gen.getAllDim()]);
+
+    size_t count = 0;
+    ISOSPEC_MAYBE_UNUSED double prob_so_far = 0.0;
+
+    while(count < limit)
+    {
+        const size_t capacity = (std::min)(chunk_size, limit - count);
+        size_t got = gen.fill(masses.get(), probs.get(), nullptr, confs.get(), capacity);
+        bool done = got < capacity;
+
+        constexpr_if(tcheckProb)
+            for(size_t ii = 0; ii < got; ii++)
+            {
+                prob_so_far += probs[ii];
+                if(prob_so_far >= target_prob)
+                {
+                    got = ii + 1;
+                    done = true;
+                    break;
+                }
+            }
+
+        if(got > 0)
+            sink(const_cast<const double*>(masses.get()), const_cast<const double*>(probs.get()), const_cast<const int*>(confs.get()), got);
+        count += got;
+
+        if(done)
+            break;
+    }
+
+    return count;
+}
+
+}  // namespace detail
+
+
+/*
+ * enumerate(iso, policy, sink) calls sink(double mass, double prob, const int* conf) for each isotopologue.
+ * conf points to the isotope counts (as in get_conf_signature()) if tgetConfs is true, and is nullptr otherwise.
+ * Returns the number of isotopologues passed to the sink.
+ */
+
+template<bool tgetConfs = false, typename Sink> size_t enumerate(Iso&& iso, const ThresholdPolicy& policy, Sink&& sink)
+{
+    IsoThresholdGenerator generator(std::move(iso), policy.threshold, policy.absolute);
+    return detail::enumerate_generator<tgetConfs, false>(generator, sink, (std::numeric_limits<size_t>::max)(), 0.0);
+}
+
+template<bool tgetConfs = false, typename Sink> size_t enumerate(Iso&& iso, const MassOrderedThresholdPolicy& policy, Sink&& sink)
+{
+    IsoMassOrderedGenerator generator(std::move(iso), policy.threshold, policy.absolute);
+    return detail::enumerate_generator<tgetConfs, false>(generator, sink, (std::numeric_limits<size_t>::max)(), 0.0);
+}
+
+template<bool tgetConfs = false, typename Sink> size_t enumerate(Iso&& iso, const TotalProbPolicy& policy, Sink&& sink)
+{
+    if(policy.target_total_prob <= 0.0)
+        return 0;
+
+    if(policy.target_total_prob >= 1.0)
+        return enumerate<tgetConfs>(std::move(iso), ThresholdPolicy(0.0), sink);
+
+    IsoLayeredGenerator generator(std::move(iso), 1000, 1000, true, (std::min)(policy.target_total_prob, 0.9999));
+    return detail::enumerate_generator<tgetConfs, true>(generator, sink, (std::numeric_limits<size_t>::max)(), policy.target_total_prob);
+}
+
+template<bool tgetConfs = false, typename Sink> size_t enumerate(Iso&& iso, const OrderedPolicy& policy, Sink&& sink)
+{
+    IsoOrderedGenerator generator(std::move(iso));
+    return detail::enumerate_generator<tgetConfs, false>(generator, sink, policy.max_confs, 0.0);
+}
+
+template<bool tgetConfs = false, typename Policy, typename Sink> size_t enumerate(const Iso& iso, const Policy& policy, Sink&& sink)
+{
+    return enumerate<tgetConfs>(Iso(iso, false), policy, std::forward<Sink>(sink));
+}
+
+
+/*
+ * enumerate_chunks(iso, policy, sink, chunk_size) calls sink(const double* masses, const double* probs, const int* confs, size_t n)
+ * for consecutive chunks of at most chunk_size isotopologues. confs holds n*getAllDim() isotope counts if tgetConfs is true,
+ * and is nullptr otherwise. The arrays are only valid during the call. Returns the number of isotopologues passed to the sink.
+ */
+
+template<bool tgetConfs = false, typename Sink> size_t enumerate_chunks(Iso&& iso, const ThresholdPolicy& policy, Sink&& sink, size_t chunk_size = 4096)
+{
+    IsoThresholdGenerator generator(std::move(iso), policy.threshold, policy.absolute);
+    return detail::enumerate_generator_chunks<tgetConfs, false>(generator, sink, chunk_size, (std::numeric_limits<size_t>::max)(), 0.0);
+}
+
+template<bool tgetConfs = false, typename Sink> size_t enumerate_chunks(Iso&& iso, const MassOrderedThresholdPolicy& policy, Sink&& sink, size_t chunk_size = 4096)
+{
+    IsoMassOrderedGenerator generator(std::move(iso), policy.threshold, policy.absolute);
+    return detail::enumerate_generator_chunks<tgetConfs, false>(generator, sink, chunk_size, (std::numeric_limits<size_t>::max)(), 0.0);
+}
+
+template<bool tgetConfs = false, typename Sink> size_t enumerate_chunks(Iso&& iso, const TotalProbPolicy& policy, Sink&& sink, size_t chunk_size = 4096)
+{
+    if(policy.target_total_prob <= 0.0)
+        return 0;
+
+    if(policy.target_total_prob >= 1.0)
+        return enumerate_chunks<tgetConfs>(std::move(iso), ThresholdPolicy(0.0), sink, chunk_size);
+
+    IsoLayeredGenerator generator(std::move(iso), 1000, 1000, true, (std::min)(policy.target_total_prob, 0.9999));
+    return detail::enumerate_generator_chunks<tgetConfs, true>(generator, sink, chunk_size, (std::numeric_limits<size_t>::max)(), policy.target_total_prob);
+}
+
+template<bool tgetConfs = false, typename Sink> size_t enumerate_chunks(Iso&& iso, const OrderedPolicy& policy, Sink&& sink, size_t chunk_size = 4096)
+{
+    IsoOrderedGenerator generator(std::move(iso));
+    return detail::enumerate_generator_chunks<tgetConfs, false>(generator, sink, chunk_size, policy.max_confs, 0.0);
+}
+
+template<bool tgetConfs = false, typename Policy, typename Sink> size_t enumerate_chunks(const Iso& iso, const Policy& policy, Sink&& sink, size_t chunk_size = 4096)
+{
+    return enumerate_chunks<tgetConfs>(Iso(iso, false), policy, std::forward<Sink>(sink), chunk_size);
+}
+
+}  // namespace IsoSpec
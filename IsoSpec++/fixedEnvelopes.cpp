@@ -16,20 +16,40 @@
 
 #include "fixedEnvelopes.h"
 #include <limits>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <cstdint>
 #include "isoMath.h"
 
 namespace IsoSpec
 {
 
+// The tables of the envelopes are realloc()-ed and free()-d, so they must be malloc()-ed too
+template<typename T> static T* malloc_copy(const T* A, size_t size)
+{
+    if(A == nullptr)
+        return nullptr;
+    T* ret = reinterpret_cast<T*>(malloc(size * sizeof(T)));
+    if(ret == nullptr && size > 0)
+        throw std::bad_alloc();
+    memcpy(ret, A, size * sizeof(T));
+    return ret;
+}
+
 FixedEnvelope::FixedEnvelope(const FixedEnvelope& other) :
-_masses(array_copy<double>(other._masses, other._confs_no)),
-_probs(array_copy<double>(other._probs, other._confs_no)),
-_confs(array_copy_nptr<int>(other._confs, other._confs_no*other.allDim)),
+_masses(malloc_copy<double>(other._masses, other._confs_no)),
+_probs(malloc_copy<double>(other._probs, other._confs_no)),
+_confs(malloc_copy<int>(other._confs, other._confs_no*other.allDim)),
 _confs_no(other._confs_no),
 allDim(other.allDim),
 sorted_by_mass(other.sorted_by_mass),
 sorted_by_prob(other.sorted_by_prob),
-total_prob(other.total_prob)
+total_prob(other.total_prob),
+current_size(other._confs_no),
+allDimSizeofInt(other.allDim*sizeof(int))
 {}
 
 FixedEnvelope::FixedEnvelope(FixedEnvelope&& other) :
@@ -40,13 +60,46 @@ _confs_no(other._confs_no),
 allDim(other.allDim),
 sorted_by_mass(other.sorted_by_mass),
 sorted_by_prob(other.sorted_by_prob),
-total_prob(other.total_prob)
+total_prob(other.total_prob),
+current_size(other._confs_no),
+allDimSizeofInt(other.allDim*sizeof(int))
 {
 other._masses = nullptr;
 other._probs  = nullptr;
 other._confs  = nullptr;
 other._confs_no = 0;
 other.total_prob = 0.0;
+other.current_size = 0;
+}
+
+FixedEnvelope& FixedEnvelope::operator=(FixedEnvelope&& other)
+{
+    if(this == &other)
+        return *this;
+
+    free(_masses);
+    free(_probs);
+    free(_confs);
+
+    _masses = other._masses;
+    _probs = other._probs;
+    _confs = other._confs;
+    _confs_no = other._confs_no;
+    allDim = other.allDim;
+    sorted_by_mass = other.sorted_by_mass;
+    sorted_by_prob = other.sorted_by_prob;
+    total_prob = other.total_prob;
+    current_size = other._confs_no;
+    allDimSizeofInt = other.allDim*sizeof(int);
+
+    other._masses = nullptr;
+    other._probs  = nullptr;
+    other._confs  = nullptr;
+    other._confs_no = 0;
+    other.total_prob = 0.0;
+    other.current_size = 0;
+
+    return *this;
 }
 
 FixedEnvelope::FixedEnvelope(double* in_masses, double* in_probs, size_t in_confs_no, bool masses_sorted, bool probs_sorted, double _total_prob) :
@@ -897,9 +950,54 @@ void FixedEnvelope::slow_reallocate_memory(size_t new_size)
     }
 }
 
-template<bool tgetConfs> void FixedEnvelope::threshold_init(Iso&& iso, double threshold, bool absolute)
+template<bool tgetConfs> void FixedEnvelope::reset_storage(int _allDim)
 {
-    IsoThresholdGenerator generator(std::move(iso), threshold, absolute);
+    free(_masses);
+    free(_probs);
+    free(_confs);
+    _masses = nullptr;
+    _probs = nullptr;
+    _confs = nullptr;
+    _confs_no = 0;
+    allDim = _allDim;
+    allDimSizeofInt = allDim*sizeof(int);
+    sorted_by_mass = false;
+    sorted_by_prob = false;
+    total_prob = NAN;
+
+    reallocate_memory<tgetConfs>(ISOSPEC_INIT_TABLE_SIZE);
+}
+
+template<bool tgetConfs> void FixedEnvelope::threshold_init(Iso&& iso, double threshold, bool absolute, MarginalCache* cache)
+{
+    IsoThresholdGenerator generator(std::move(iso), threshold, absolute, 1000, 1000, true, false, cache);
+
+    threshold_init<tgetConfs>(generator);
+}
+
+template<bool tgetConfs> void FixedEnvelope::threshold_init(IsoThresholdGenerator& generator)
+{
+    size_t tab_size = generator.count_confs();
+    this->allDim = generator.getAllDim();
+    this->allDimSizeofInt = this->allDim * sizeof(int);
+
+    this->reallocate_memory<tgetConfs>(tab_size);
+
+    int* ttconfs = nullptr;
+    constexpr_if(tgetConfs)
+        ttconfs = _confs;
+
+    this->_confs_no = generator.fill(this->_masses, this->_probs, nullptr, ttconfs, tab_size);
+}
+
+template void FixedEnvelope::threshold_init<true>(Iso&& iso, double threshold, bool absolute, MarginalCache* cache);
+template void FixedEnvelope::threshold_init<false>(Iso&& iso, double threshold, bool absolute, MarginalCache* cache);
+template void FixedEnvelope::threshold_init<true>(IsoThresholdGenerator& generator);
+template void FixedEnvelope::threshold_init<false>(IsoThresholdGenerator& generator);
+
+template<bool tgetConfs> void FixedEnvelope::threshold_mass_ordered_init(Iso&& iso, double threshold, bool absolute)
+{
+    IsoMassOrderedGenerator generator(std::move(iso), threshold, absolute);
 
     size_t tab_size = generator.count_confs();
     this->allDim = generator.getAllDim();
@@ -907,147 +1005,575 @@ template<bool tgetConfs> void FixedEnvelope::threshold_init(Iso&& iso, double th
 
     this->reallocate_memory<tgetConfs>(tab_size);
 
-    double* ttmasses = this->_masses;
-    double* ttprobs = this->_probs;
-    ISOSPEC_MAYBE_UNUSED int* ttconfs;
+    int* ttconfs = nullptr;
     constexpr_if(tgetConfs)
         ttconfs = _confs;
 
+    this->_confs_no = generator.fill(this->_masses, this->_probs, nullptr, ttconfs, tab_size);
+    this->sorted_by_mass = true;
+}
+
+template void FixedEnvelope::threshold_mass_ordered_init<true>(Iso&& iso, double threshold, bool absolute);
+template void FixedEnvelope::threshold_mass_ordered_init<false>(Iso&& iso, double threshold, bool absolute);
+
+template<bool tgetConfs> void FixedEnvelope::threshold_in_mass_range_init(Iso&& iso, double threshold, double mass_lower, double mass_upper, bool absolute)
+{
+    IsoThresholdInMassRangeGenerator generator(std::move(iso), threshold, mass_lower, mass_upper, absolute);
+
+    this->allDim = generator.getAllDim();
+    this->allDimSizeofInt = this->allDim * sizeof(int);
+
+    this->reallocate_memory<tgetConfs>(ISOSPEC_INIT_TABLE_SIZE);
+
     while(generator.advanceToNextConfiguration())
+        this->template addConfILG<tgetConfs, IsoThresholdInMassRangeGenerator>(generator);
+}
+
+template void FixedEnvelope::threshold_in_mass_range_init<true>(Iso&& iso, double threshold, double mass_lower, double mass_upper, bool absolute);
+template void FixedEnvelope::threshold_in_mass_range_init<false>(Iso&& iso, double threshold, double mass_lower, double mass_upper, bool absolute);
+
+template<bool tgetConfs> void FixedEnvelope::threshold_init_parallel(Iso&& iso, double threshold, bool absolute, unsigned int n_threads)
+{
+    if(n_threads == 0)
+        n_threads = std::thread::hardware_concurrency();
+
+    if(n_threads <= 1)
+    {
+        threshold_init<tgetConfs>(std::move(iso), threshold, absolute);
+        return;
+    }
+
+    IsoThresholdGenerator generator(std::move(iso), threshold, absolute);
+
+    this->allDim = generator.getAllDim();
+    this->allDimSizeofInt = this->allDim * sizeof(int);
+
+    // Cut the space into many more chunks than there are threads: the chunks differ wildly in size,
+    // and the threads balance the load by grabbing the next unprocessed chunk once they are done with the last one
+    std::vector<int> chunks;
+    int no_ranges;
+    const size_t no_chunks = generator.split_space(ISOSPEC_CHUNKS_PER_THREAD * n_threads, chunks, &no_ranges);
+
+    // Keep one (idle) thread when the threshold leaves no chunks at all: the result must still be a valid, empty envelope
+    n_threads = static_cast<unsigned int>((std::max<size_t>)(1, (std::min<size_t>)(n_threads, no_chunks)));
+
+    std::unique_ptr<FixedEnvelope[]> partials(new FixedEnvelope[n_threads]);
+    std::unique_ptr<unsigned int[]> chunk_thread(new unsigned int[no_chunks]);
+    std::unique_ptr<size_t[]> chunk_start(new size_t[no_chunks]);
+    std::unique_ptr<size_t[]> chunk_end(new size_t[no_chunks]);
+    std::atomic<size_t> next_chunk(0);
+
+    run_in_threads(n_threads, [&](unsigned int thread_id)
+    {
+        try
+        {
+            FixedEnvelope& partial = partials[thread_id];
+            partial.allDim = this->allDim;
+            partial.allDimSizeofInt = this->allDimSizeofInt;
+            partial.template reallocate_memory<tgetConfs>(ISOSPEC_INIT_TABLE_SIZE);
+
+            size_t chunk_idx;
+            while((chunk_idx = next_chunk.fetch_add(1)) < no_chunks)
+            {
+                IsoThresholdGenerator chunk_generator(generator, chunks.data() + chunk_idx * 2 * no_ranges, no_ranges);
+                chunk_thread[chunk_idx] = thread_id;
+                chunk_start[chunk_idx] = partial._confs_no;
+                while(chunk_generator.advanceToNextConfiguration())
+                    partial.template addConfILG<tgetConfs, IsoThresholdGenerator>(chunk_generator);
+                chunk_end[chunk_idx] = partial._confs_no;
+            }
+        }
+        catch(...)
+        {
+            // Have the other threads quit early: run_in_threads() rethrows
+            next_chunk = no_chunks;
+            throw;
+        }
+    });
+
+    // Glue the chunks together in order, so that the result does not depend on the scheduling
+    size_t tab_size = 0;
+    for(unsigned int ii = 0; ii < n_threads; ii++)
+        tab_size += partials[ii]._confs_no;
+
+    this->reallocate_memory<tgetConfs>(tab_size);
+
+    for(size_t ii = 0; ii < no_chunks; ii++)
     {
-        *ttmasses = generator.mass(); ttmasses++;
-        *ttprobs = generator.prob(); ttprobs++;
-        constexpr_if(tgetConfs)  { generator.get_conf_signature(ttconfs); ttconfs += allDim; }
+        const FixedEnvelope& partial = partials[chunk_thread[ii]];
+        const size_t start = chunk_start[ii];
+        const size_t len = chunk_end[ii] - start;
+        memcpy(tmasses, partial._masses + start, len * sizeof(double)); tmasses += len;
+        memcpy(tprobs, partial._probs + start, len * sizeof(double)); tprobs += len;
+        constexpr_if(tgetConfs) { memcpy(tconfs, partial._confs + start * allDim, len * allDimSizeofInt); tconfs += len * allDim; }
     }
 
     this->_confs_no = tab_size;
 }
 
-template void FixedEnvelope::threshold_init<true>(Iso&& iso, double threshold, bool absolute);
-template void FixedEnvelope::threshold_init<false>(Iso&& iso, double threshold, bool absolute);
+template void FixedEnvelope::threshold_init_parallel<true>(Iso&& iso, double threshold, bool absolute, unsigned int n_threads);
+template void FixedEnvelope::threshold_init_parallel<false>(Iso&& iso, double threshold, bool absolute, unsigned int n_threads);
 
 
-template<bool tgetConfs> void FixedEnvelope::total_prob_init(Iso&& iso, double target_total_prob, bool optimize)
+template<bool tgetConfs> void FixedEnvelope::total_prob_init(Iso&& iso, double target_total_prob, bool optimize, unsigned int n_threads, TotalProbState* state)
 {
-    if(target_total_prob <= 0.0)
-        return;
-
-    if(target_total_prob >= 1.0)
+    // With a state, the layers are walked through in any case: they are what the state resumes from
+    if(state == nullptr)
     {
-        threshold_init<tgetConfs>(std::move(iso), 0.0, true);
-        return;
+        if(target_total_prob <= 0.0)
+            return;
+
+        if(target_total_prob >= 1.0)
+        {
+            threshold_init<tgetConfs>(std::move(iso), 0.0, true);
+            return;
+        }
     }
 
-    IsoLayeredGenerator generator(std::move(iso), 1000, 1000, true, std::min<double>(target_total_prob, 0.9999));
+    const double t_prob_hint = target_total_prob > 0.0 ? (std::min)(target_total_prob, 0.9999) : 0.9999;
 
-    this->allDim = generator.getAllDim();
+    std::unique_ptr<IsoLayeredGenerator> generator(new IsoLayeredGenerator(std::move(iso), 1000, 1000, true, t_prob_hint));
+
+    this->allDim = generator->getAllDim();
     this->allDimSizeofInt = this->allDim*sizeof(int);
 
 
     this->reallocate_memory<tgetConfs>(ISOSPEC_INIT_TABLE_SIZE);
 
-    size_t last_switch = 0;
-    double prob_at_last_switch = 0.0;
-    double prob_so_far = 0.0;
+    if(state != nullptr)
+    {
+        state->excess.template reset_storage<tgetConfs>(this->allDim);
+        state->t_prob_hint = t_prob_hint;
+        state->optimize = optimize;
+        state->get_confs = tgetConfs;
+    }
+
+    total_prob_layers<tgetConfs>(*generator, target_total_prob, optimize, n_threads, state, true, 0, 0.0, 0.0);
+
+    if(state != nullptr)
+    {
+        state->generator = std::move(generator);
+        state->envelope_confs_no = this->_confs_no;
+    }
+}
+
+template void FixedEnvelope::total_prob_init<true>(Iso&& iso, double target_total_prob, bool optimize, unsigned int n_threads, TotalProbState* state);
+template void FixedEnvelope::total_prob_init<false>(Iso&& iso, double target_total_prob, bool optimize, unsigned int n_threads, TotalProbState* state);
+
+/*
+ * Store the configurations of the layers of the generator until their probabilities, added to prob_so_far, reach
+ * target_total_prob. The current layer (open unless it's been gone through already) started at last_switch in the
+ * envelope, with prob_at_last_switch stored before it. If optimizing, the whole last layer is stored, and then its
+ * excess trimmed. With a state, the configurations of the last layer which are not kept go to its excess, and the
+ * generator is left at the end of that layer.
+ */
+template<bool tgetConfs> void FixedEnvelope::total_prob_layers(IsoLayeredGenerator& generator, double target_total_prob, bool optimize, unsigned int n_threads, TotalProbState* state,
+                                                                bool layer_open, size_t last_switch, double prob_at_last_switch, double prob_so_far)
+{
     double layer_delta;
 
-    const double sum_above = log1p(-target_total_prob) - 2.3025850929940455;  // log(0.1);
+    const double sum_above = log1p(-(std::min)(target_total_prob, 1.0)) - 2.3025850929940455;  // log(0.1);
 
-    do
-    {  // Store confs until we accumulate more prob than needed - and, if optimizing,
-       // store also the rest of the last layer
-        while(generator.advanceToNextConfigurationWithinLayer())
+    while(true)
+    {
+        if(layer_open)
         {
-            this->template addConfILG<tgetConfs>(generator);
-            prob_so_far += *(tprobs-1);  // The just-stored probability
+            // Store confs until we accumulate more prob than needed - and, if optimizing,
+            // store also the rest of the last layer
+            while(prob_so_far < target_total_prob && generator.advanceToNextConfigurationWithinLayer())
+            {
+                this->template addConfILG<tgetConfs>(generator);
+                prob_so_far += *(tprobs-1);  // The just-stored probability
+            }
             if(prob_so_far >= target_total_prob)
             {
-                if (optimize)
-                {
+                if(optimize)
                     while(generator.advanceToNextConfigurationWithinLayer())
+                    {
                         this->template addConfILG<tgetConfs>(generator);
-                    break;
-                }
-                else
-                    return;
+                        prob_so_far += *(tprobs-1);
+                    }
+                else if(state != nullptr)
+                    while(generator.advanceToNextConfigurationWithinLayer())
+                        state->excess.template addConfILG<tgetConfs>(generator);
+                break;
             }
         }
-        if(prob_so_far >= target_total_prob)
+        else if(prob_so_far >= target_total_prob)
             break;
 
         last_switch = this->_confs_no;
         prob_at_last_switch = prob_so_far;
 
+        // Step towards where the target probability is likely reached, through layers neither so large that they
+        // overshoot it by much (the excess is trimmed below), nor so small that the per-layer overhead dominates.
+        // Past ISOSPEC_TOTAL_PROB_MAX_LAYER_CONFS, a layer may hold as many isotopologues as the previous ones
+        // together: that keeps the number of layers logarithmic, with an overshoot within the doubling of the tables.
+        const double largest_delta = generator.plan_layer_offset(this->_confs_no,
+                                            (std::max)(static_cast<double>(ISOSPEC_TOTAL_PROB_MAX_LAYER_CONFS), static_cast<double>(this->_confs_no)));
         layer_delta = sum_above - log1p(-prob_so_far);
+        if(std::isnan(layer_delta))
+            // Targets of 1 (or more, with a state): nothing to aim at but the end
+            layer_delta = -5.0;
         layer_delta = (std::max)((std::min)(layer_delta, -0.1), -5.0);
-    } while(generator.nextLayer(layer_delta));
+        if(generator.layer_sizes_measured())
+            layer_delta = (std::min)(layer_delta, generator.plan_layer_offset(this->_confs_no, ISOSPEC_TOTAL_PROB_MIN_LAYER_CONFS));
+        layer_delta = (std::max)(layer_delta, largest_delta);
+
+        if(!generator.nextLayer(layer_delta))
+            break;
+        layer_open = true;
+    }
 
     if(!optimize || prob_so_far <= target_total_prob)
         return;
 
     // Right. We have extra configurations and we have been asked to produce an optimal p-set, so
-    // now we shall trim unneeded configurations, using an algorithm dubbed "quicktrim"
-    // - similar to the quickselect algorithm, except that we use the cumulative sum of elements
-    // left of pivot to decide whether to go left or right, instead of the positional index.
-    // We'll be sorting by the prob array, permuting the other ones in parallel.
+    // now we shall trim unneeded configurations of the last layer (see quicktrim_parallel())
+    const size_t end = quicktrim_parallel<tgetConfs>(last_switch, this->_confs_no, prob_at_last_switch, target_total_prob, n_threads,
+                                                     state != nullptr ? &state->excess : nullptr);
 
-    int* conf_swapspace = nullptr;
-    constexpr_if(tgetConfs)
-        conf_swapspace = reinterpret_cast<int*>(malloc(this->allDimSizeofInt));
+    if(end > 0 && end <= current_size/2)
+        // Overhead in memory of 2x or more, shrink to fit
+        this->template reallocate_memory<tgetConfs>(end);
 
-    size_t start = last_switch;
-    size_t end = this->_confs_no;
-    double sum_to_start = prob_at_last_switch;
+    this->_confs_no = end;
+}
+
+void FixedEnvelope::extend_total_prob(TotalProbState& state, double target_total_prob, unsigned int n_threads)
+{
+    if(!state.is_set())
+        throw std::logic_error("The state was not set by FromTotalProb()");
+    if(state.envelope_confs_no != _confs_no || state.excess.allDim != allDim)
+        throw std::logic_error("The state was set for another envelope");
+    if(state.get_confs && _confs == nullptr && _confs_no > 0)
+        throw std::logic_error("Cannot extend an envelope whose configurations were released");
+
+    if(state.get_confs)
+        total_prob_resume<true>(state, target_total_prob, n_threads);
+    else
+        total_prob_resume<false>(state, target_total_prob, n_threads);
+}
+
+template<bool tgetConfs> void FixedEnvelope::total_prob_resume(TotalProbState& state, double target_total_prob, unsigned int n_threads)
+{
+    // The pointers past the stored configurations aren't kept by the copies of the envelope: set them anew
+    this->allDimSizeofInt = this->allDim*sizeof(int);
+    this->template reallocate_memory<tgetConfs>((std::max)(this->_confs_no, static_cast<size_t>(ISOSPEC_INIT_TABLE_SIZE)));
+
+    double prob_so_far = 0.0;
+    for(size_t ii = 0; ii < this->_confs_no; ii++)
+        prob_so_far += this->_probs[ii];
+
+    // The rest of the last layer comes first, as if the layer was resumed: from there on, it's as in total_prob_init()
+    const size_t last_switch = this->_confs_no;
+    const double prob_at_last_switch = prob_so_far;
+
+    FixedEnvelope excess(std::move(state.excess));
+    state.excess.template reset_storage<tgetConfs>(this->allDim);
+
+    for(size_t ii = 0; ii < excess._confs_no; ii++)
+        if(state.optimize || prob_so_far < target_total_prob)
+        {
+            this->template copy_conf<tgetConfs>(excess, ii);
+            prob_so_far += excess._probs[ii];
+        }
+        else
+            state.excess.template copy_conf<tgetConfs>(excess, ii);
+
+    total_prob_layers<tgetConfs>(*state.generator, target_total_prob, state.optimize, n_threads, &state, false, last_switch, prob_at_last_switch, prob_so_far);
+
+    state.envelope_confs_no = this->_confs_no;
 
-    while(start < end)
+    if(this->_confs_no != last_switch)
     {
-        // Partition part
-        size_t len = end - start;
+        this->sorted_by_mass = false;
+        this->sorted_by_prob = false;
+        this->total_prob = NAN;
+    }
+}
+
+/*
+ * Keep the fewest most probable configurations of the [start, end) part of the envelope whose probabilities,
+ * added to sum_to_start, reach target_total_prob, and return the end of them. This is the algorithm dubbed
+ * "quicktrim" - similar to the quickselect algorithm, except that we use the cumulative sum of elements
+ * left of pivot to decide whether to go left or right, instead of the positional index.
+ *
+ * Only a copy of the probabilities is partitioned, in n_threads threads: each counts and sums the probabilities
+ * above and at the pivot in its block of the candidates, and a prefix scan of these partial sums chooses the side
+ * and the positions the threads write their part of the candidates to. The kept configurations are those above
+ * the probability found (and as many of those at it as needed), and are moved, each at most once, to the beginning
+ * of the range, in their original order. If dropped is not null, the other ones are appended to it.
+ */
+template<bool tgetConfs> size_t FixedEnvelope::quicktrim_parallel(size_t start, size_t end, double sum_to_start, double target_total_prob, unsigned int n_threads, FixedEnvelope* dropped)
+{
+    if(n_threads == 0)
+        n_threads = (std::max)(1U, std::thread::hardware_concurrency());
+
+    // Fewer candidates than that per thread are not worth the cost of starting the threads
+    const size_t min_cands_per_thread = 65536;
+
+    const size_t len = end - start;
+    const double* probs = this->_probs + start;
+
+    // The probabilities of the configurations that may or may not be kept. In the first round, these are
+    // all the ones of the range, read in place.
+    std::unique_ptr<double[]> cands;
+    std::unique_ptr<double[]> cands_tmp;
+    bool first_round = true;
+    auto candidate = [&](size_t ii) { return first_round ? probs[ii] : cands[ii]; };
+
+    struct BlockSums
+    {
+        size_t no_above, no_at;
+        double above, at;
+    };
+    std::unique_ptr<BlockSums[]> block_sums(new BlockSums[n_threads]);
+    std::unique_ptr<size_t[]> block_offsets(new size_t[n_threads]);
+
+    // The configurations above boundary are kept, and so are the first no_at_boundary ones at it
+    double boundary = std::numeric_limits<double>::infinity();
+    size_t no_at_boundary = 0;
+
+    size_t no_cands = len;
+
+    while(no_cands > 0)
+    {
+        const unsigned int no_threads = static_cast<unsigned int>((std::min<size_t>)(n_threads, (std::max<size_t>)(1, no_cands / min_cands_per_thread)));
+        auto block_start = [&](unsigned int thread_id) { return no_cands * thread_id / no_threads; };
+
 #if ISOSPEC_BUILDING_R
-        size_t pivot = len/2 + start;
+        const double pprob = candidate(no_cands/2);
 #else
-        size_t pivot = random_gen() % len + start;  // Using Mersenne twister directly - we don't
-                                                    // need a very uniform distribution just for pivot
-                                                    // selection
+        const double pprob = candidate(random_gen() % no_cands);  // Using Mersenne twister directly - we don't
+                                                                   // need a very uniform distribution just for pivot
+                                                                   // selection
 #endif
-        double pprob = this->_probs[pivot];
-        swap<tgetConfs>(pivot, end-1, conf_swapspace);
 
-        double new_csum = sum_to_start;
+        run_in_threads(no_threads, [&](unsigned int thread_id)
+        {
+            BlockSums sums = {0, 0, 0.0, 0.0};
+            for(size_t ii = block_start(thread_id); ii < block_start(thread_id+1); ii++)
+            {
+                const double prob = candidate(ii);
+                if(prob > pprob)
+                {
+                    sums.no_above++;
+                    sums.above += prob;
+                }
+                else if(prob == pprob)
+                {
+                    sums.no_at++;
+                    sums.at += prob;
+                }
+            }
+            block_sums[thread_id] = sums;
+        });
+
+        double above = 0.0;
+        double at = 0.0;
+        size_t no_at = 0;
+        for(unsigned int ii = 0; ii < no_threads; ii++)
+        {
+            above += block_sums[ii].above;
+            at += block_sums[ii].at;
+            no_at += block_sums[ii].no_at;
+        }
 
-        size_t loweridx = start;
-        for(size_t ii = start; ii < end-1; ii++)
-            if(this->_probs[ii] > pprob)
+        // Selection part: the candidates above the pivot are either all that remain, or all kept
+        const bool go_above = sum_to_start + above >= target_total_prob;
+        const bool stop_at = !go_above && sum_to_start + above + at >= target_total_prob;
+
+        size_t next_no_cands = 0;
+        for(unsigned int ii = 0; ii < no_threads; ii++)
+        {
+            block_offsets[ii] = next_no_cands;
+            const BlockSums& sums = block_sums[ii];
+            const size_t block_len = block_start(ii+1) - block_start(ii);
+            next_no_cands += go_above ? sums.no_above : stop_at ? 0 : block_len - sums.no_above - sums.no_at;
+        }
+
+        if(!go_above)
+        {
+            boundary = pprob;
+            no_at_boundary = len;
+        }
+
+        if(stop_at)
+        {
+            // Only some of the configurations as probable as the pivot are needed
+            sum_to_start += above;
+            for(no_at_boundary = 0; sum_to_start < target_total_prob && no_at_boundary < no_at; no_at_boundary++)
+                sum_to_start += pprob;
+            break;
+        }
+
+        if(first_round)
+        {
+            cands.reset(new double[next_no_cands]);
+            cands_tmp.reset(new double[next_no_cands]);
+        }
+
+        run_in_threads(no_threads, [&](unsigned int thread_id)
+        {
+            size_t out = block_offsets[thread_id];
+            for(size_t ii = block_start(thread_id); ii < block_start(thread_id+1); ii++)
             {
-                swap<tgetConfs>(ii, loweridx, conf_swapspace);
-                new_csum += this->_probs[loweridx];
-                loweridx++;
+                const double prob = candidate(ii);
+                if(go_above ? prob > pprob : prob < pprob)
+                    cands_tmp[out++] = prob;
             }
+        });
+
+        if(!go_above)
+            sum_to_start += above + at;
+
+        cands.swap(cands_tmp);
+        no_cands = next_no_cands;
+        first_round = false;
+    }
+
+    // Move the kept configurations to the beginning of the range, in their original order
+    size_t kept_end = start;
+    for(size_t ii = 0; ii < len; ii++)
+        if(probs[ii] > boundary || (probs[ii] == boundary && no_at_boundary > 0))
+        {
+            if(probs[ii] == boundary)
+                no_at_boundary--;
+            const size_t from = start + ii;
+            if(from != kept_end)
+            {
+                this->_probs[kept_end] = this->_probs[from];
+                this->_masses[kept_end] = this->_masses[from];
+                constexpr_if(tgetConfs)
+                    memcpy(this->_confs + kept_end * this->allDim, this->_confs + from * this->allDim, this->allDimSizeofInt);
+            }
+            kept_end++;
+        }
+        else if(dropped != nullptr)
+            dropped->template copy_conf<tgetConfs>(*this, start + ii);
+
+    return kept_end;
+}
+
+template<bool tgetConfs> void FixedEnvelope::topk_init(Iso&& iso, size_t k)
+{
+    // We search for L = -log(relative threshold), modelling the number of configurations above it after the
+    // Gaussian approximations of the marginals as exp(log_coeff) * L^exponent (see Iso::saveLogSizeModel())
+    double log_coeff, exponent;
+    iso.saveLogSizeModel(&log_coeff, &exponent);
+    const bool few_confs = iso.getLogConfsNo() <= log(2.0 * k + 16.0);
+
+    // Start with the configurations at least 1/e as probable as the mode. (A relative threshold of exactly 1.0
+    // is unsafe: due to rounding the mode itself might or might not make it.) If there are at most about 2k
+    // configurations at all, we simply take all of them.
+    IsoThresholdGenerator generator(std::move(iso), few_confs ? 0.0 : exp(-1.0), false);
+
+    this->allDim = generator.getAllDim();
+    this->allDimSizeofInt = this->allDim * sizeof(int);
+
+    if(k == 0)
+        return;
+
+    if(!few_confs)
+    {
+        // Configurations less probable than DBL_MIN times the mode are not considered: smaller thresholds underflow to 0.0,
+        // which would make the generator take all the configurations, however many there are
+        const double max_L = -log((std::numeric_limits<double>::min)());
+        const double log_target = log(1.5 * k);
 
-        swap<tgetConfs>(end-1, loweridx, conf_swapspace);
+        double lo = 0.0;
+        double hi = std::numeric_limits<double>::infinity();
+        double L = 1.0;
+        size_t count = generator.count_confs();
 
-        // Selection part
-        if(new_csum < target_total_prob)
+        // The first guess is taken from the model itself, the further ones from the model refitted to the last count
+        bool first_guess = true;
+
+        while(count < k || count > 2*k + 16)
+        {
+            if(count < k)
+                lo = L;
+            else
+                hi = L;
+
+            if(lo >= max_L || (!std::isinf(hi) && hi - lo <= 1e-9 * hi))
+                break;
+
+            if(!first_guess && count > 0)
+                log_coeff = log(static_cast<double>(count)) - exponent * log(L);
+            first_guess = false;
+
+            double next_L = exp((log_target - log_coeff) / exponent);
+
+            // The model may be way off: L at most doubles (or halves) per step, and stays within the bracket
+            next_L = (std::min)((std::max)(next_L, 0.5 * L), 2.0 * L);
+            if(next_L <= lo || next_L >= hi)
+                next_L = std::isinf(hi) ? 2.0 * (std::max)(lo, 1.0) : 0.5 * (lo + hi);
+
+            L = (std::min)(next_L, max_L);
+            generator.new_threshold(exp(-L), false);
+            count = generator.count_confs();
+        }
+
+        if(count < k && !std::isinf(hi))
         {
-            start = loweridx + 1;
-            sum_to_start = new_csum + this->_probs[loweridx];
+            // Many configurations of equal probability: jump straight from below k to way above it
+            generator.new_threshold(exp(-hi), false);
         }
+    }
+
+    threshold_init<tgetConfs>(generator);
+
+    if(this->_confs_no <= k)
+        return;
+
+    int* conf_swapspace = nullptr;
+    constexpr_if(tgetConfs)
+        conf_swapspace = reinterpret_cast<int*>(malloc(this->allDimSizeofInt));
+
+    // Quickselect with a three-way partition, so that ties (eg. the probabilities underflowing to 0.0) take one pass
+    size_t start = 0;
+    size_t end = this->_confs_no;
+
+    while(end - start > 1)
+    {
+#if ISOSPEC_BUILDING_R
+        const double pprob = this->_probs[start + (end - start)/2];
+#else
+        const double pprob = this->_probs[start + random_gen() % (end - start)];
+#endif
+        // [start, above) are more probable than the pivot, [above, below) equally probable, [below, end) less probable
+        size_t above = start;
+        size_t below = end;
+        size_t ii = start;
+        while(ii < below)
+            if(this->_probs[ii] > pprob)
+                swap<tgetConfs>(ii++, above++, conf_swapspace);
+            else if(this->_probs[ii] < pprob)
+                swap<tgetConfs>(ii, --below, conf_swapspace);
+            else
+                ii++;
+
+        if(k < above)
+            end = above;
+        else if(k > below)
+            start = below;
         else
-            end = loweridx;
+            break;
     }
 
     constexpr_if(tgetConfs)
         free(conf_swapspace);
 
-    if(end <= current_size/2)
-        // Overhead in memory of 2x or more, shrink to fit
-        this->template reallocate_memory<tgetConfs>(end);
+    if(k <= current_size/2)
+        this->template reallocate_memory<tgetConfs>(k);
 
-    this->_confs_no = end;
+    this->_confs_no = k;
 }
 
-template void FixedEnvelope::total_prob_init<true>(Iso&& iso, double target_total_prob, bool optimize);
-template void FixedEnvelope::total_prob_init<false>(Iso&& iso, double target_total_prob, bool optimize);
+template void FixedEnvelope::topk_init<true>(Iso&& iso, size_t k);
+template void FixedEnvelope::topk_init<false>(Iso&& iso, size_t k);
 
 template<bool tgetConfs> void FixedEnvelope::stochastic_init(Iso&& iso, size_t _no_molecules, double _precision, double _beta_bias)
 {
@@ -1088,7 +1614,7 @@ double FixedEnvelope::empiric_variance()
     return ret / get_total_prob();
 }
 
-FixedEnvelope FixedEnvelope::Binned(Iso&& iso, double target_total_prob, double bin_width, double bin_middle)
+FixedEnvelope FixedEnvelope::Binned(Iso&& iso, double target_total_prob, double bin_width, double bin_middle, int aggregate_fine_bins)
 {
     FixedEnvelope ret;
 
@@ -1112,7 +1638,7 @@ FixedEnvelope FixedEnvelope::Binned(Iso&& iso, double target_total_prob, double
 
     acc -= idx_min;
 
-    IsoLayeredGenerator ITG(std::move(iso));
+    IsoLayeredGenerator ITG(std::move(iso), 1000, 1000, true, 0.99, aggregate_fine_bins);
 
 
     bool non_empty;
@@ -1141,7 +1667,8 @@ FixedEnvelope FixedEnvelope::Binned(Iso&& iso, double target_total_prob, double
 
         ret.reallocate_memory<false>(ISOSPEC_INIT_TABLE_SIZE);
 
-        for(size_t ii = nonzero_idx; ii >= idx_min && empty_steps < distance_10da; ii--)
+        // Not ii >= idx_min: that never fails for idx_min == 0 (molecules with no atoms)
+        for(size_t ii = nonzero_idx + 1; ii-- > idx_min && empty_steps < distance_10da;)
         {
             if(acc[ii] > 0.0)
             {
@@ -1176,4 +1703,162 @@ FixedEnvelope FixedEnvelope::Binned(Iso&& iso, double target_total_prob, double
     return ret;
 }
 
+static const char total_prob_state_magic[8] = {'I', 's', 'o', 'S', 'p', 'e', 'c', 'L'};
+static const uint32_t total_prob_state_byte_order = 0x01020304;
+
+/*
+ * The layout of the blob:
+ *   header:      TotalProbStateHeader
+ *   layers:      double layer_state[layer_state_size], see IsoLayeredGenerator::save_layer_state()
+ *   per element: int32 isotopeNo, int32 atomCnt, double atom_masses[isotopeNo], double atom_lProbs[isotopeNo]
+ *   excess:      double masses[no_excess], double probs[no_excess], int32 confs[no_excess*allDim] (if get_confs)
+ */
+struct TotalProbStateHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t flags;         // 1: optimize, 2: get_confs
+    int32_t dimNumber;
+    double t_prob_hint;
+    uint64_t envelope_confs_no;
+    uint64_t no_excess;
+    uint64_t layer_state_size;
+};
+
+TotalProbState::TotalProbState() :
+generator(nullptr),
+excess(),
+envelope_confs_no(0),
+t_prob_hint(0.9999),
+optimize(false),
+get_confs(false)
+{}
+
+std::string TotalProbState::save() const
+{
+    if(!is_set())
+        throw std::logic_error("The state was not set by FixedEnvelope::FromTotalProb()");
+
+    std::string blob;
+    auto put = [&](const void* src, size_t bytes) { blob.append(reinterpret_cast<const char*>(src), bytes); };
+
+    TotalProbStateHeader header;
+    memcpy(header.magic, total_prob_state_magic, sizeof(total_prob_state_magic));
+    header.version = ISOSPEC_TOTAL_PROB_STATE_VERSION;
+    header.byte_order = total_prob_state_byte_order;
+    header.flags = (optimize ? 1 : 0) | (get_confs ? 2 : 0);
+    header.dimNumber = generator->getDimNumber();
+    header.t_prob_hint = t_prob_hint;
+    header.envelope_confs_no = envelope_confs_no;
+    header.no_excess = excess._confs_no;
+    std::vector<double> layer_state;
+    generator->save_layer_state(layer_state);
+    header.layer_state_size = layer_state.size();
+    put(&header, sizeof(header));
+    put(layer_state.data(), layer_state.size()*sizeof(double));
+
+    for(int ii = 0; ii < header.dimNumber; ii++)
+    {
+        const Marginal& m = generator->get_marginal(ii);
+        const int32_t sizes[2] = {m.get_isotopeNo(), m.get_atomCnt()};
+        put(sizes, sizeof(sizes));
+        put(m.get_atom_masses(), m.get_isotopeNo()*sizeof(double));
+        put(m.get_lProbs(), m.get_isotopeNo()*sizeof(double));
+    }
+
+    put(excess._masses, excess._confs_no*sizeof(double));
+    put(excess._probs, excess._confs_no*sizeof(double));
+    if(get_confs)
+        put(excess._confs, excess._confs_no*excess.allDimSizeofInt);
+
+    return blob;
+}
+
+TotalProbState TotalProbState::load(const std::string& blob)
+{
+    size_t pos = 0;
+    auto take = [&](void* dst, size_t bytes)
+    {
+        if(bytes > blob.size() - pos)
+            throw std::runtime_error("Truncated total probability state");
+        memcpy(dst, blob.data() + pos, bytes);
+        pos += bytes;
+    };
+
+    TotalProbStateHeader header;
+    take(&header, sizeof(header));
+    if(memcmp(header.magic, total_prob_state_magic, sizeof(total_prob_state_magic)) != 0)
+        throw std::runtime_error("Not a total probability state");
+    if(header.byte_order != total_prob_state_byte_order)
+        throw std::runtime_error("The total probability state was saved on a machine with another byte order");
+    if(header.version != ISOSPEC_TOTAL_PROB_STATE_VERSION)
+        throw std::runtime_error("Unsupported version of the total probability state");
+    if(header.flags > 3 || header.dimNumber < 0 || !(header.t_prob_hint > 0.0 && header.t_prob_hint <= 1.0) ||
+       header.no_excess > blob.size() || header.layer_state_size > blob.size())
+        throw std::runtime_error("Corrupted total probability state");
+
+    std::vector<double> layer_state(header.layer_state_size);
+    take(layer_state.data(), layer_state.size()*sizeof(double));
+
+    Iso iso;
+    int allDim = 0;
+    std::vector<double> masses;
+    std::vector<double> lProbs;
+    for(int ii = 0; ii < header.dimNumber; ii++)
+    {
+        int32_t sizes[2];
+        take(sizes, sizeof(sizes));
+        if(sizes[0] <= 0 || sizes[1] < 0 || static_cast<size_t>(sizes[0]) > blob.size())
+            throw std::runtime_error("Corrupted total probability state");
+        masses.resize(sizes[0]);
+        lProbs.resize(sizes[0]);
+        take(masses.data(), sizes[0]*sizeof(double));
+        take(lProbs.data(), sizes[0]*sizeof(double));
+        try
+        {
+            iso.addElementLProbs(sizes[1], sizes[0], masses.data(), lProbs.data());
+        }
+        catch(std::logic_error&)
+        {
+            throw std::runtime_error("Corrupted total probability state");
+        }
+        allDim += sizes[0];
+    }
+
+    TotalProbState ret;
+    ret.envelope_confs_no = header.envelope_confs_no;
+    ret.t_prob_hint = header.t_prob_hint;
+    ret.optimize = (header.flags & 1) != 0;
+    ret.get_confs = (header.flags & 2) != 0;
+
+    const size_t no_excess = header.no_excess;
+    if(ret.get_confs)
+        ret.excess.reset_storage<true>(allDim);
+    else
+        ret.excess.reset_storage<false>(allDim);
+    ret.excess.slow_reallocate_memory((std::max)(no_excess, static_cast<size_t>(ISOSPEC_INIT_TABLE_SIZE)));
+    take(ret.excess._masses, no_excess*sizeof(double));
+    take(ret.excess._probs, no_excess*sizeof(double));
+    if(ret.get_confs)
+        take(ret.excess._confs, no_excess*ret.excess.allDimSizeofInt);
+    ret.excess._confs_no = no_excess;
+    // Point past the loaded configurations
+    ret.excess.slow_reallocate_memory(ret.excess.current_size);
+
+    if(pos != blob.size())
+        throw std::runtime_error("Corrupted total probability state");
+
+    try
+    {
+        ret.generator.reset(new IsoLayeredGenerator(std::move(iso), layer_state.data(), layer_state.size(), 1000, 1000, true, ret.t_prob_hint));
+    }
+    catch(std::invalid_argument&)
+    {
+        throw std::runtime_error("Corrupted total probability state");
+    }
+
+    return ret;
+}
+
 }  // namespace IsoSpec
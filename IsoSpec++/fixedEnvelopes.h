@@ -20,19 +20,39 @@
 #include <algorithm>
 #include <vector>
 #include <utility>
+#include <memory>
+#include <string>
 
 #include "isoSpec++.h"
 
+/*
+ * The layers of FixedEnvelope::FromTotalProb() aim at reaching the requested probability, but are sized to hold
+ * between these numbers of isotopologues (as estimated by IsoLayeredGenerator::plan_layer_offset()).
+ */
+#ifndef ISOSPEC_TOTAL_PROB_MIN_LAYER_CONFS
+#define ISOSPEC_TOTAL_PROB_MIN_LAYER_CONFS 1024
+#endif
+
+#ifndef ISOSPEC_TOTAL_PROB_MAX_LAYER_CONFS
+#define ISOSPEC_TOTAL_PROB_MAX_LAYER_CONFS 1048576
+#endif
+
 #ifdef DEBUG
 #define ISOSPEC_INIT_TABLE_SIZE 16
 #else
 #define ISOSPEC_INIT_TABLE_SIZE 1024
 #endif
 
+/*
+ * The version of the format of TotalProbState::save(). States saved with another version are rejected.
+ */
+#define ISOSPEC_TOTAL_PROB_STATE_VERSION 1
+
 namespace IsoSpec
 {
 
 class FixedEnvelope;
+class TotalProbState;
 
 double AbyssalWassersteinDistanceGrad(FixedEnvelope* const* envelopes, const double* scales, double* ret_gradient, size_t N, double abyss_depth_exp, double abyss_depth_the);
 
@@ -69,6 +89,7 @@ class ISOSPEC_EXPORT_SYMBOL FixedEnvelope {
 
     FixedEnvelope(const FixedEnvelope& other);
     FixedEnvelope(FixedEnvelope&& other);
+    FixedEnvelope& operator=(FixedEnvelope&& other);
 
     FixedEnvelope(double* masses, double* probs, size_t confs_no, bool masses_sorted = false, bool probs_sorted = false, double _total_prob = NAN);
 
@@ -149,6 +170,18 @@ class ISOSPEC_EXPORT_SYMBOL FixedEnvelope {
         _confs_no++;
     }
 
+    template<bool tgetConfs> ISOSPEC_FORCE_INLINE void copy_conf(const FixedEnvelope& other, size_t idx)
+    {
+        if(_confs_no == current_size)
+            reallocate_memory<tgetConfs>(current_size*2);
+
+        *tmasses = other._masses[idx]; tmasses++;
+        *tprobs  = other._probs[idx];  tprobs++;
+        constexpr_if(tgetConfs) { memcpy(tconfs, other._confs + idx*allDim, allDimSizeofInt); tconfs += allDim; }
+
+        _confs_no++;
+    }
+
     template<bool tgetConfs> ISOSPEC_FORCE_INLINE void swap(size_t idx1, size_t idx2, ISOSPEC_MAYBE_UNUSED int* conf_swapspace)
     {
         std::swap<double>(this->_probs[idx1],  this->_probs[idx2]);
@@ -165,9 +198,22 @@ class ISOSPEC_EXPORT_SYMBOL FixedEnvelope {
 
     template<bool tgetConfs> void reallocate_memory(size_t new_size);
     void slow_reallocate_memory(size_t new_size);
+    template<bool tgetConfs> void reset_storage(int _allDim);
+
+    template<bool tgetConfs> void threshold_init(IsoThresholdGenerator& generator);
+    template<bool tgetConfs> size_t quicktrim_parallel(size_t start, size_t end, double sum_to_start, double target_total_prob, unsigned int n_threads, FixedEnvelope* dropped = nullptr);
+    template<bool tgetConfs> void total_prob_layers(IsoLayeredGenerator& generator, double target_total_prob, bool optimize, unsigned int n_threads, TotalProbState* state,
+                                                    bool layer_open, size_t last_switch, double prob_at_last_switch, double prob_so_far);
+    template<bool tgetConfs> void total_prob_resume(TotalProbState& state, double target_total_prob, unsigned int n_threads);
 
  public:
-    template<bool tgetConfs> void threshold_init(Iso&& iso, double threshold, bool absolute);
+    template<bool tgetConfs> void threshold_init(Iso&& iso, double threshold, bool absolute, MarginalCache* cache = nullptr);
+
+    template<bool tgetConfs> void threshold_in_mass_range_init(Iso&& iso, double threshold, double mass_lower, double mass_upper, bool absolute);
+
+    template<bool tgetConfs> void threshold_init_parallel(Iso&& iso, double threshold, bool absolute, unsigned int n_threads);
+
+    template<bool tgetConfs> void threshold_mass_ordered_init(Iso&& iso, double threshold, bool absolute);
 
     template<bool tgetConfs, typename GenType = IsoLayeredGenerator> void addConfILG(const GenType& generator)
     {
@@ -178,39 +224,135 @@ class ISOSPEC_EXPORT_SYMBOL FixedEnvelope {
         this->_confs_no++;
     }
 
-    template<bool tgetConfs> void total_prob_init(Iso&& iso, double target_prob, bool trim);
+    template<bool tgetConfs> void total_prob_init(Iso&& iso, double target_prob, bool trim, unsigned int n_threads = 1, TotalProbState* state = nullptr);
+
+    //! The isotopologues above a threshold. If cache is not null, the marginals are taken from it (see IsoThresholdGenerator).
+    static FixedEnvelope FromThreshold(Iso&& iso, double threshold, bool absolute, bool tgetConfs = false, MarginalCache* cache = nullptr)
+    {
+        FixedEnvelope ret;
+
+        if(tgetConfs)
+            ret.threshold_init<true>(std::move(iso), threshold, absolute, cache);
+        else
+            ret.threshold_init<false>(std::move(iso), threshold, absolute, cache);
+        return ret;
+    }
+
+    inline static FixedEnvelope FromThreshold(const Iso& iso, double _threshold, bool _absolute, bool tgetConfs = false, MarginalCache* cache = nullptr)
+    {
+        return FromThreshold(Iso(iso, false), _threshold, _absolute, tgetConfs, cache);
+    }
+
+    //! Same as FromThreshold, but computed using n_threads threads (0: one per hardware thread). The result, including the order of the peaks, is identical.
+    static FixedEnvelope FromThresholdParallel(Iso&& iso, double threshold, bool absolute, bool tgetConfs = false, unsigned int n_threads = 0)
+    {
+        FixedEnvelope ret;
+
+        if(tgetConfs)
+            ret.threshold_init_parallel<true>(std::move(iso), threshold, absolute, n_threads);
+        else
+            ret.threshold_init_parallel<false>(std::move(iso), threshold, absolute, n_threads);
+        return ret;
+    }
+
+    inline static FixedEnvelope FromThresholdParallel(const Iso& iso, double _threshold, bool _absolute, bool tgetConfs = false, unsigned int n_threads = 0)
+    {
+        return FromThresholdParallel(Iso(iso, false), _threshold, _absolute, tgetConfs, n_threads);
+    }
+
+    //! Same as FromThreshold(), but the envelope is already sorted by mass (see IsoMassOrderedGenerator).
+    static FixedEnvelope FromThresholdMassOrdered(Iso&& iso, double threshold, bool absolute, bool tgetConfs = false)
+    {
+        FixedEnvelope ret;
+
+        if(tgetConfs)
+            ret.threshold_mass_ordered_init<true>(std::move(iso), threshold, absolute);
+        else
+            ret.threshold_mass_ordered_init<false>(std::move(iso), threshold, absolute);
+
+        return ret;
+    }
+
+    inline static FixedEnvelope FromThresholdMassOrdered(const Iso& iso, double _threshold, bool _absolute, bool tgetConfs = false)
+    {
+        return FromThresholdMassOrdered(Iso(iso, false), _threshold, _absolute, tgetConfs);
+    }
 
-    static FixedEnvelope FromThreshold(Iso&& iso, double threshold, bool absolute, bool tgetConfs = false)
+    //! Same as FromThreshold, but only the peaks with masses within [mass_lower, mass_upper] are computed.
+    static FixedEnvelope FromThresholdInMassRange(Iso&& iso, double threshold, double mass_lower, double mass_upper, bool absolute, bool tgetConfs = false)
     {
         FixedEnvelope ret;
 
         if(tgetConfs)
-            ret.threshold_init<true>(std::move(iso), threshold, absolute);
+            ret.threshold_in_mass_range_init<true>(std::move(iso), threshold, mass_lower, mass_upper, absolute);
         else
-            ret.threshold_init<false>(std::move(iso), threshold, absolute);
+            ret.threshold_in_mass_range_init<false>(std::move(iso), threshold, mass_lower, mass_upper, absolute);
         return ret;
     }
 
-    inline static FixedEnvelope FromThreshold(const Iso& iso, double _threshold, bool _absolute, bool tgetConfs = false)
+    inline static FixedEnvelope FromThresholdInMassRange(const Iso& iso, double _threshold, double _mass_lower, double _mass_upper, bool _absolute, bool tgetConfs = false)
     {
-        return FromThreshold(Iso(iso, false), _threshold, _absolute, tgetConfs);
+        return FromThresholdInMassRange(Iso(iso, false), _threshold, _mass_lower, _mass_upper, _absolute, tgetConfs);
     }
 
-    static FixedEnvelope FromTotalProb(Iso&& iso, double target_total_prob, bool optimize, bool tgetConfs = false)
+    //! The isotopologues needed to reach target_total_prob. If optimize is set, the fewest possible (an optimal p-set): the excess of the last layer is trimmed in n_threads threads (0: one per hardware thread).
+    /*!
+        If state is not null, it is set to what extend_total_prob() needs to extend the envelope later on.
+    */
+    static FixedEnvelope FromTotalProb(Iso&& iso, double target_total_prob, bool optimize, bool tgetConfs = false, unsigned int n_threads = 1, TotalProbState* state = nullptr)
     {
         FixedEnvelope ret;
 
         if(tgetConfs)
-            ret.total_prob_init<true>(std::move(iso), target_total_prob, optimize);
+            ret.total_prob_init<true>(std::move(iso), target_total_prob, optimize, n_threads, state);
         else
-            ret.total_prob_init<false>(std::move(iso), target_total_prob, optimize);
+            ret.total_prob_init<false>(std::move(iso), target_total_prob, optimize, n_threads, state);
 
         return ret;
     }
 
-    inline static FixedEnvelope FromTotalProb(const Iso& iso, double _target_total_prob, bool _optimize, bool tgetConfs = false)
+    inline static FixedEnvelope FromTotalProb(const Iso& iso, double _target_total_prob, bool _optimize, bool tgetConfs = false, unsigned int n_threads = 1, TotalProbState* state = nullptr)
     {
-        return FromTotalProb(Iso(iso, false), _target_total_prob, _optimize, tgetConfs);
+        return FromTotalProb(Iso(iso, false), _target_total_prob, _optimize, tgetConfs, n_threads, state);
+    }
+
+    //! Extend an envelope made by FromTotalProb() so that it reaches target_total_prob, continuing from where it stopped.
+    /*!
+        The configurations of the envelope are kept as they are, and the missing ones appended, with the optimize and
+        tgetConfs settings of FromTotalProb(). If optimizing, the result is again an optimal p-set: the one FromTotalProb()
+        would give for target_total_prob, up to the order of the configurations and the choice among equally probable
+        ones. A lower target_total_prob leaves the envelope as it is.
+        \param state The state set by FromTotalProb() (or loaded by TotalProbState::load()) for this very envelope,
+                     and by the previous extend_total_prob() calls. It is updated for further calls.
+        \param n_threads As in FromTotalProb().
+    */
+    void extend_total_prob(TotalProbState& state, double target_total_prob, unsigned int n_threads = 1);
+
+    template<bool tgetConfs> void topk_init(Iso&& iso, size_t k);
+
+    //! Get exactly the k most probable isotopologues (or all of them, if there are fewer).
+    /*!
+        A threshold giving somewhat more than k configurations is found by probing a single IsoThresholdGenerator
+        (see IsoThresholdGenerator::new_threshold()), starting from the sizes estimated by Iso::saveLogSizeModel().
+        The configurations above it are enumerated once and then trimmed to exactly k using quickselect. Ties at
+        the k-th probability are broken arbitrarily. Configurations less probable than DBL_MIN times the mode are
+        only returned if there are at most about 2k configurations in total. The configurations are not sorted.
+    */
+    static FixedEnvelope FromTopK(Iso&& iso, size_t k, bool tgetConfs = false)
+    {
+        FixedEnvelope ret;
+
+        if(tgetConfs)
+            ret.topk_init<true>(std::move(iso), k);
+        else
+            ret.topk_init<false>(std::move(iso), k);
+
+        return ret;
+    }
+
+    inline static FixedEnvelope FromTopK(const Iso& iso, size_t _k, bool tgetConfs = false)
+    {
+        return FromTopK(Iso(iso, false), _k, tgetConfs);
     }
 
     template<bool tgetConfs> void stochastic_init(Iso&& iso, size_t _no_molecules, double _precision, double _beta_bias);
@@ -232,13 +374,63 @@ class ISOSPEC_EXPORT_SYMBOL FixedEnvelope {
         return FromStochastic(Iso(iso, false), _no_molecules, _precision, _beta_bias, tgetConfs);
     }
 
-    static FixedEnvelope Binned(Iso&& iso, double target_total_prob, double bin_width, double bin_middle = 0.0);
-    static FixedEnvelope Binned(const Iso& iso, double target_total_prob, double bin_width, double bin_middle = 0.0)
+    //! The envelope of the configurations with total probability at least target_total_prob, binned by mass.
+    /*!
+        \param aggregate_fine_bins If positive, the marginals are aggregated by mass instead of enumerated, with this many
+               fine-structure bins per nominal mass (see IsoLayeredGenerator). Much faster for molecules with very many atoms,
+               while the envelope stays the same up to the spread of masses within the fine-structure bins.
+    */
+    static FixedEnvelope Binned(Iso&& iso, double target_total_prob, double bin_width, double bin_middle = 0.0, int aggregate_fine_bins = 0);
+    static FixedEnvelope Binned(const Iso& iso, double target_total_prob, double bin_width, double bin_middle = 0.0, int aggregate_fine_bins = 0)
     {
-        return Binned(Iso(iso, false), target_total_prob, bin_width, bin_middle);
+        return Binned(Iso(iso, false), target_total_prob, bin_width, bin_middle, aggregate_fine_bins);
     }
 
     friend double AbyssalWassersteinDistanceGrad(FixedEnvelope* const* envelopes, const double* scales, double* ret_gradient, size_t N, double abyss_depth_exp, double abyss_depth_the);
+    friend class TotalProbState;
+};
+
+//! What FixedEnvelope::extend_total_prob() needs to extend an envelope made by FixedEnvelope::FromTotalProb().
+/*!
+    That is the IsoLayeredGenerator, at the end of the last layer it went through, and the configurations of that layer
+    which did not make it into the envelope. The state can be saved to a compact binary blob and loaded back, also in
+    another process: the blob holds the isotopes of the molecule and the thresholds of the layers, through which the
+    marginals are extended again, and the remaining configurations of the last layer, but not the envelope itself.
+*/
+class ISOSPEC_EXPORT_SYMBOL TotalProbState
+{
+ private:
+    std::unique_ptr<IsoLayeredGenerator> generator;
+    FixedEnvelope excess;
+    size_t envelope_confs_no;
+    double t_prob_hint;
+    bool optimize;
+    bool get_confs;
+
+    friend class FixedEnvelope;
+
+ public:
+    TotalProbState();
+    TotalProbState(TotalProbState&& other) = default;
+    TotalProbState& operator=(TotalProbState&& other) = default;
+
+    TotalProbState(const TotalProbState& other) = delete;
+    TotalProbState& operator=(const TotalProbState& other) = delete;
+
+    //! Has the state been set by FixedEnvelope::FromTotalProb()?
+    inline bool is_set() const { return generator != nullptr; }
+
+    //! The number of configurations of the last layer not included in the envelope.
+    inline size_t excess_confs_no() const { return excess.confs_no(); }
+
+    //! Save the state to a binary blob, in the byte order of the machine.
+    std::string save() const;
+
+    //! Load a state saved by save().
+    /*!
+        Throws std::runtime_error if the blob isn't a valid state of this version.
+    */
+    static TotalProbState load(const std::string& blob);
 };
 
 }  // namespace IsoSpec
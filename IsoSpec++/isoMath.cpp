@@ -12,6 +12,7 @@
 
 #include <cmath>
 #include <cstdlib>
+#include <algorithm>
 #include "isoMath.h"
 #include "platform.h"
 #include "btrd.h"
@@ -20,6 +21,8 @@ namespace IsoSpec
 {
 
 
+static const size_t lfact_blocks = (ISOSPEC_G_FACT_TABLE_SIZE + ISOSPEC_LFACT_BLOCK - 1) / ISOSPEC_LFACT_BLOCK;
+
 void release_g_lfact_table()
 {
 #if ISOSPEC_GOT_MMAN
@@ -27,6 +30,7 @@ void release_g_lfact_table()
 #else
     free(g_lfact_table);
 #endif
+    delete[] g_lfact_ready;
 }
 
 double* alloc_lfact_table()
@@ -42,6 +46,39 @@ double* alloc_lfact_table()
 }
 
 double* g_lfact_table = alloc_lfact_table();
+std::atomic<unsigned char>* g_lfact_ready = new std::atomic<unsigned char>[lfact_blocks]();
+
+double safe_lgamma(double x)
+{
+#if ISOSPEC_TEST_WE_ARE_ON_UNIX_YAY
+    int sign;
+    return lgamma_r(x, &sign);
+#else
+    return lgamma(x);
+#endif
+}
+
+double fill_lfact_block(int n)
+{
+    std::atomic<unsigned char>& ready = g_lfact_ready[n / ISOSPEC_LFACT_BLOCK];
+    unsigned char state = 0;
+
+    if(ready.compare_exchange_strong(state, 1, std::memory_order_acquire))
+    {
+        const int start = n - n % ISOSPEC_LFACT_BLOCK;
+        const int end = (std::min)(start + ISOSPEC_LFACT_BLOCK, ISOSPEC_G_FACT_TABLE_SIZE);
+        for(int ii = start; ii < end; ii++)
+            g_lfact_table[ii] = ii < 2 ? 0.0 : -safe_lgamma(ii+1);
+        ready.store(2, std::memory_order_release);
+        return g_lfact_table[n];
+    }
+
+    if(state == 2)
+        return g_lfact_table[n];
+
+    // Another thread is filling the block: don't wait for it
+    return -safe_lgamma(n+1);
+}
 
 
 double RationalApproximation(double t)
@@ -17,37 +17,68 @@
 #pragma once
 
 #include <cmath>
+#include <atomic>
 #include <random>
+#include "platform_incl.h"
 
 #if !defined(ISOSPEC_G_FACT_TABLE_SIZE)
 // 10M should be enough for anyone, right?
 // Actually, yes. If anyone tries to input a molecule that has more than 10M atoms,
 // he deserves to get an exception thrown in his face. OpenMS guys don't want to alloc
 // a table of 10M to memoize the necessary values though, use something smaller for them.
-  #if ISOSPEC_BUILDING_OPENMS
+// So does anyone else who defines ISOSPEC_SMALL_LFACT_TABLE (e.g. in memory-constrained containers).
+  #if ISOSPEC_BUILDING_OPENMS || ISOSPEC_SMALL_LFACT_TABLE
     #define ISOSPEC_G_FACT_TABLE_SIZE 1024
   #else
     #define ISOSPEC_G_FACT_TABLE_SIZE 1024*1024*10
   #endif
 #endif
 
+// With a small table, the log-factorials of larger numbers are computed from the Stirling series,
+// and there is no limit on the number of atoms
+#if ISOSPEC_BUILDING_OPENMS || ISOSPEC_SMALL_LFACT_TABLE
+  #define ISOSPEC_LFACT_TABLE_BOUNDED true
+#else
+  #define ISOSPEC_LFACT_TABLE_BOUNDED false
+#endif
+
+// The table is filled in blocks of this many entries (a cache line), each by a single thread
+#define ISOSPEC_LFACT_BLOCK 8
+
 namespace IsoSpec
 {
 
 extern double* g_lfact_table;
+extern std::atomic<unsigned char>* g_lfact_ready;  /*!< Per block of the table: 0 if empty, 1 if being filled, 2 if filled. */
+
+// lgamma, without the data race on the global signgam it sets on POSIX systems
+double safe_lgamma(double x);
+
+double fill_lfact_block(int n);
+
+// Accurate to the last bit or so for n >= 1024, where it is used
+static inline double minuslogFactorialStirling(int n)
+{
+    const double x = static_cast<double>(n);
+    const double inv = 1.0 / x;
+    const double inv2 = inv * inv;
+    // -log(n!) = -((n+1/2) log(n) - n + log(2 pi)/2 + 1/(12n) - 1/(360n^3) + 1/(1260n^5) - ...)
+    return -((x + 0.5) * log(x) - x + 0.91893853320467274178 + inv * (1.0/12.0 - inv2 * (1.0/360.0 - inv2 * (1.0/1260.0))));
+}
 
+// Safe to be called concurrently: the table entries are only read after their block is published
 static inline double minuslogFactorial(int n)
 {
     if (n < 2)
         return 0.0;
-    #if ISOSPEC_BUILDING_OPENMS
+    #if ISOSPEC_LFACT_TABLE_BOUNDED
     if (n >= ISOSPEC_G_FACT_TABLE_SIZE)
-        return -lgamma(n+1);
+        return minuslogFactorialStirling(n);
     #endif
-    if (g_lfact_table[n] == 0.0)
-        g_lfact_table[n] = -lgamma(n+1);
+    if (g_lfact_ready[n / ISOSPEC_LFACT_BLOCK].load(std::memory_order_acquire) == 2)
+        return g_lfact_table[n];
 
-    return g_lfact_table[n];
+    return fill_lfact_block(n);
 }
 
 const double pi = 3.14159265358979323846264338328;
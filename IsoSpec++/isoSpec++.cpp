@@ -34,13 +34,14 @@
 #include <cctype>
 #include "platform.h"
 #include "conf.h"
-#include "dirtyAllocator.h"
 #include "operators.h"
 #include "summator.h"
 #include "marginalTrek++.h"
 #include "misc.h"
 #include "element_tables.h"
 #include "fasta.h"
+#include "simd.h"
+#include "marginalCache.h"
 
 
 
@@ -323,13 +324,22 @@ marginals(nullptr)
 
 void Iso::addElement(int atomCount, int noIsotopes, const double* isotopeMasses, const double* isotopeProbabilities)
 {
-    Marginal* m = new Marginal(isotopeMasses, isotopeProbabilities, noIsotopes, atomCount);
-    realloc_append<int>(&isotopeNumbers, noIsotopes, dimNumber);
-    realloc_append<int>(&atomCounts, atomCount, dimNumber);
+    addMarginal(new Marginal(isotopeMasses, isotopeProbabilities, noIsotopes, atomCount));
+}
+
+void Iso::addElementLProbs(int atomCount, int noIsotopes, const double* isotopeMasses, const double* isotopeLProbs)
+{
+    addMarginal(new Marginal(Marginal::FromLProbs(isotopeMasses, isotopeLProbs, noIsotopes, atomCount)));
+}
+
+void Iso::addMarginal(Marginal* m)
+{
+    realloc_append<int>(&isotopeNumbers, m->get_isotopeNo(), dimNumber);
+    realloc_append<int>(&atomCounts, m->get_atomCnt(), dimNumber);
     realloc_append<Marginal*>(&marginals, m, dimNumber);
     dimNumber++;
     confSize += sizeof(int);
-    allDim += noIsotopes;
+    allDim += m->get_isotopeNo();
 }
 
 void Iso::saveMarginalLogSizeEstimates(double* priorities, double target_total_prob) const
@@ -352,6 +362,37 @@ void Iso::saveMarginalLogSizeEstimates(double* priorities, double target_total_p
         priorities[ii] = marginals[ii]->getLogSizeEstimate(log_R2);
 }
 
+void Iso::saveLogSizeModel(double* log_coeff, double* exponent) const
+{
+    // The isotopologues at most d below the mode lie (roughly) in the product of the Gaussian ellipsoids of the marginals,
+    // of squared radius 2d: its volume, with K degrees of freedom, is proportional to d^(K/2)
+    double degrees_of_freedom = 0.0;
+    double coeff = 0.0;
+    for(int ii = 0; ii < dimNumber; ii++)
+        // The elements with a single subisotopologue (one isotope, or no atoms) add no degrees of freedom
+        if(marginals[ii]->get_isotopeNo() > 1 && marginals[ii]->get_atomCnt() > 0)
+        {
+            const double k = marginals[ii]->get_isotopeNo() - 1;
+            // Undo the volume of the unit ball in k dimensions, taken into account below for all the K dimensions at once
+            coeff += marginals[ii]->getLogSizeEstimate(0.0) + safe_lgamma(k * 0.5 + 1.0) - k * 0.5 * logpi;
+            degrees_of_freedom += k;
+        }
+    *exponent = degrees_of_freedom * 0.5;
+    *log_coeff = coeff + *exponent * (logpi + log(2.0)) - safe_lgamma(*exponent + 1.0);
+}
+
+double Iso::getLogConfsNo() const
+{
+    double ret = 0.0;
+    for(int ii = 0; ii < dimNumber; ii++)
+    {
+        const double i = static_cast<double>(marginals[ii]->get_isotopeNo());
+        const double n = static_cast<double>(marginals[ii]->get_atomCnt());
+        ret += safe_lgamma(n+i) - safe_lgamma(n+1.0) - safe_lgamma(i);
+    }
+    return ret;
+}
+
 unsigned int parse_formula(const char* formula, std::vector<double>& isotope_masses, std::vector<double>& isotope_probabilities, int** isotopeNumbers, int** atomCounts, unsigned int* confSize, bool use_nominal_masses)
 {
     // This function is NOT guaranteed to be secure against malicious input. It should be used only for debugging.
@@ -475,24 +516,17 @@ IsoGenerator::~IsoGenerator()
 
 static const double minsqrt = -1.3407796239501852e+154;  // == constexpr(-sqrt(std::numeric_limits<double>::max()));
 
-IsoThresholdGenerator::IsoThresholdGenerator(Iso&& iso, double _threshold, bool _absolute, int tabSize, int hashSize, bool reorder_marginals)
-: IsoGenerator(std::move(iso)),
-Lcutoff(_threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_threshold) + mode_lprob))
+// The common setup of the marginals of IsoThresholdGenerator, IsoThresholdInMassRangeGenerator and IsoMassOrderedGenerator:
+// precalculates the subisotopologues above Lcutoff of each marginal. Returns whether any of the marginals is empty.
+static bool precalculate_marginals(Marginal** marginals, int dimNumber, double Lcutoff, double mode_lprob, bool sort, int tabSize, int hashSize, PrecalculatedMarginal** marginalResultsUnsorted)
 {
-    counter = new int[dimNumber];
-    maxConfsLPSum = new double[dimNumber-1];
-    marginalResultsUnsorted = new PrecalculatedMarginal*[dimNumber];
-
-    empty = false;
-
-    const bool marginalsNeedSorting = doMarginalsNeedSorting();
+    bool empty = false;
 
     for(int ii = 0; ii < dimNumber; ii++)
     {
-        counter[ii] = 0;
         marginalResultsUnsorted[ii] = new PrecalculatedMarginal(std::move(*(marginals[ii])),
                                                         Lcutoff - mode_lprob + marginals[ii]->fastGetModeLProb(),
-                                                        marginalsNeedSorting,
+                                                        sort,
                                                         tabSize,
                                                         hashSize);
 
@@ -500,38 +534,209 @@ Lcutoff(_threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_thresh
             empty = true;
     }
 
-    if(reorder_marginals && dimNumber > 1)
+    return empty;
+}
+
+// Orders the marginals by decreasing size, if requested: marginalOrder maps the original indices to the new ones. Otherwise
+// marginalResults is marginalResultsUnsorted and marginalOrder is nullptr.
+template<typename MarginalType> static void order_marginals(MarginalType** marginalResultsUnsorted, int dimNumber, bool reorder_marginals, MarginalType*** marginalResults, int** marginalOrder)
+{
+    if(!reorder_marginals || dimNumber <= 1)
     {
-        OrderMarginalsBySizeDecresing<PrecalculatedMarginal> comparator(marginalResultsUnsorted);
-        int* tmpMarginalOrder = new int[dimNumber];
+        *marginalResults = marginalResultsUnsorted;
+        *marginalOrder = nullptr;
+        return;
+    }
+
+    OrderMarginalsBySizeDecresing<PrecalculatedMarginal> comparator(marginalResultsUnsorted);
+    std::unique_ptr<int[]> tmpMarginalOrder(new int[dimNumber]);
+
+    for(int ii = 0; ii < dimNumber; ii++)
+        tmpMarginalOrder[ii] = ii;
+
+    std::sort(tmpMarginalOrder.get(), tmpMarginalOrder.get() + dimNumber, comparator);
+    *marginalResults = new MarginalType*[dimNumber];
+
+    for(int ii = 0; ii < dimNumber; ii++)
+        (*marginalResults)[ii] = marginalResultsUnsorted[tmpMarginalOrder[ii]];
+
+    *marginalOrder = new int[dimNumber];
+    for(int ii = 0; ii < dimNumber; ii++)
+        (*marginalOrder)[tmpMarginalOrder[ii]] = ii;
+}
+
+IsoThresholdGenerator::IsoThresholdGenerator(Iso&& iso, double _threshold, bool _absolute, int tabSize, int hashSize, bool reorder_marginals, bool fuse_marginals, MarginalCache* _cache, bool compact_confs)
+: IsoGenerator(std::move(iso)),
+Lcutoff(_threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_threshold) + mode_lprob)),
+confOffsets(nullptr),
+depth(dimNumber),
+firstOwnedMarginal(_cache != nullptr ? dimNumber : 0),
+ownedResults(nullptr),
+cache(_cache),
+cacheTabSize(tabSize)
+{
+    counter = new int[dimNumber];
+    maxConfsLPSum = new double[dimNumber-1];
+    marginalResultsUnsorted = new const PrecalculatedMarginal*[dimNumber];
+
+    empty = false;
+
+    const bool marginalsNeedSorting = doMarginalsNeedSorting();
 
+    if(cache != nullptr)
+        cachedMarginals.resize(dimNumber);
+
+    memset(counter, 0, sizeof(int)*dimNumber);
+
+    std::unique_ptr<PrecalculatedMarginal*[]> precalculated;
+
+    if(cache != nullptr)
         for(int ii = 0; ii < dimNumber; ii++)
-            tmpMarginalOrder[ii] = ii;
+            marginalResultsUnsorted[ii] = get_cached_marginal(ii);
+    else
+    {
+        precalculated.reset(new PrecalculatedMarginal*[dimNumber]);
+        if(precalculate_marginals(marginals, dimNumber, Lcutoff, mode_lprob, marginalsNeedSorting, tabSize, hashSize, precalculated.get()))
+            empty = true;
+        std::copy(precalculated.get(), precalculated.get() + dimNumber, marginalResultsUnsorted);
+    }
 
-        std::sort(tmpMarginalOrder, tmpMarginalOrder + dimNumber, comparator);
-        marginalResults = new PrecalculatedMarginal*[dimNumber];
+    order_marginals(marginalResultsUnsorted, dimNumber, reorder_marginals, &marginalResults, &marginalOrder);
 
+    if(precalculated)
+    {
+        ownedResults = new PrecalculatedMarginal*[dimNumber];
         for(int ii = 0; ii < dimNumber; ii++)
-            marginalResults[ii] = marginalResultsUnsorted[tmpMarginalOrder[ii]];
+            ownedResults[marginalOrder != nullptr ? marginalOrder[ii] : ii] = precalculated[ii];
+    }
+
+    // Without sorting there is at most one marginal with more than one subisotopologue, and nothing to gain
+    if(fuse_marginals && ownedResults != nullptr && marginalOrder != nullptr && marginalsNeedSorting && !empty)
+        fuse_small_marginals();
+
+    if(compact_confs && ownedResults != nullptr)
+        for(int ii = 0; ii < depth; ii++)
+            ownedResults[ii]->compact_confs();
+
+    setup_search();
+}
+
+const PrecalculatedMarginal* IsoThresholdGenerator::get_cached_marginal(int idx)
+{
+    const double lCutOff = Lcutoff - mode_lprob + marginals[idx]->fastGetModeLProb();
+    cachedMarginals[idx] = cache->get(*marginals[idx], lCutOff, cacheTabSize);
+
+    // The cached marginal may hold subisotopologues below our cut-off, so inRange(0) is not enough
+    if(!cachedMarginals[idx]->inRange(0) || cachedMarginals[idx]->get_lProb(0) < lCutOff)
+        empty = true;
+
+    // Cached marginals are shared: we only read them (they are never retargeted, fused or deleted by us)
+    return cachedMarginals[idx].get();
+}
+
+#ifndef ISOSPEC_MAX_FUSED_MARGINAL_SIZE
+#define ISOSPEC_MAX_FUSED_MARGINAL_SIZE 4096
+#endif
+
+void IsoThresholdGenerator::fuse_small_marginals()
+{
+    // marginalResults are sorted by decreasing size. Replace the two smallest ones by their joint
+    // distribution for as long as its table is not too large, and the largest marginal is left alone.
+    while(depth > 2 && static_cast<size_t>(marginalResults[depth-2]->get_no_confs()) * marginalResults[depth-1]->get_no_confs() <= ISOSPEC_MAX_FUSED_MARGINAL_SIZE)
+    {
+        PrecalculatedMarginal* larger = ownedResults[depth-2];
+        PrecalculatedMarginal* smaller = ownedResults[depth-1];
+        PrecalculatedMarginal* fused = new FusedMarginal(larger, smaller, Lcutoff - mode_lprob + larger->getModeLProb() + smaller->getModeLProb());
+
+        if(confOffsets == nullptr)
+            confOffsets = new int[dimNumber]();
 
-        marginalOrder = new int[dimNumber];
         for(int ii = 0; ii < dimNumber; ii++)
-            marginalOrder[tmpMarginalOrder[ii]] = ii;
+            if(marginalResultsUnsorted[ii] == smaller)
+            {
+                marginalResultsUnsorted[ii] = fused;
+                confOffsets[ii] += larger->get_isotopeNo();
+            }
+            else if(marginalResultsUnsorted[ii] == larger)
+                marginalResultsUnsorted[ii] = fused;
 
-        delete[] tmpMarginalOrder;
+        depth--;
+        marginalResults[depth-1] = fused;
+        ownedResults[depth-1] = fused;
+
+        for(int ii = depth-1; ii > 0 && marginalResults[ii]->get_no_confs() > marginalResults[ii-1]->get_no_confs(); ii--)
+        {
+            std::swap(marginalResults[ii], marginalResults[ii-1]);
+            std::swap(ownedResults[ii], ownedResults[ii-1]);
+        }
+
+        if(!fused->inRange(0))
+            empty = true;
+    }
+
+    if(confOffsets != nullptr)
+        for(int ii = 0; ii < dimNumber; ii++)
+            marginalOrder[ii] = std::find(marginalResults, marginalResults + depth, marginalResultsUnsorted[ii]) - marginalResults;
+}
+
+IsoThresholdGenerator::IsoThresholdGenerator(const IsoThresholdGenerator& parent, const int* ranges, int no_ranges)
+: IsoGenerator(Iso(parent, false)),
+Lcutoff(parent.Lcutoff),
+confOffsets(array_copy_nptr<int>(parent.confOffsets, dimNumber)),
+depth(parent.depth),
+firstOwnedMarginal(depth - no_ranges),
+ownedResults(nullptr),
+cache(nullptr),
+cacheTabSize(parent.cacheTabSize)
+{
+    counter = new int[dimNumber];
+    maxConfsLPSum = new double[dimNumber-1];
+    marginalResults = new const PrecalculatedMarginal*[dimNumber];
+
+    empty = parent.empty;
+
+    for(int ii = 0; ii < depth; ii++)
+    {
+        counter[ii] = 0;
+        if(ii < firstOwnedMarginal)
+            marginalResults[ii] = parent.marginalResults[ii];
+        else
+        {
+            const int* range = ranges + 2*(ii - firstOwnedMarginal);
+            marginalResults[ii] = new PrecalculatedMarginal(*parent.marginalResults[ii], range[0], range[1]);
+            if(!marginalResults[ii]->inRange(0))
+                empty = true;
+        }
+    }
+
+    if(parent.marginalOrder != nullptr)
+    {
+        marginalOrder = array_copy<int>(parent.marginalOrder, dimNumber);
+        marginalResultsUnsorted = new const PrecalculatedMarginal*[dimNumber];
+        for(int ii = 0; ii < dimNumber; ii++)
+            marginalResultsUnsorted[ii] = marginalResults[marginalOrder[ii]];
     }
     else
     {
-        marginalResults = marginalResultsUnsorted;
+        marginalResultsUnsorted = marginalResults;
         marginalOrder = nullptr;
     }
 
+    setup_search();
+}
+
+void IsoThresholdGenerator::setup_search()
+{
     lProbs_ptr_start = marginalResults[0]->get_lProbs_ptr();
 
-    if(dimNumber > 1)
+    partialLProbs[depth] = 0.0;
+    partialMasses[depth] = 0.0;
+    partialProbs[depth] = 1.0;
+
+    if(depth > 1)
         maxConfsLPSum[0] = marginalResults[0]->fastGetModeLProb();
 
-    for(int ii = 1; ii < dimNumber-1; ii++)
+    for(int ii = 1; ii < depth-1; ii++)
         maxConfsLPSum[ii] = maxConfsLPSum[ii-1] + marginalResults[ii]->fastGetModeLProb();
 
     lProbs_ptr = lProbs_ptr_start;
@@ -541,7 +746,7 @@ Lcutoff(_threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_thresh
 
     if(!empty)
     {
-        recalc(dimNumber-1);
+        recalc(depth-1);
         counter[0]--;
         lProbs_ptr--;
     }
@@ -554,12 +759,12 @@ Lcutoff(_threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_thresh
 
 void IsoThresholdGenerator::terminate_search()
 {
-    for(int ii = 0; ii < dimNumber; ii++)
+    for(int ii = 0; ii < depth; ii++)
     {
         counter[ii] = marginalResults[ii]->get_no_confs()-1;
         partialLProbs[ii] = -std::numeric_limits<double>::infinity();
     }
-    partialLProbs[dimNumber] = -std::numeric_limits<double>::infinity();
+    partialLProbs[depth] = -std::numeric_limits<double>::infinity();
     lProbs_ptr = lProbs_ptr_start + marginalResults[0]->get_no_confs()-1;
 }
 
@@ -568,14 +773,15 @@ size_t IsoThresholdGenerator::count_confs()
     if(empty)
         return 0;
 
-    if(dimNumber == 1)
+    // Cached marginals may hold subisotopologues below the cut-off, which have to be skipped
+    if(depth == 1 && cache == nullptr)
         return marginalResults[0]->get_no_confs();
 
     const double* lProbs_ptr_l = marginalResults[0]->get_lProbs_ptr() + marginalResults[0]->get_no_confs();
 
-    std::unique_ptr<const double* []> lProbs_restarts(new const double*[dimNumber]);
+    std::unique_ptr<const double* []> lProbs_restarts(new const double*[depth]);
 
-    for(int ii = 0; ii < dimNumber; ii++)
+    for(int ii = 0; ii < depth; ii++)
         lProbs_restarts[ii] = lProbs_ptr_l;
 
     size_t count = 0;
@@ -590,7 +796,7 @@ size_t IsoThresholdGenerator::count_confs()
         int idx = 0;
         int * cntr_ptr = counter;
 
-        while(idx < dimNumber - 1)
+        while(idx < depth - 1)
         {
             *cntr_ptr = 0;
             idx++;
@@ -609,7 +815,7 @@ size_t IsoThresholdGenerator::count_confs()
                 break;
             }
         }
-        if(idx == dimNumber - 1)
+        if(idx == depth - 1)
         {
             reset();
             return count;
@@ -625,19 +831,325 @@ void IsoThresholdGenerator::reset()
         return;
     }
 
-    partialLProbs[dimNumber] = 0.0;
+    partialLProbs[depth] = 0.0;
 
-    memset(counter, 0, sizeof(int)*dimNumber);
-    recalc(dimNumber-1);
+    memset(counter, 0, sizeof(int)*depth);
+    recalc(depth-1);
     counter[0]--;
 
     lProbs_ptr = lProbs_ptr_start - 1;
 }
 
+void IsoThresholdGenerator::new_threshold(double _threshold, bool _absolute)
+{
+    Lcutoff = _threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_threshold) + mode_lprob);
+
+    empty = false;
+
+    if(cache != nullptr)
+        for(int ii = 0; ii < dimNumber; ii++)
+        {
+            const PrecalculatedMarginal* marginal = get_cached_marginal(ii);
+            marginalResultsUnsorted[ii] = marginal;
+            if(marginalOrder != nullptr)
+                marginalResults[marginalOrder[ii]] = marginal;
+        }
+    else if(ownedResults == nullptr)
+        throw std::logic_error("The threshold of a generator constructed from a part of another one cannot be changed");
+    else
+        for(int ii = 0; ii < depth; ii++)
+        {
+            ownedResults[ii]->retarget(Lcutoff - mode_lprob + ownedResults[ii]->getModeLProb());
+            if(!ownedResults[ii]->inRange(0))
+                empty = true;
+        }
+
+    lProbs_ptr_start = marginalResults[0]->get_lProbs_ptr();
+
+    if(empty)
+    {
+        terminate_search();
+        lcfmsv = std::numeric_limits<double>::infinity();
+    }
+    else
+        reset();
+}
+
 IsoThresholdGenerator::~IsoThresholdGenerator()
 {
     delete[] counter;
     delete[] maxConfsLPSum;
+    if (marginalResultsUnsorted != marginalResults)
+        delete[] marginalResultsUnsorted;
+    for(int ii = firstOwnedMarginal; ii < depth; ii++)
+        delete marginalResults[ii];
+    delete[] marginalResults;
+    if(ownedResults != nullptr)
+        delete[] ownedResults;
+    if(marginalOrder != nullptr)
+        delete[] marginalOrder;
+    if(confOffsets != nullptr)
+        delete[] confOffsets;
+}
+
+// The common body of IsoThresholdGenerator::fill() and IsoLayeredGenerator::fill(): the isotopologues which differ from the
+// current one only in the subisotopologue of the first marginal, and which we would visit next, form a contiguous run of the
+// first marginal, so we emit them in one go
+template<typename GenType> ISOSPEC_FORCE_INLINE size_t fill_runs(GenType& gen, double* masses, double* probs, double* lprobs, int* confs, size_t capacity)
+{
+    size_t ii = 0;
+
+    while(ii < capacity && gen.GenType::advanceToNextConfiguration())
+    {
+        const auto* marginal = gen.marginalResults[0];
+        const double* run_start = gen.lProbs_ptr;
+        const size_t offset = run_start - gen.lProbs_ptr_start;
+        const size_t max_run = std::min<size_t>(capacity - ii, marginal->get_no_confs() - offset);
+        const size_t run_len = 1 + simd_count_at_least(run_start + 1, max_run - 1, gen.lcfmsv);
+
+        if(masses != nullptr)
+            simd_add_scalar(marginal->get_masses_ptr() + offset, gen.partialMasses[1], masses + ii, run_len);
+        if(probs != nullptr)
+            simd_mul_scalar(marginal->get_probs_ptr() + offset, gen.partialProbs[1], probs + ii, run_len);
+        if(lprobs != nullptr)
+            simd_add_scalar(run_start, gen.partialLProbs_second_val, lprobs + ii, run_len);
+        if(confs != nullptr)
+            for(gen.lProbs_ptr = run_start; gen.lProbs_ptr < run_start + run_len; gen.lProbs_ptr++)
+            {
+                gen.GenType::get_conf_signature(confs);
+                confs += gen.allDim;
+            }
+
+        gen.lProbs_ptr = run_start + run_len - 1;
+        ii += run_len;
+    }
+
+    return ii;
+}
+
+size_t IsoThresholdGenerator::fill(double* _masses, double* _probs, double* _lprobs, int* _confs, size_t capacity)
+{
+    return fill_runs(*this, _masses, _probs, _lprobs, _confs, capacity);
+}
+
+// The common body of IsoThresholdGenerator::split_space() and IsoLayeredGenerator::split_layer(): splits the configurations of
+// the marginals above Lcutoff, never splitting the marginals below min_split_idx
+template<typename MarginalType> static size_t split_marginal_space(MarginalType* const* marginalResults, const double* maxConfsLPSum, int depth, double Lcutoff, int min_split_idx, size_t min_chunks, std::vector<int>& chunks, int* no_ranges)
+{
+    *no_ranges = 0;
+
+    // Prefixes of fixed indices of the outermost marginals (the outermost marginal first), together with the sums of their log-probabilities. We start with the single empty prefix, and extend
+    // the prefixes one marginal at a time as long as there are too few of them to produce min_chunks chunks.
+    std::vector<int> prefixes;
+    std::vector<double> prefix_lprobs(1, 0.0);
+    std::vector<unsigned int> valid_counts;
+    int no_fixed = 0;
+
+    while(true)
+    {
+        const int split_idx = depth - 1 - no_fixed;
+        const MarginalType* marginal = marginalResults[split_idx];
+        const double lcutoff_rest = split_idx > 0 ? Lcutoff - maxConfsLPSum[split_idx-1] : Lcutoff;
+
+        valid_counts.clear();
+        size_t total = 0;
+        for(size_t ii = 0; ii < prefix_lprobs.size(); ii++)
+        {
+            // The log-probabilities are sorted, and terminated with a -inf guardian
+            unsigned int cnt = 0;
+            while(marginal->get_lProb(cnt) + prefix_lprobs[ii] >= lcutoff_rest)
+                cnt++;
+            valid_counts.push_back(cnt);
+            total += cnt;
+        }
+
+        if(total >= min_chunks || split_idx <= min_split_idx)
+        {
+            // Split the valid part of marginal split_idx under each prefix into ranges of roughly equal length
+            const size_t step = std::max<size_t>(1, total / std::max<size_t>(1, min_chunks));
+            size_t no_chunks = 0;
+            *no_ranges = no_fixed + 1;
+            for(size_t ii = 0; ii < prefix_lprobs.size(); ii++)
+                for(size_t start = 0; start < valid_counts[ii]; start += step)
+                {
+                    chunks.push_back(static_cast<int>(start));
+                    chunks.push_back(static_cast<int>(std::min<size_t>(start + step, valid_counts[ii])));
+                    for(int jj = 0; jj < no_fixed; jj++)
+                    {
+                        const int idx = prefixes[ii*no_fixed + no_fixed - 1 - jj];
+                        chunks.push_back(idx);
+                        chunks.push_back(idx+1);
+                    }
+                    no_chunks++;
+                }
+            return no_chunks;
+        }
+
+        std::vector<int> new_prefixes;
+        std::vector<double> new_prefix_lprobs;
+        for(size_t ii = 0; ii < prefix_lprobs.size(); ii++)
+            for(unsigned int idx = 0; idx < valid_counts[ii]; idx++)
+            {
+                new_prefixes.insert(new_prefixes.end(), prefixes.begin() + ii*no_fixed, prefixes.begin() + (ii+1)*no_fixed);
+                new_prefixes.push_back(idx);
+                new_prefix_lprobs.push_back(prefix_lprobs[ii] + marginal->get_lProb(idx));
+            }
+        prefixes.swap(new_prefixes);
+        prefix_lprobs.swap(new_prefix_lprobs);
+        no_fixed++;
+    }
+}
+
+size_t IsoThresholdGenerator::split_space(size_t min_chunks, std::vector<int>& chunks, int* no_ranges) const
+{
+    *no_ranges = 0;
+
+    if(empty)
+        return 0;
+
+    return split_marginal_space(marginalResults, maxConfsLPSum, depth, Lcutoff, 0, min_chunks, chunks, no_ranges);
+}
+
+
+/*
+ * ------------------------------------------------------------------------------------------------------------------------
+ */
+
+
+IsoThresholdInMassRangeGenerator::IsoThresholdInMassRangeGenerator(Iso&& iso, double _threshold, double _mass_lower, double _mass_upper, bool _absolute, int tabSize, int hashSize, bool reorder_marginals)
+: IsoGenerator(std::move(iso)),
+Lcutoff(_threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_threshold) + mode_lprob)),
+massLower(_mass_lower),
+massUpper(_mass_upper)
+{
+    counter = new int[dimNumber];
+    maxConfsLPSum = new double[dimNumber];
+    minMassSum = new double[dimNumber];
+    maxMassSum = new double[dimNumber];
+    marginalResultsUnsorted = new PrecalculatedMarginal*[dimNumber];
+
+    empty = massLower > massUpper;
+
+    const bool marginalsNeedSorting = doMarginalsNeedSorting();
+
+    memset(counter, 0, sizeof(int)*dimNumber);
+
+    if(precalculate_marginals(marginals, dimNumber, Lcutoff, mode_lprob, marginalsNeedSorting, tabSize, hashSize, marginalResultsUnsorted))
+        empty = true;
+
+    order_marginals(marginalResultsUnsorted, dimNumber, reorder_marginals, &marginalResults, &marginalOrder);
+
+    lProbs_ptr_start = marginalResults[0]->get_lProbs_ptr();
+    masses_start = marginalResults[0]->get_masses_ptr();
+
+    double min_mass_acc = 0.0, max_mass_acc = 0.0, lprob_acc = 0.0;
+    for(int ii = 0; ii < dimNumber; ii++)
+    {
+        const PrecalculatedMarginal* marginal = marginalResults[ii];
+        if(marginal->get_no_confs() > 0)
+        {
+            const double* masses = marginal->get_masses_ptr();
+            min_mass_acc += *std::min_element(masses, masses + marginal->get_no_confs());
+            max_mass_acc += *std::max_element(masses, masses + marginal->get_no_confs());
+        }
+        lprob_acc += marginal->getModeLProb();
+        minMassSum[ii] = min_mass_acc;
+        maxMassSum[ii] = max_mass_acc;
+        maxConfsLPSum[ii] = lprob_acc;
+    }
+
+    // The bounds are sums computed in a different order than the actual masses, so they may be off by a few ulps:
+    // never prune subtrees that miss the window by less than that.
+    massSlack = (std::max)(fabs(massLower), fabs(massUpper)) * 1e-12 + 1e-12;
+
+    lProbs_ptr = lProbs_ptr_start - 1;
+
+    if(empty || !descend(dimNumber-1))
+    {
+        empty = true;
+        terminate_search();
+    }
+}
+
+bool IsoThresholdInMassRangeGenerator::descend(int idx)
+{
+    // A depth-first search through the tree of prefixes of the configurations (subisotopologues of the
+    // outermost marginals fixed), visiting subtrees in the same order as IsoThresholdGenerator would, and
+    // skipping those that have either too low probabilities or masses that cannot fall into the window.
+    while(idx > 0)
+    {
+        const PrecalculatedMarginal* marginal = marginalResults[idx];
+        bool found = false;
+
+        while(true)
+        {
+            const double lprob = partialLProbs[idx+1] + marginal->get_lProb(counter[idx]);
+            if(lprob + maxConfsLPSum[idx-1] < Lcutoff)
+                break;  // The subisotopologues are sorted, so all the following ones are too improbable too.
+
+            const double mass = partialMasses[idx+1] + marginal->get_mass(counter[idx]);
+            if(mass + minMassSum[idx-1] <= massUpper + massSlack && mass + maxMassSum[idx-1] >= massLower - massSlack)
+            {
+                partialLProbs[idx] = lprob;
+                partialMasses[idx] = mass;
+                partialProbs[idx] = partialProbs[idx+1] * marginal->get_prob(counter[idx]);
+                found = true;
+                break;
+            }
+
+            counter[idx]++;
+        }
+
+        if(found)
+        {
+            idx--;
+            counter[idx] = 0;
+        }
+        else
+        {
+            idx++;
+            if(idx >= dimNumber)
+                return false;
+            counter[idx]++;
+        }
+    }
+
+    lcfmsv = Lcutoff - partialLProbs[1];
+    lProbs_ptr = lProbs_ptr_start - 1;
+    return true;
+}
+
+bool IsoThresholdInMassRangeGenerator::carry()
+{
+    if(dimNumber == 1 || empty)
+    {
+        terminate_search();
+        return false;
+    }
+
+    counter[1]++;
+    if(descend(1))
+        return true;
+
+    empty = true;
+    terminate_search();
+    return false;
+}
+
+void IsoThresholdInMassRangeGenerator::terminate_search()
+{
+    for(int ii = 0; ii < dimNumber; ii++)
+        counter[ii] = static_cast<int>(marginalResults[ii]->get_no_confs())-1;
+    lcfmsv = std::numeric_limits<double>::infinity();
+    lProbs_ptr = lProbs_ptr_start + (static_cast<int>(marginalResults[0]->get_no_confs())-1);
+}
+
+IsoThresholdInMassRangeGenerator::~IsoThresholdInMassRangeGenerator()
+{
+    delete[] counter;
+    delete[] maxConfsLPSum;
+    delete[] minMassSum;
+    delete[] maxMassSum;
     if (marginalResultsUnsorted != marginalResults)
         delete[] marginalResultsUnsorted;
     dealloc_table(marginalResults, dimNumber);
@@ -651,12 +1163,224 @@ IsoThresholdGenerator::~IsoThresholdGenerator()
  */
 
 
-IsoLayeredGenerator::IsoLayeredGenerator(Iso&& iso, int tabSize, int hashSize, bool reorder_marginals, double t_prob_hint)
-: IsoGenerator(std::move(iso))
+IsoMassOrderedGenerator::IsoMassOrderedGenerator(Iso&& iso, double _threshold, bool _absolute, int tabSize, int hashSize, bool reorder_marginals)
+: IsoGenerator(std::move(iso)),
+Lcutoff(_threshold <= 0.0 ? minsqrt : (_absolute ? log(_threshold) : log(_threshold) + mode_lprob)),
+current_run(0),
+started(false)
+{
+    counter = new int[dimNumber];
+    maxConfsLPSum = new double[dimNumber];
+    marginalResultsUnsorted = new PrecalculatedMarginal*[dimNumber];
+
+    memset(counter, 0, sizeof(int)*dimNumber);
+
+    // The runs are found by binary search, so the marginals must always be sorted
+    const bool empty = precalculate_marginals(marginals, dimNumber, Lcutoff, mode_lprob, true, tabSize, hashSize, marginalResultsUnsorted);
+
+    order_marginals(marginalResultsUnsorted, dimNumber, reorder_marginals, &marginalResults, &marginalOrder);
+
+    double lprob_acc = 0.0;
+    for(int ii = 0; ii < dimNumber; ii++)
+    {
+        lprob_acc += marginalResults[ii]->getModeLProb();
+        maxConfsLPSum[ii] = lprob_acc;
+    }
+
+    // The subisotopologues of the first marginal, sorted by mass
+    const PrecalculatedMarginal* m0 = marginalResults[0];
+    m0_size = m0->get_no_confs();
+    m0_by_mass = new unsigned int[m0_size];
+    m0_masses = new double[m0_size];
+
+    for(unsigned int ii = 0; ii < m0_size; ii++)
+        m0_by_mass[ii] = ii;
+
+    std::sort(m0_by_mass, m0_by_mass + m0_size, [m0](unsigned int a, unsigned int b)
+              { return m0->get_mass(a) < m0->get_mass(b) || (m0->get_mass(a) == m0->get_mass(b) && a < b); });
+
+    for(unsigned int ii = 0; ii < m0_size; ii++)
+        m0_masses[ii] = m0->get_mass(m0_by_mass[ii]);
+
+    // As the first marginal is sorted by probability, the subisotopologues above the threshold within a run
+    // are those with indices below some value. The tree holds minimal indices over ranges of positions in
+    // m0_by_mass, so that the next such subisotopologue can be found in logarithmic time.
+    m0_tree_leaves = 1;
+    while(m0_tree_leaves < m0_size)
+        m0_tree_leaves *= 2;
+
+    m0_rank_tree = new unsigned int[2*m0_tree_leaves];
+    for(unsigned int ii = 0; ii < m0_tree_leaves; ii++)
+        m0_rank_tree[m0_tree_leaves + ii] = ii < m0_size ? m0_by_mass[ii] : (std::numeric_limits<unsigned int>::max)();
+    for(unsigned int ii = m0_tree_leaves - 1; ii > 0; ii--)
+        m0_rank_tree[ii] = (std::min)(m0_rank_tree[2*ii], m0_rank_tree[2*ii+1]);
+
+    if(!empty)
+        add_runs(dimNumber-1);
+
+    for(unsigned int ii = 0; ii < run_lengths.size(); ii++)
+        heap.push_back(ii);
+
+    auto cmp = [this](unsigned int a, unsigned int b) { return run_mass(a) > run_mass(b) || (run_mass(a) == run_mass(b) && a > b); };
+    std::make_heap(heap.data(), heap.data() + heap.size(), cmp);
+}
+
+/*
+ * Enumerate the combinations of subisotopologues of marginals 1..idx (the ones above idx being fixed by counter),
+ * pruned exactly as in IsoThresholdGenerator, and store a run for each.
+ */
+void IsoMassOrderedGenerator::add_runs(int idx)
+{
+    if(idx == 0)
+    {
+        const PrecalculatedMarginal* m0 = marginalResults[0];
+        const double lcfmsv = Lcutoff - partialLProbs[1];
+        const double* lProbs = m0->get_lProbs_ptr();
+
+        unsigned int length = std::lower_bound(lProbs, lProbs + m0->get_no_confs(), lcfmsv,
+                                               [](double lprob, double cutoff) { return lprob >= cutoff; }) - lProbs;
+        if(length == 0)
+            return;
+
+        run_lprobs.push_back(partialLProbs[1]);
+        run_masses.push_back(partialMasses[1]);
+        run_probs.push_back(partialProbs[1]);
+        run_lengths.push_back(length);
+        run_positions.push_back(next_in_run(0, length));
+        for(int ii = 1; ii < dimNumber; ii++)
+            run_counters.push_back(counter[ii]);
+        return;
+    }
+
+    const PrecalculatedMarginal* marginal = marginalResults[idx];
+
+    for(counter[idx] = 0; marginal->inRange(counter[idx]); counter[idx]++)
+    {
+        partialLProbs[idx] = partialLProbs[idx+1] + marginal->get_lProb(counter[idx]);
+        if(partialLProbs[idx] + maxConfsLPSum[idx-1] < Lcutoff)
+            break;
+        partialMasses[idx] = partialMasses[idx+1] + marginal->get_mass(counter[idx]);
+        partialProbs[idx] = partialProbs[idx+1] * marginal->get_prob(counter[idx]);
+        add_runs(idx-1);
+    }
+}
+
+unsigned int IsoMassOrderedGenerator::next_in_run(unsigned int pos, unsigned int run_length) const
+{
+    if(pos >= m0_size)
+        return m0_size;
+
+    // Usually the run continues right away
+    if(m0_by_mass[pos] < run_length)
+        return pos;
+
+    // Go up until there is a subtree to the right with a matching position...
+    unsigned int node = m0_tree_leaves + pos;
+    while(true)
+    {
+        if(node == 1)
+            return m0_size;
+        if((node & 1) == 0 && m0_rank_tree[node+1] < run_length)
+        {
+            node++;
+            break;
+        }
+        node >>= 1;
+    }
+
+    // ...and down to its leftmost one
+    while(node < m0_tree_leaves)
+    {
+        node *= 2;
+        if(m0_rank_tree[node] >= run_length)
+            node++;
+    }
+
+    return node - m0_tree_leaves;
+}
+
+bool IsoMassOrderedGenerator::advanceToNextConfiguration()
+{
+    auto cmp = [this](unsigned int a, unsigned int b) { return run_mass(a) > run_mass(b) || (run_mass(a) == run_mass(b) && a > b); };
+
+    if(started)
+    {
+        unsigned int pos = next_in_run(run_positions[current_run] + 1, run_lengths[current_run]);
+        if(pos < m0_size)
+        {
+            run_positions[current_run] = pos;
+            // Stay in the current run as long as it is not overtaken by another one
+            if(heap.empty() || !cmp(current_run, heap[0]))
+                return true;
+            heap.push_back(current_run);
+            std::push_heap(heap.data(), heap.data() + heap.size(), cmp);
+        }
+    }
+
+    if(heap.empty())
+        return false;
+
+    std::pop_heap(heap.data(), heap.data() + heap.size(), cmp);
+    current_run = heap.back();
+    heap.pop_back();
+    started = true;
+    return true;
+}
+
+void IsoMassOrderedGenerator::get_conf_signature(int* space) const
+{
+    const int* run_counter = run_counters.data() + static_cast<size_t>(current_run) * (dimNumber-1);
+    counter[0] = m0_by_mass[run_positions[current_run]];
+    for(int ii = 1; ii < dimNumber; ii++)
+        counter[ii] = run_counter[ii-1];
+
+    for(int ii = 0; ii < dimNumber; ii++)
+    {
+        int jj = marginalOrder != nullptr ? marginalOrder[ii] : ii;
+        memcpy(space, marginalResultsUnsorted[ii]->get_conf(counter[jj]), isotopeNumbers[ii]*sizeof(int));
+        space += isotopeNumbers[ii];
+    }
+}
+
+size_t IsoMassOrderedGenerator::count_confs() const
+{
+    size_t ret = 0;
+    for(size_t ii = 0; ii < run_lengths.size(); ii++)
+        ret += run_lengths[ii];
+    return ret;
+}
+
+IsoMassOrderedGenerator::~IsoMassOrderedGenerator()
+{
+    delete[] counter;
+    delete[] maxConfsLPSum;
+    delete[] m0_by_mass;
+    delete[] m0_masses;
+    delete[] m0_rank_tree;
+    if (marginalResultsUnsorted != marginalResults)
+        delete[] marginalResultsUnsorted;
+    dealloc_table(marginalResults, dimNumber);
+    if(marginalOrder != nullptr)
+        delete[] marginalOrder;
+}
+
+
+/*
+ * ------------------------------------------------------------------------------------------------------------------------
+ */
+
+
+IsoLayeredGenerator::IsoLayeredGenerator(Iso&& iso, int tabSize, int hashSize, bool reorder_marginals, double t_prob_hint, int aggregate_fine_bins)
+: IsoGenerator(std::move(iso)),
+ownsMarginals(true),
+firstMarginalLayerStart(0),
+restrictedLevel(dimNumber),
+restrictedEnd(0),
+observedDepth(0.0),
+observedConfs(0)
 {
     counter = new int[dimNumber];
     maxConfsLPSum = new double[dimNumber-1];
-    currentLThreshold = nextafter(mode_lprob, -std::numeric_limits<double>::infinity());
     lastLThreshold = (std::numeric_limits<double>::min)();
     marginalResultsUnsorted = new LayeredMarginal*[dimNumber];
     resetPositions = new const double*[dimNumber];
@@ -664,8 +1388,22 @@ IsoLayeredGenerator::IsoLayeredGenerator(Iso&& iso, int tabSize, int hashSize, b
 
     memset(counter, 0, sizeof(int)*dimNumber);
 
+    saveLogSizeModel(&logSizeCoeff, &gaussianExponent);
+    sizeExponent = gaussianExponent;
+
+    for(int ii = 0; ii < dimNumber; ii++)
+        marginalResultsUnsorted[ii] = new LayeredMarginal(std::move(*(marginals[ii])), tabSize, hashSize, aggregate_fine_bins);
+
+    // Summed in the same order as mode_lprob and getUnlikeliestPeakLProb(), so that they're equal without aggregation
+    modeLProb = 0.0;
+    unlikeliestLProb = 0.0;
     for(int ii = 0; ii < dimNumber; ii++)
-        marginalResultsUnsorted[ii] = new LayeredMarginal(std::move(*(marginals[ii])), tabSize, hashSize);
+    {
+        modeLProb += marginalResultsUnsorted[ii]->getModeLProb();
+        unlikeliestLProb += marginalResultsUnsorted[ii]->getLowestLProb();
+    }
+    currentLThreshold = nextafter(modeLProb, -std::numeric_limits<double>::infinity());
+
 
     if(reorder_marginals && dimNumber > 1)
     {
@@ -718,32 +1456,119 @@ IsoLayeredGenerator::IsoLayeredGenerator(Iso&& iso, int tabSize, int hashSize, b
     IsoLayeredGenerator::nextLayer(-0.00001);
 }
 
-bool IsoLayeredGenerator::nextLayer(double offset)
+IsoLayeredGenerator::IsoLayeredGenerator(Iso&& iso, const double* layer_state, size_t layer_state_size, int tabSize, int hashSize, bool reorder_marginals, double t_prob_hint)
+: IsoLayeredGenerator(std::move(iso), tabSize, hashSize, reorder_marginals, t_prob_hint)
 {
-    size_t first_mrg_size = marginalResults[0]->get_no_confs();
+    // Unless sorted, the order of the subisotopologues of the marginals depends on the thresholds they were extended
+    // to on the way, so the saved layers are entered one by one (only without walking through them)
+    if(layer_state_size < 5 || !(layer_state[3] >= 0.0) || layer_state[4] != layerThresholds[0])
+        throw std::invalid_argument("The layer state was not saved by a generator of this molecule");
+    for(size_t ii = 5; ii < layer_state_size; ii++)
+    {
+        // The layers past the end of the spectrum may be empty, with equal thresholds
+        if(!(layer_state[ii] <= currentLThreshold))
+            throw std::invalid_argument("The thresholds of the layer state increase");
+        enterLayer(layer_state[ii]);
+    }
+    skip_layer();
+    sizeExponent = layer_state[0];
+    logSizeCoeff = layer_state[1];
+    observedDepth = layer_state[2];
+    observedConfs = static_cast<size_t>(layer_state[3]);
+}
+
+void IsoLayeredGenerator::save_layer_state(std::vector<double>& layer_state) const
+{
+    layer_state = {sizeExponent, logSizeCoeff, observedDepth, static_cast<double>(observedConfs)};
+    layer_state.insert(layer_state.end(), layerThresholds.begin(), layerThresholds.end());
+}
+
+void IsoLayeredGenerator::skip_layer()
+{
+    // Past the last subisotopologue of every marginal, and with nothing acceptable in the first one
+    for(int ii = 0; ii < dimNumber; ii++)
+        counter[ii] = marginalResults[ii]->get_no_confs()-1;
+    lProbs_ptr = lProbs_ptr_start + marginalResults[0]->get_no_confs()-1;
+    lcfmsv = std::numeric_limits<double>::infinity();
+}
 
-    if(lastLThreshold < getUnlikeliestPeakLProb())
+bool IsoLayeredGenerator::nextLayer(double offset)
+{
+    if(lastLThreshold < unlikeliestLProb)
         return false;
 
+    enterLayer(currentLThreshold + offset);
+
+    return true;
+}
+
+void IsoLayeredGenerator::enterLayer(double new_threshold)
+{
+    size_t first_mrg_size = marginalResults[0]->get_no_confs();
+
     lastLThreshold = currentLThreshold;
-    currentLThreshold += offset;
+    currentLThreshold = new_threshold;
+    layerThresholds.push_back(new_threshold);
 
     for(int ii = 0; ii < dimNumber; ii++)
     {
-        marginalResults[ii]->extend(currentLThreshold - mode_lprob + marginalResults[ii]->fastGetModeLProb(), marginalsNeedSorting);
+        marginalResults[ii]->extend(currentLThreshold - modeLProb + marginalResults[ii]->fastGetModeLProb(), marginalsNeedSorting);
         counter[ii] = 0;
     }
 
     lProbs_ptr_start = marginalResults[0]->get_lProbs_ptr();  // vector relocation might have happened
 
+    firstMarginalLayerStart = static_cast<int>(first_mrg_size);
     lProbs_ptr = lProbs_ptr_start + first_mrg_size - 1;
 
     for(int ii = 0; ii < dimNumber; ii++)
         resetPositions[ii] = lProbs_ptr;
 
     recalc(dimNumber-1);
+}
 
-    return true;
+double IsoLayeredGenerator::plan_layer_offset(size_t confs_so_far, double target_confs)
+{
+    const double depth = modeLProb - currentLThreshold;
+    const double past_end = unlikeliestLProb - 1.0 - currentLThreshold;
+
+    if(sizeExponent <= 0.0)
+        // A single isotopologue
+        return past_end;
+
+    // Too few isotopologues to measure anything but the discreteness of the first layers
+    const size_t min_observed_confs = 64;
+
+    if(confs_so_far >= min_observed_confs && depth > observedDepth)
+    {
+        // The growth since the last measurement: it drops as the layers get close to the whole configuration space
+        // of small molecules, and rises in the tails of the rare isotopes (beyond the Gaussian approximation)
+        if(observedConfs >= min_observed_confs && depth > observedDepth * 1.01 && confs_so_far > observedConfs)
+        {
+            const double observed_exponent = log(static_cast<double>(confs_so_far) / static_cast<double>(observedConfs)) / log(depth / observedDepth);
+            sizeExponent = (std::min)((std::max)(observed_exponent, gaussianExponent * 0.25), gaussianExponent * 2.0);
+        }
+        logSizeCoeff = log(static_cast<double>(confs_so_far)) - sizeExponent * log(depth);
+        observedDepth = depth;
+        observedConfs = confs_so_far;
+    }
+
+    // Before the first measurement, only probe: the Gaussian approximation underestimates the tails of the rare isotopes by a lot
+    if(observedConfs == 0)
+        target_confs = (std::min)(target_confs, static_cast<double>(16 * min_observed_confs));
+
+    double next_depth = exp((log(static_cast<double>(confs_so_far) + target_confs) - logSizeCoeff) / sizeExponent);
+    if(next_depth <= depth)
+    {
+        // The estimate promised more isotopologues than there are down to here (typically the whole configuration
+        // space of a small molecule is smaller than the Gaussian approximation): scale it to the observed ones instead
+        logSizeCoeff = log((std::max)(static_cast<double>(confs_so_far), 1.0)) - sizeExponent * log(depth);
+        next_depth = exp((log(static_cast<double>(confs_so_far) + target_confs) - logSizeCoeff) / sizeExponent);
+    }
+    // Whatever the estimate, make progress
+    next_depth = (std::max)(next_depth, depth * (1.0 + 1e-9) + 1e-9);
+
+    return (std::max)(depth - next_depth, past_end);
 }
 
 bool IsoLayeredGenerator::carry()
@@ -760,6 +1585,8 @@ bool IsoLayeredGenerator::carry()
         idx++;
         cntr_ptr++;
         (*cntr_ptr)++;
+        if(idx >= restrictedLevel && (idx > restrictedLevel || *cntr_ptr >= restrictedEnd))
+            return false;  // The end of the slice
         partialLProbs[idx] = partialLProbs[idx+1] + marginalResults[idx]->get_lProb(counter[idx]);
         if(partialLProbs[idx] + maxConfsLPSum[idx-1] >= currentLThreshold)
         {
@@ -782,6 +1609,11 @@ bool IsoLayeredGenerator::carry()
 }
 
 
+size_t IsoLayeredGenerator::fill(double* _masses, double* _probs, double* _lprobs, int* _confs, size_t capacity)
+{
+    return fill_runs(*this, _masses, _probs, _lprobs, _confs, capacity);
+}
+
 void IsoLayeredGenerator::terminate_search()
 {
     for(int ii = 0; ii < dimNumber; ii++)
@@ -793,6 +1625,92 @@ void IsoLayeredGenerator::terminate_search()
     lProbs_ptr = lProbs_ptr_start + marginalResults[0]->get_no_confs()-1;
 }
 
+IsoLayeredGenerator::IsoLayeredGenerator(const IsoLayeredGenerator& parent, const int* ranges, int no_ranges)
+: IsoGenerator(Iso(parent, false)),
+currentLThreshold(parent.currentLThreshold),
+lastLThreshold(parent.lastLThreshold),
+modeLProb(parent.modeLProb),
+unlikeliestLProb(parent.unlikeliestLProb),
+marginalsNeedSorting(parent.marginalsNeedSorting),
+ownsMarginals(false),
+firstMarginalLayerStart(parent.firstMarginalLayerStart),
+restrictedLevel(no_ranges > 0 ? dimNumber - no_ranges : dimNumber),
+restrictedEnd(no_ranges > 0 ? ranges[1] : 0),
+gaussianExponent(parent.gaussianExponent),
+sizeExponent(parent.sizeExponent),
+logSizeCoeff(parent.logSizeCoeff),
+observedDepth(parent.observedDepth),
+observedConfs(parent.observedConfs)
+{
+    counter = new int[dimNumber];
+    maxConfsLPSum = array_copy<double>(parent.maxConfsLPSum, dimNumber-1);
+    resetPositions = new const double*[dimNumber];
+    marginalResults = array_copy<LayeredMarginal*>(parent.marginalResults, dimNumber);
+
+    if(parent.marginalOrder != nullptr)
+    {
+        marginalOrder = array_copy<int>(parent.marginalOrder, dimNumber);
+        marginalResultsUnsorted = array_copy<LayeredMarginal*>(parent.marginalResultsUnsorted, dimNumber);
+    }
+    else
+    {
+        marginalResultsUnsorted = marginalResults;
+        marginalOrder = nullptr;
+    }
+
+    memset(counter, 0, sizeof(int)*dimNumber);
+    for(int ii = 0; ii < no_ranges; ii++)
+        counter[restrictedLevel + ii] = ranges[2*ii];
+
+    lProbs_ptr_start = marginalResults[0]->get_lProbs_ptr();
+    partialLProbs_second = partialLProbs;
+    partialLProbs_second++;
+
+    // The slice is empty if its first prefix of the restricted marginals is too improbable: the rest of the range is even less probable
+    bool empty = false;
+    bool at_modes = true;
+    for(int ii = dimNumber-1; ii >= restrictedLevel && ii > 0; ii--)
+    {
+        partialLProbs[ii] = partialLProbs[ii+1] + marginalResults[ii]->get_lProb(counter[ii]);
+        if(partialLProbs[ii] + maxConfsLPSum[ii-1] < currentLThreshold)
+            empty = true;
+        if(counter[ii] != 0)
+            at_modes = false;
+    }
+
+    if(empty)
+    {
+        restrictedLevel = 0;
+        lcfmsv = std::numeric_limits<double>::infinity();
+        lProbs_ptr = lProbs_ptr_start - 1;
+        return;
+    }
+
+    recalc(dimNumber-1);
+
+    // Same as in nextLayer(), and, away from the modes of the restricted marginals, as carry() would get there
+    lProbs_ptr = lProbs_ptr_start + firstMarginalLayerStart - 1;
+    if(!at_modes)
+        while(*lProbs_ptr <= last_lcfmsv)
+            lProbs_ptr--;
+
+    for(int ii = 0; ii < dimNumber; ii++)
+        resetPositions[ii] = lProbs_ptr;
+}
+
+size_t IsoLayeredGenerator::split_layer(size_t min_chunks, std::vector<int>& chunks, int* no_ranges) const
+{
+    *no_ranges = 0;
+
+    // The innermost loop is not restricted, so the first marginal is never split
+    if(dimNumber == 1)
+    {
+        return 1;
+    }
+
+    return split_marginal_space(marginalResults, maxConfsLPSum, dimNumber, currentLThreshold, 1, min_chunks, chunks, no_ranges);
+}
+
 IsoLayeredGenerator::~IsoLayeredGenerator()
 {
     delete[] counter;
@@ -800,7 +1718,10 @@ IsoLayeredGenerator::~IsoLayeredGenerator()
     delete[] resetPositions;
     if (marginalResultsUnsorted != marginalResults)
         delete[] marginalResultsUnsorted;
-    dealloc_table(marginalResults, dimNumber);
+    if(ownsMarginals)
+        dealloc_table(marginalResults, dimNumber);
+    else
+        delete[] marginalResults;
     if(marginalOrder != nullptr)
       delete[] marginalOrder;
 }
@@ -811,8 +1732,9 @@ IsoLayeredGenerator::~IsoLayeredGenerator()
  */
 
 
-IsoOrderedGenerator::IsoOrderedGenerator(Iso&& iso, int _tabSize, int _hashSize) :
-IsoGenerator(std::move(iso), false), allocator(dimNumber, _tabSize)
+IsoOrderedGenerator::IsoOrderedGenerator(Iso&& iso, int _tabSize, int _hashSize, bool bucket_queue) :
+IsoGenerator(std::move(iso), false), bucketed(bucket_queue), current_bucket(0), queued(0), peak_queued(0),
+slotMasses(_tabSize), slotConfs(static_cast<size_t>(_tabSize) * dimNumber), topSlotSpent(false)
 {
     partialLProbs = &currentLProb;
     partialMasses = &currentMass;
@@ -834,21 +1756,19 @@ IsoGenerator(std::move(iso), false), allocator(dimNumber, _tabSize)
         marginalConfs[i] = &marginalResults[i]->confs();
     }
 
-    topConf = allocator.newConf();
-    memset(
-            reinterpret_cast<char*>(topConf) + sizeof(double),
-            0,
-            sizeof(int)*dimNumber
-    );
+    topSlot = newSlot();
+    int* topConf = slotConfs.data() + topSlot * dimNumber;
+    memset(topConf, 0, sizeof(int)*dimNumber);
 
-    *(reinterpret_cast<double*>(topConf)) =
-    combinedSum(
-                getConf(topConf),
-                logProbs,
-                dimNumber
-    );
+    // The only full sums: the other isotopologues are derived from their predecessors
+    slotMasses[topSlot] = combinedSum(topConf, masses, dimNumber);
+    bucket_top = combinedSum(topConf, logProbs, dimNumber);
 
-    pq.push(topConf);
+    const QueueEntry entry = { bucket_top, topSlot };
+    if(bucketed)
+        push<true>(entry);
+    else
+        push<false>(entry);
 }
 
 
@@ -866,50 +1786,133 @@ IsoOrderedGenerator::~IsoOrderedGenerator()
 
 bool IsoOrderedGenerator::advanceToNextConfiguration()
 {
-    if(pq.size() < 1)
+    return bucketed ? advance<true>() : advance<false>();
+}
+
+size_t IsoOrderedGenerator::newSlot()
+{
+    if(!freeSlots.empty())
+    {
+        const size_t slot = freeSlots.back();
+        freeSlots.pop_back();
+        return slot;
+    }
+
+    const size_t slot = slotMasses.size();
+    if(slot == slotMasses.capacity())
+    {
+        // Grow more slowly than the default doubling: the slots are most of the memory taken by long runs
+        const size_t new_capacity = slot + slot / 4 + 1;
+        slotMasses.reserve(new_capacity);
+        slotConfs.reserve(new_capacity * dimNumber);
+    }
+    slotMasses.resize(slot + 1);
+    slotConfs.resize((slot + 1) * dimNumber);
+    return slot;
+}
+
+template<bool bucket_queue> void IsoOrderedGenerator::push(const QueueEntry& entry)
+{
+    queued++;
+    if(queued > peak_queued)
+        peak_queued = queued;
+
+    if(!bucket_queue)
+    {
+        pq.push(entry);
+        return;
+    }
+
+    // Never before current_bucket, as the successors are not more probable than the visited isotopologue
+    const size_t bucket = static_cast<size_t>((bucket_top - entry.lprob) * (1.0 / ISOSPEC_ORDERED_BUCKET_WIDTH));
+    ISOSPEC_IMPOSSIBLE(bucket < current_bucket);
+
+    if(bucket >= buckets.size())
+        buckets.resize(bucket + 1);
+
+    buckets[bucket].push_back(entry);
+
+    if(bucket == current_bucket)
+        std::push_heap(buckets[bucket].begin(), buckets[bucket].end(), QueueEntryOrder());
+}
+
+template<bool bucket_queue> bool IsoOrderedGenerator::pop(QueueEntry& entry)
+{
+    if(queued == 0)
         return false;
+    queued--;
+
+    if(!bucket_queue)
+    {
+        entry = pq.top();
+        pq.pop();
+        return true;
+    }
+
+    while(current_bucket < buckets.size() && buckets[current_bucket].empty())
+    {
+        // Release the memory of the buckets already visited
+        std::vector<QueueEntry>().swap(buckets[current_bucket]);
+        current_bucket++;
+        if(current_bucket < buckets.size())
+            std::make_heap(buckets[current_bucket].begin(), buckets[current_bucket].end(), QueueEntryOrder());
+    }
 
+    std::vector<QueueEntry>& bucket = buckets[current_bucket];
+    std::pop_heap(bucket.begin(), bucket.end(), QueueEntryOrder());
+    entry = bucket.back();
+    bucket.pop_back();
+    return true;
+}
 
-    topConf = pq.top();
-    pq.pop();
+template<bool bucket_queue> bool IsoOrderedGenerator::advance()
+{
+    // The previous isotopologue had no successor to take over its slot, and get_conf_signature() is done with it
+    if(topSlotSpent)
+    {
+        freeSlots.push_back(topSlot);
+        topSlotSpent = false;
+    }
 
-    int* topConfIsoCounts = getConf(topConf);
+    QueueEntry top;
+    if(!pop<bucket_queue>(top))
+        return false;
 
-    currentLProb = *(reinterpret_cast<double*>(topConf));
-    currentMass = combinedSum( topConfIsoCounts, masses, dimNumber );
+    topSlot = top.slot;
+    currentLProb = top.lprob;
+    currentMass = slotMasses[topSlot];
     currentProb = exp(currentLProb);
 
     ccount = -1;
     for(int j = 0; j < dimNumber; ++j)
     {
-        if(marginalResults[j]->probeConfigurationIdx(topConfIsoCounts[j] + 1))
+        const int idx = slotConfs[topSlot * dimNumber + j];
+        if(marginalResults[j]->probeConfigurationIdx(idx + 1))
         {
+            // The successor differs from the current isotopologue in the j-th marginal only. The marginal
+            // log-probabilities are non-increasing, so the successor is never more probable
+            const QueueEntry successor = { currentLProb + ((*logProbs[j])[idx+1] - (*logProbs[j])[idx]), ccount == -1 ? topSlot : newSlot() };
+            slotMasses[successor.slot] = currentMass + ((*masses[j])[idx+1] - (*masses[j])[idx]);
+
             if(ccount == -1)
-            {
-                topConfIsoCounts[j]++;
-                *(reinterpret_cast<double*>(topConf)) = combinedSum(topConfIsoCounts, logProbs, dimNumber);
-                pq.push(topConf);
-                topConfIsoCounts[j]--;
+                // The current isotopologue's slot is taken over, and its counts updated once all successors are pushed
                 ccount = j;
-            }
             else
             {
-                void* acceptedCandidate = allocator.newConf();
-                int* acceptedCandidateIsoCounts = getConf(acceptedCandidate);
-                memcpy(acceptedCandidateIsoCounts, topConfIsoCounts, confSize);
-
-                acceptedCandidateIsoCounts[j]++;
-
-                *(reinterpret_cast<double*>(acceptedCandidate)) = combinedSum(acceptedCandidateIsoCounts, logProbs, dimNumber);
-
-                pq.push(acceptedCandidate);
+                int* successorConf = slotConfs.data() + successor.slot * dimNumber;
+                memcpy(successorConf, slotConfs.data() + topSlot * dimNumber, sizeof(int)*dimNumber);
+                successorConf[j]++;
             }
+
+            push<bucket_queue>(successor);
         }
-        if(topConfIsoCounts[j] > 0)
+        if(idx > 0)
             break;
     }
-    if(ccount >=0)
-        topConfIsoCounts[ccount]++;
+    if(ccount >= 0)
+        slotConfs[topSlot * dimNumber + ccount]++;
+    else
+        topSlotSpent = true;
 
     return true;
 }
@@ -21,17 +21,36 @@
 #include <limits>
 #include <string>
 #include <vector>
+#include <memory>
+#include <stdexcept>
 #include "platform.h"
-#include "dirtyAllocator.h"
+#include "pod_vector.h"
 #include "summator.h"
 #include "operators.h"
 #include "marginalTrek++.h"
 
 
 
+/*
+ * The number of chunks per thread the configuration space is split into by the parallel enumerations (see
+ * IsoThresholdGenerator::split_space()): the chunks differ in size, and the threads balance the load by taking them one by one.
+ */
+#ifndef ISOSPEC_CHUNKS_PER_THREAD
+#define ISOSPEC_CHUNKS_PER_THREAD 16
+#endif
+
+/*
+ * The width (in the log-probability space) of the buckets of the priority queue of IsoOrderedGenerator.
+ */
+#ifndef ISOSPEC_ORDERED_BUCKET_WIDTH
+#define ISOSPEC_ORDERED_BUCKET_WIDTH 0.01
+#endif
+
 namespace IsoSpec
 {
 
+class MarginalCache;
+
 // This function is NOT guaranteed to be secure against malicious input. It should be used only for debugging.
 unsigned int parse_formula(const char* formula,
                            std::vector<double>& isotope_masses,
@@ -69,6 +88,8 @@ class ISOSPEC_EXPORT_SYMBOL Iso {
 
     bool doMarginalsNeedSorting() const;
 
+    void addMarginal(Marginal* m);
+
  public:
     Iso();
 
@@ -171,8 +192,21 @@ class ISOSPEC_EXPORT_SYMBOL Iso {
     //! Add an element to the molecule. Note: this method can only be used BEFORE Iso is used to construct an IsoGenerator instance.
     void addElement(int atomCount, int noIsotopes, const double* isotopeMasses, const double* isotopeProbabilities);
 
+    //! Same as addElement(), but with the log-probabilities of the isotopes (see Marginal::get_lProbs()), which are taken exactly as they are.
+    void addElementLProbs(int atomCount, int noIsotopes, const double* isotopeMasses, const double* isotopeLProbs);
+
     //! Save estimates of logarithms of target sizes of marginals using Gaussian approximation into argument array. Array priorities must have length equal to dimNumber.
     void saveMarginalLogSizeEstimates(double* priorities, double target_total_prob) const;
+
+    /*!
+        Estimate the number of isotopologues at most d below the mode in log-probability as exp(*log_coeff) * d^(*exponent),
+        from the Gaussian approximations of the marginals (see Marginal::getLogSizeEstimate()). Must be called before
+        Iso is used to construct an IsoGenerator instance.
+    */
+    void saveLogSizeModel(double* log_coeff, double* exponent) const;
+
+    //! Get the logarithm of the number of all the isotopologues (with any probability, including zero).
+    double getLogConfsNo() const;
 };
 
 
@@ -223,6 +257,33 @@ class ISOSPEC_EXPORT_SYMBOL IsoGenerator : public Iso
 
     //! Destructor.
     virtual ~IsoGenerator();
+
+ protected:
+    //! The common body of the fill() methods of the subclasses.
+    /*!
+        The calls are statically bound to the methods of GenType, so no virtual dispatch happens in the loop.
+    */
+    template<typename GenType> ISOSPEC_FORCE_INLINE static size_t fill_impl(GenType& gen, double* masses, double* probs, double* lprobs, int* confs, size_t capacity)
+    {
+        const int allDim = gen.getAllDim();
+        size_t ii = 0;
+        while(ii < capacity && gen.GenType::advanceToNextConfiguration())
+        {
+            if(masses != nullptr)
+                masses[ii] = gen.GenType::mass();
+            if(probs != nullptr)
+                probs[ii] = gen.GenType::prob();
+            if(lprobs != nullptr)
+                lprobs[ii] = gen.GenType::lprob();
+            if(confs != nullptr)
+            {
+                gen.GenType::get_conf_signature(confs);
+                confs += allDim;
+            }
+            ii++;
+        }
+        return ii;
+    }
 };
 
 
@@ -232,14 +293,38 @@ class ISOSPEC_EXPORT_SYMBOL IsoGenerator : public Iso
     The subsequent isotopologues are generated with diminishing probability, starting from the mode.
     This algorithm take O(N*log(N)) to compute the N isotopologues because of using the Priority Queue data structure.
     Obtaining the N isotopologues can be achieved in O(N) if they are not required to be spit out in the descending order.
+
+    By default the priority queue is a monotone bucket queue: the isotopologues waiting to be visited are put in
+    buckets of log-probabilities ISOSPEC_ORDERED_BUCKET_WIDTH wide, and only the current (most probable) bucket
+    is kept as a heap. This relies on the successors of an isotopologue never being more probable than it.
 */
 class ISOSPEC_EXPORT_SYMBOL IsoOrderedGenerator: public IsoGenerator
 {
  private:
+    struct QueueEntry
+    {
+        double lprob;
+        size_t slot;                                                /*!< The index of the mass and the counts of the isotopologue in the slot arrays. */
+    };
+
+    struct QueueEntryOrder
+    {
+        inline bool operator()(const QueueEntry& a, const QueueEntry& b) const { return a.lprob < b.lprob; }
+    };
+
     MarginalTrek**              marginalResults;                    /*!< Table of pointers to marginal distributions of subisotopologues. */
-    std::priority_queue<void*, pod_vector<void*>, ConfOrder> pq;   /*!< The priority queue used to generate isotopologues ordered by descending probability. */
-    void*                       topConf;                            /*!< Most probable configuration. */
-    DirtyAllocator              allocator;                          /*!< Structure used for alocating memory for isotopologues. */
+    const bool                  bucketed;                           /*!< Is the bucket queue used instead of pq? */
+    std::priority_queue<QueueEntry, pod_vector<QueueEntry>, QueueEntryOrder> pq;   /*!< The priority queue used to generate isotopologues ordered by descending probability, unless bucketed. */
+    std::vector<std::vector<QueueEntry> > buckets;                  /*!< The bucket queue: the ii-th bucket holds log-probabilities in (top - (ii+1)*width, top - ii*width]. */
+    size_t                      current_bucket;                     /*!< The buckets before it are empty, and it is a heap. */
+    double                      bucket_top;                         /*!< The log-probability of the mode, where the buckets start. */
+    size_t                      queued;                             /*!< The number of isotopologues waiting to be visited. */
+    size_t                      peak_queued;                        /*!< The maximal value of queued so far. */
+    pod_vector<double>          slotMasses;                         /*!< The masses of the isotopologues waiting to be visited, and of the current one, by slot. */
+    pod_vector<int>             slotConfs;                          /*!< Their indices of the configurations of subisotopologues, dimNumber per slot. */
+    pod_vector<size_t>          freeSlots;                          /*!< The slots of the visited isotopologues, to be reused. */
+    size_t                      topSlot;                            /*!< The slot of the current isotopologue. */
+    bool                        topSlotSpent;                       /*!< Is topSlot to be freed on the next advance, having no successor to take it over? */
     const pod_vector<double>**  logProbs;                           /*!< Obtained log-probabilities. */
     const pod_vector<double>**  masses;                             /*!< Obtained masses. */
     const pod_vector<Conf>**    marginalConfs;                      /*!< Obtained counts of isotopes. */
@@ -254,6 +339,29 @@ class ISOSPEC_EXPORT_SYMBOL IsoOrderedGenerator: public IsoGenerator
 
     bool advanceToNextConfiguration() override final;
 
+    //! Advance through (at most) capacity subsequent isotopologues, storing their properties.
+    /*!
+        This is equivalent to calling advanceToNextConfiguration() followed by mass(), prob(), lprob() and
+        get_conf_signature() up to capacity times, but avoids the per-isotopologue overhead of virtual calls.
+        \param _masses Array of size capacity for the masses, or nullptr if those are not needed.
+        \param _probs Array of size capacity for the probabilities, or nullptr.
+        \param _lprobs Array of size capacity for the log-probabilities, or nullptr.
+        \param _confs Array of size capacity*getAllDim() for the isotope counts, or nullptr.
+        \param capacity The maximal number of isotopologues to store.
+        \return The number of stored isotopologues. Values less than capacity mean the generator is exhausted.
+    */
+    size_t fill(double* _masses, double* _probs, double* _lprobs, int* _confs, size_t capacity) { return fill_impl<IsoOrderedGenerator>(*this, _masses, _probs, _lprobs, _confs, capacity); }
+
+    //! The peak memory taken by the isotopologues waiting to be visited, in bytes.
+    /*!
+        This counts the slots of the isotopologues (which are recycled once visited) and the entries of the priority
+        queue, but not the marginal distributions.
+    */
+    inline size_t memory_high_water_mark() const
+    {
+        return slotMasses.capacity() * sizeof(double) + slotConfs.capacity() * sizeof(int) + freeSlots.capacity() * sizeof(size_t) + peak_queued * sizeof(QueueEntry);
+    }
+
     //! Save the counts of isotopes in the space.
     /*!
         \param space An array where counts of isotopes shall be written.
@@ -261,26 +369,32 @@ class ISOSPEC_EXPORT_SYMBOL IsoOrderedGenerator: public IsoGenerator
     */
     inline void get_conf_signature(int* space) const override final
     {
-        int* c = getConf(topConf);
-
-        if (ccount >= 0)
-            c[ccount]--;
+        // The slot has been taken over by the successor differing in the ccount-th marginal
+        const int* c = slotConfs.data() + topSlot * dimNumber;
 
         for(int ii = 0; ii < dimNumber; ii++)
         {
-            memcpy(space, marginalResults[ii]->confs()[c[ii]], isotopeNumbers[ii]*sizeof(int));
+            memcpy(space, marginalResults[ii]->confs()[c[ii] - (ii == ccount ? 1 : 0)], isotopeNumbers[ii]*sizeof(int));
             space += isotopeNumbers[ii];
         }
-
-        if (ccount >= 0)
-            c[ccount]++;
     };
 
     //! The move-contstructor.
-    IsoOrderedGenerator(Iso&& iso, int _tabSize  = 1000, int _hashSize = 1000);  // NOLINT(runtime/explicit) - constructor deliberately left to be used as a conversion
+    /*!
+        \param bucket_queue Should the bucket queue be used (see the class description)? If not, a binary heap of all
+                            the isotopologues waiting to be visited is. Both give the same isotopologues, in the same order
+                            up to ties.
+    */
+    IsoOrderedGenerator(Iso&& iso, int _tabSize  = 1000, int _hashSize = 1000, bool bucket_queue = true);  // NOLINT(runtime/explicit) - constructor deliberately left to be used as a conversion
 
     //! Destructor.
     virtual ~IsoOrderedGenerator();
+
+ private:
+    template<bool bucket_queue> bool advance();
+    template<bool bucket_queue> void push(const QueueEntry& entry);
+    template<bool bucket_queue> bool pop(QueueEntry& entry);
+    size_t newSlot();
 };
 
 
@@ -297,10 +411,17 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
  private:
     int*                    counter;            /*!< An array storing the position of an isotopologue in terms of the subisotopologues ordered by decreasing probability. */
     double*                 maxConfsLPSum;
-    const double            Lcutoff;            /*!< The logarithm of the lower bound on the calculated probabilities. */
-    PrecalculatedMarginal** marginalResults;
-    PrecalculatedMarginal** marginalResultsUnsorted;
+    double                  Lcutoff;            /*!< The logarithm of the lower bound on the calculated probabilities. */
+    const PrecalculatedMarginal** marginalResults;
+    const PrecalculatedMarginal** marginalResultsUnsorted;
     int* marginalOrder;
+    int* confOffsets;                           /*!< If marginals were fused: the offsets of the elements' isotope counts within the subisotopologues of the fused marginals. */
+    int depth;                                  /*!< The number of marginals iterated over: dimNumber, or less if some marginals were fused. */
+    int firstOwnedMarginal;                     /*!< Marginals below this index are borrowed from a parent generator and are not deleted by us. */
+    PrecalculatedMarginal** ownedResults;       /*!< The same marginals as marginalResults, which we may modify (retarget, fuse, compact): nullptr if some of them are shared (cached, or borrowed from a parent generator). */
+    MarginalCache* cache;
+    int cacheTabSize;                           /*!< The tabSize of the marginals computed by the cache for us. */
+    std::vector<std::shared_ptr<const PrecalculatedMarginal> > cachedMarginals;  /*!< Holds the marginals obtained from the cache (in the original order). */
 
     const double* lProbs_ptr;
     const double* lProbs_ptr_start;
@@ -315,12 +436,25 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
     inline void get_conf_signature(int* space) const override final
     {
         counter[0] = lProbs_ptr - lProbs_ptr_start;
-        if(marginalOrder != nullptr)
+        if(confOffsets != nullptr)
         {
             for(int ii = 0; ii < dimNumber; ii++)
             {
                 int jj = marginalOrder[ii];
-                memcpy(space, marginalResultsUnsorted[ii]->get_conf(counter[jj]), isotopeNumbers[ii]*sizeof(int));
+                // Fused marginals are never compact, so a compact one holds just this element
+                if(marginalResultsUnsorted[ii]->has_compact_confs())
+                    marginalResultsUnsorted[ii]->get_conf(counter[jj], space);
+                else
+                    memcpy(space, marginalResultsUnsorted[ii]->get_conf(counter[jj]) + confOffsets[ii], isotopeNumbers[ii]*sizeof(int));
+                space += isotopeNumbers[ii];
+            }
+        }
+        else if(marginalOrder != nullptr)
+        {
+            for(int ii = 0; ii < dimNumber; ii++)
+            {
+                int jj = marginalOrder[ii];
+                marginalResultsUnsorted[ii]->get_conf(counter[jj], space);
                 space += isotopeNumbers[ii];
             }
         }
@@ -328,7 +462,7 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
         {
             for(int ii = 0; ii < dimNumber; ii++)
             {
-                memcpy(space, marginalResultsUnsorted[ii]->get_conf(counter[ii]), isotopeNumbers[ii]*sizeof(int));
+                marginalResultsUnsorted[ii]->get_conf(counter[ii], space);
                 space += isotopeNumbers[ii];
             }
         }
@@ -342,8 +476,29 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
                          If false, the _threshold is the fraction of the heighest peak's probability.
         \param tabSize The size of the extension of the table with configurations.
         \param hashSize The size of the hash-table used to store subisotopologues and check if they have been already calculated.
+        \param reorder_marginals Should the marginals be internally reordered by decreasing size (this speeds up the search).
+        \param fuse_marginals Should the smallest marginals be replaced by their joint distribution, as long as it is small (this
+                              shortens the carries between marginals). Only used if reorder_marginals is true. The isotopologues
+                              are the same, but may be visited in a different order, and their probabilities may differ in
+                              the last bits, so this is off by default.
+        \param _cache If not null, the marginals are taken from (and stored in) this cache instead of being computed
+                      for this generator only. Such marginals are never fused.
+        \param compact_confs Should the subisotopologues be stored compactly (see PrecalculatedMarginal::compact_confs()).
+                             This cuts the memory used by large marginals, but makes get_conf_signature() slower.
+                             Not used for the marginals taken from the cache.
     */
-    IsoThresholdGenerator(Iso&& iso, double _threshold, bool _absolute = true, int _tabSize = 1000, int _hashSize = 1000, bool reorder_marginals = true);
+    IsoThresholdGenerator(Iso&& iso, double _threshold, bool _absolute = true, int _tabSize = 1000, int _hashSize = 1000, bool reorder_marginals = true, bool fuse_marginals = false, MarginalCache* _cache = nullptr, bool compact_confs = false);
+
+    //! Construct a generator walking through a part of the configuration space of another generator.
+    /*!
+        The marginal tables of parent are shared (read-only), so many such generators can be used
+        concurrently from different threads. The parent must outlive the constructed generator.
+        \param parent The generator whose configuration space is to be walked.
+        \param ranges Pairs of [start, end) indices restricting the last no_ranges marginals (in the
+                      internal, possibly reordered, marginal order), as produced by split_space().
+        \param no_ranges The number of restricted outermost marginals.
+    */
+    IsoThresholdGenerator(const IsoThresholdGenerator& parent, const int* ranges, int no_ranges);
 
     ~IsoThresholdGenerator();
 
@@ -365,7 +520,7 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
 
         int * cntr_ptr = counter;
 
-        while(idx < dimNumber-1)
+        while(idx < depth-1)
         {
             // counter[idx] = 0;
             *cntr_ptr = 0;
@@ -392,6 +547,11 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
     ISOSPEC_FORCE_INLINE double mass()  const override final { return partialMasses[1] + marginalResults[0]->get_mass(lProbs_ptr - lProbs_ptr_start); }
     ISOSPEC_FORCE_INLINE double prob()  const override final { return partialProbs[1] * marginalResults[0]->get_prob(lProbs_ptr - lProbs_ptr_start); }
 
+    //! Same as IsoOrderedGenerator::fill(), but emits whole runs of isotopologues differing only in the first marginal at once, using SIMD instructions if possible.
+    size_t fill(double* _masses, double* _probs, double* _lprobs, int* _confs, size_t capacity);
+
+    template<typename GenType> friend size_t fill_runs(GenType& gen, double* masses, double* probs, double* lprobs, int* confs, size_t capacity);
+
     //! Block the subsequent search of isotopologues.
     void terminate_search();
 
@@ -407,7 +567,28 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
      * and has undefined results (incl. segfaults) otherwise. */
     size_t count_confs();
 
+    /*! Change the threshold and reset the generator. The marginal distributions are not recalculated: if the threshold
+     * is raised they are only truncated, if it is lowered they are extended with the subisotopologues that are newly
+     * above the threshold. This makes repeated probing of different thresholds (eg. in a bisection search for a threshold
+     * giving a specified number of configurations) much cheaper than constructing new generators. Must not be called on
+     * generators constructed from a part of another one, nor while such generators constructed from this one are in use.
+     * \param _threshold The new threshold value.
+     * \param _absolute As in the constructor.
+     */
+    void new_threshold(double _threshold, bool _absolute = true);
+
+    /*! Split the configuration space into at least min_chunks (if possible) disjoint chunks, which together cover
+     * all the configurations. Each chunk is described by *no_ranges pairs of [start, end) indices restricting the
+     * outermost marginals, and is appended to chunks. The chunks are listed in the order in which this generator
+     * would visit them, so concatenating the output of generators constructed from consecutive chunks gives
+     * exactly the output of this generator. Returns the number of chunks. */
+    size_t split_space(size_t min_chunks, std::vector<int>& chunks, int* no_ranges) const;
+
  private:
+    void setup_search();
+    void fuse_small_marginals();
+    const PrecalculatedMarginal* get_cached_marginal(int idx);
+
     //! Recalculate the current partial log-probabilities, masses, and probabilities.
     ISOSPEC_FORCE_INLINE void recalc(int idx)
     {
@@ -434,6 +615,188 @@ class ISOSPEC_EXPORT_SYMBOL IsoThresholdGenerator: public IsoGenerator
 
 
 
+//! The generator of isotopologues above a given threshold value, restricted to a mass window.
+/*!
+    Visits the same isotopologues as IsoThresholdGenerator, in the same order, except for those with masses
+    outside of the [mass_lower, mass_upper] window. For each marginal the minimal and maximal masses of its
+    subisotopologues are known, so whole subtrees of the configuration space, whose attainable masses do not
+    intersect the window, are skipped without being visited. This makes the enumeration of a narrow window
+    of a large molecule much cheaper than enumerating all the peaks and filtering them.
+*/
+class ISOSPEC_EXPORT_SYMBOL IsoThresholdInMassRangeGenerator: public IsoGenerator
+{
+ private:
+    int*                    counter;            /*!< An array storing the position of an isotopologue in terms of the subisotopologues ordered by decreasing probability. */
+    double*                 maxConfsLPSum;
+    double*                 minMassSum;         /*!< minMassSum[ii] is the minimal mass attainable by marginals 0..ii. */
+    double*                 maxMassSum;         /*!< maxMassSum[ii] is the maximal mass attainable by marginals 0..ii. */
+    const double            Lcutoff;            /*!< The logarithm of the lower bound on the calculated probabilities. */
+    const double            massLower;          /*!< The lower end of the mass window. */
+    const double            massUpper;          /*!< The upper end of the mass window. */
+    double                  massSlack;          /*!< Safety margin for rounding errors in the subtree mass bounds. */
+    PrecalculatedMarginal** marginalResults;
+    PrecalculatedMarginal** marginalResultsUnsorted;
+    int* marginalOrder;
+
+    const double* lProbs_ptr;
+    const double* lProbs_ptr_start;
+    const double* masses_start;
+    double lcfmsv;
+    bool empty;
+
+ public:
+    IsoThresholdInMassRangeGenerator(const IsoThresholdInMassRangeGenerator& other) = delete;
+    IsoThresholdInMassRangeGenerator& operator=(const IsoThresholdInMassRangeGenerator& other) = delete;
+
+    inline void get_conf_signature(int* space) const override final
+    {
+        counter[0] = lProbs_ptr - lProbs_ptr_start;
+        if(marginalOrder != nullptr)
+        {
+            for(int ii = 0; ii < dimNumber; ii++)
+            {
+                int jj = marginalOrder[ii];
+                memcpy(space, marginalResultsUnsorted[ii]->get_conf(counter[jj]), isotopeNumbers[ii]*sizeof(int));
+                space += isotopeNumbers[ii];
+            }
+        }
+        else
+        {
+            for(int ii = 0; ii < dimNumber; ii++)
+            {
+                memcpy(space, marginalResultsUnsorted[ii]->get_conf(counter[ii]), isotopeNumbers[ii]*sizeof(int));
+                space += isotopeNumbers[ii];
+            }
+        }
+    };
+
+    //! The move-constructor.
+    /*!
+        \param iso An instance of the Iso class.
+        \param _threshold The threshold value, see IsoThresholdGenerator.
+        \param _mass_lower The lower bound on the masses of the generated isotopologues (inclusive).
+        \param _mass_upper The upper bound on the masses of the generated isotopologues (inclusive).
+        \param _absolute If true, the _threshold is interpreted as the absolute minimal peak height for the isotopologues.
+                         Otherwise, it is interpreted as a fraction of the height of the mode.
+        \param _tabSize The size of the extension of the table with configurations.
+        \param _hashSize The size of the hash-table used to store subisotopologues and check if they have been already calculated.
+        \param reorder_marginals Should the marginals be internally reordered, see IsoThresholdGenerator.
+    */
+    IsoThresholdInMassRangeGenerator(Iso&& iso, double _threshold, double _mass_lower, double _mass_upper, bool _absolute = true, int _tabSize = 1000, int _hashSize = 1000, bool reorder_marginals = true);
+
+    ~IsoThresholdInMassRangeGenerator();
+
+    ISOSPEC_FORCE_INLINE bool advanceToNextConfiguration() override final
+    {
+        while(true)
+        {
+            lProbs_ptr++;
+
+            if(ISOSPEC_LIKELY(*lProbs_ptr >= lcfmsv))
+            {
+                const double m = partialMasses[1] + masses_start[lProbs_ptr - lProbs_ptr_start];
+                if(massLower <= m && m <= massUpper)
+                    return true;
+            }
+            else if(!carry())
+                return false;
+        }
+    }
+
+    ISOSPEC_FORCE_INLINE double lprob() const override final { return partialLProbs[1] + (*(lProbs_ptr)); }
+    ISOSPEC_FORCE_INLINE double mass()  const override final { return partialMasses[1] + masses_start[lProbs_ptr - lProbs_ptr_start]; }
+    ISOSPEC_FORCE_INLINE double prob()  const override final { return partialProbs[1] * marginalResults[0]->get_prob(lProbs_ptr - lProbs_ptr_start); }
+
+    //! Same as IsoOrderedGenerator::fill().
+    size_t fill(double* _masses, double* _probs, double* _lprobs, int* _confs, size_t capacity) { return fill_impl<IsoThresholdInMassRangeGenerator>(*this, _masses, _probs, _lprobs, _confs, capacity); }
+
+    //! Block the subsequent search of isotopologues.
+    void terminate_search();
+
+ private:
+    //! Move to the next subtree (fixed subisotopologues of marginals 1..dimNumber-1) which may contain isotopologues in the window.
+    bool carry();
+
+    //! Starting from the current values of counter[idx..dimNumber-1], find the first subtree which may contain isotopologues in the window.
+    bool descend(int idx);
+};
+
+
+
+//! The generator of isotopologues above a given threshold value, sorted by ascending mass.
+/*!
+    Visits the same isotopologues as IsoThresholdGenerator, but in the order of ascending masses, so that they don't
+    have to be sorted afterwards. Each combination of subisotopologues of all the marginals but the first one (which is
+    the largest one, unless the marginals are not reordered) gives a run of isotopologues, which differ only in the
+    first marginal. The subisotopologues of the first marginal are kept sorted by mass, and the runs are merged using
+    a heap. This takes O(N*log(R)) time for N isotopologues in R runs, and R is usually much smaller than N.
+*/
+class ISOSPEC_EXPORT_SYMBOL IsoMassOrderedGenerator: public IsoGenerator
+{
+ private:
+    const double            Lcutoff;            /*!< The logarithm of the lower bound on the calculated probabilities. */
+    PrecalculatedMarginal** marginalResults;
+    PrecalculatedMarginal** marginalResultsUnsorted;
+    int*                    marginalOrder;
+    double*                 maxConfsLPSum;
+    int*                    counter;
+
+    unsigned int            m0_size;
+    unsigned int*           m0_by_mass;         /*!< Indices of the subisotopologues of the first marginal, sorted by mass. */
+    double*                 m0_masses;          /*!< Masses of the subisotopologues of the first marginal, sorted. */
+    unsigned int*           m0_rank_tree;       /*!< Minimum tree over m0_by_mass, used to skip the subisotopologues below the threshold. */
+    unsigned int            m0_tree_leaves;
+
+    pod_vector<double>      run_lprobs;         /*!< The log-probability of the outer marginals' part of each run. */
+    pod_vector<double>      run_masses;
+    pod_vector<double>      run_probs;
+    pod_vector<unsigned int> run_lengths;       /*!< The number of subisotopologues of the first marginal above the threshold in each run. */
+    pod_vector<unsigned int> run_positions;     /*!< The current position of each run in m0_by_mass. */
+    pod_vector<int>         run_counters;       /*!< The indices of the subisotopologues of the outer marginals of each run. */
+    pod_vector<unsigned int> heap;
+
+    unsigned int            current_run;
+    bool                    started;
+
+ public:
+    IsoMassOrderedGenerator(const IsoMassOrderedGenerator& other) = delete;
+    IsoMassOrderedGenerator& operator=(const IsoMassOrderedGenerator& other) = delete;
+
+    //! The move-constructor.
+    /*!
+        \param iso An instance of the Iso class.
+        \param _threshold The threshold value.
+        \param _absolute If true, the _threshold is interpreted as the absolute minimal peak height for the isotopologues.
+                         If false, the _threshold is the fraction of the heighest peak's probability.
+        \param tabSize The size of the extension of the table with configurations.
+        \param hashSize The size of the hash-table used to store subisotopologues and check if they have been already calculated.
+        \param reorder_marginals Should the largest marginal be moved to the first position?
+    */
+    IsoMassOrderedGenerator(Iso&& iso, double _threshold, bool _absolute = true, int _tabSize = 1000, int _hashSize = 1000, bool reorder_marginals = true);
+
+    ~IsoMassOrderedGenerator();
+
+    bool advanceToNextConfiguration() override final;
+
+    ISOSPEC_FORCE_INLINE double lprob() const override final { return run_lprobs[current_run] + marginalResults[0]->get_lProb(m0_by_mass[run_positions[current_run]]); }
+    ISOSPEC_FORCE_INLINE double mass()  const override final { return run_masses[current_run] + m0_masses[run_positions[current_run]]; }
+    ISOSPEC_FORCE_INLINE double prob()  const override final { return run_probs[current_run] * marginalResults[0]->get_prob(m0_by_mass[run_positions[current_run]]); }
+
+    void get_conf_signature(int* space) const override final;
+
+    //! Same as IsoOrderedGenerator::fill().
+    size_t fill(double* _masses, double* _probs, double* _lprobs, int* _confs, size_t capacity) { return fill_impl<IsoMassOrderedGenerator>(*this, _masses, _probs, _lprobs, _confs, capacity); }
+
+    //! Count the number of configurations in the distribution. Does not change the state of the generator.
+    size_t count_confs() const;
+
+ private:
+    void add_runs(int idx);
+    unsigned int next_in_run(unsigned int pos, unsigned int run_length) const;
+
+    ISOSPEC_FORCE_INLINE double run_mass(unsigned int run) const { return run_masses[run] + m0_masses[run_positions[run]]; }
+};
+
 
 
 class ISOSPEC_EXPORT_SYMBOL IsoLayeredGenerator : public IsoGenerator
@@ -442,6 +805,8 @@ class ISOSPEC_EXPORT_SYMBOL IsoLayeredGenerator : public IsoGenerator
     int*                    counter;            /*!< An array storing the position of an isotopologue in terms of the subisotopologues ordered by decreasing probability. */
     double*                 maxConfsLPSum;
     double currentLThreshold, lastLThreshold;
+    double modeLProb;           /*!< The sum of the modes of the marginals: differs from mode_lprob when they are aggregated. */
+    double unlikeliestLProb;    /*!< The sum of the lowest log-probabilities of the marginals. */
     LayeredMarginal** marginalResults;
     LayeredMarginal** marginalResultsUnsorted;
     int* marginalOrder;
@@ -452,6 +817,16 @@ class ISOSPEC_EXPORT_SYMBOL IsoLayeredGenerator : public IsoGenerator
     double* partialLProbs_second;
     double partialLProbs_second_val, lcfmsv, last_lcfmsv;
     bool marginalsNeedSorting;
+    const bool ownsMarginals;   /*!< False if the marginals are shared with the parent generator (see the slice constructor). */
+    int firstMarginalLayerStart;    /*!< The number of subisotopologues of the first marginal before the current layer. */
+    int restrictedLevel;        /*!< The carry stops at this marginal: it is the innermost one restricted by the slice constructor, or dimNumber. */
+    int restrictedEnd;          /*!< The end of the range of the counter of restrictedLevel. */
+    double gaussianExponent;    /*!< Half the number of degrees of freedom of the isotopologues: the exponent below, in the Gaussian approximation. */
+    double sizeExponent;        /*!< The number of isotopologues at most d below modeLProb is estimated as proportional to d to this power... */
+    double logSizeCoeff;        /*!< ... and to the exp() of this, as long as it was not measured (see plan_layer_offset()). */
+    double observedDepth;       /*!< The depth below modeLProb of the last measured threshold, or 0.0. */
+    size_t observedConfs;       /*!< The number of isotopologues above it. */
+    std::vector<double> layerThresholds;    /*!< The thresholds of the layers entered so far, in order (see save_layer_state()). */
 
 
  public:
@@ -460,6 +835,10 @@ class ISOSPEC_EXPORT_SYMBOL IsoLayeredGenerator : public IsoGenerator
 
     inline void get_conf_signature(int* space) const override final
     {
+        // The marginals are either all aggregated or none of them is
+        if(dimNumber > 0 && marginalResultsUnsorted[0]->is_aggregated())
+            throw std::logic_error("The configurations are not available when the marginals are aggregated");
+
         counter[0] = lProbs_ptr - lProbs_ptr_start;
         if(marginalOrder != nullptr)
         {
@@ -482,10 +861,44 @@ class ISOSPEC_EXPORT_SYMBOL IsoLayeredGenerator : public IsoGenerator
 
     inline double get_currentLThreshold() const { return currentLThreshold; }
 
-    IsoLayeredGenerator(Iso&& iso, int _tabSize = 1000, int _hashSize = 1000, bool reorder_marginals = true, double t_prob_hint = 0.99);  // NOLINT(runtime/explicit) - constructor deliberately left to be used as a conversion
+    //! Constructor.
+    /*!
+        \param aggregate_fine_bins If positive, the marginals are aggregated into bins with this many fine-structure bins
+               per nominal mass (see LayeredMarginal), instead of enumerating their subisotopologues. This is for
+               coarse envelopes of molecules with very many atoms: the generated configurations are then combinations
+               of the bins, with their total probabilities and average masses, and get_conf_signature() throws std::logic_error.
+    */
+    IsoLayeredGenerator(Iso&& iso, int _tabSize = 1000, int _hashSize = 1000, bool reorder_marginals = true, double t_prob_hint = 0.99, int aggregate_fine_bins = 0);  // NOLINT(runtime/explicit) - constructor deliberately left to be used as a conversion
+
+    //! Construct a generator at the end of a layer of another one, saved by save_layer_state().
+    /*!
+        The marginals are extended through the same thresholds as in the saved generator, so their subisotopologues
+        come out the same and in the same order, but the configurations above the last threshold are not walked
+        through: the next call to nextLayer() moves to the layer that the saved generator would have moved to next.
+        \param iso The same molecule as the one of the saved generator (with the same log-probabilities of the isotopes).
+        \param layer_state The values saved by save_layer_state().
+        \param layer_state_size Their number.
+        The other parameters are as in the main constructor.
+    */
+    IsoLayeredGenerator(Iso&& iso, const double* layer_state, size_t layer_state_size, int _tabSize = 1000, int _hashSize = 1000, bool reorder_marginals = true, double t_prob_hint = 0.99);
+
+    //! Construct a generator walking through a part of the current layer of another generator.
+    /*!
+        The marginals of parent are shared (read-only), so many such generators can walk through the layer
+        concurrently from different threads, as long as the parent is not moved to the next layer meanwhile.
+        The constructed generator only walks through this one layer: its nextLayer() must not be called.
+        \param parent The generator whose current layer is to be walked.
+        \param ranges Pairs of [start, end) indices restricting the last no_ranges marginals (in the
+                      internal, possibly reordered, marginal order), as produced by split_layer().
+        \param no_ranges The number of restricted outermost marginals.
+    */
+    IsoLayeredGenerator(const IsoLayeredGenerator& parent, const int* ranges, int no_ranges);
 
     ~IsoLayeredGenerator();
 
+    //! Same as IsoThresholdGenerator::split_space(), but splits the current layer, and never the first marginal.
+    size_t split_layer(size_t min_chunks, std::vector<int>& chunks, int* no_ranges) const;
+
     ISOSPEC_FORCE_INLINE bool advanceToNextConfiguration() override final
     {
         do
@@ -512,6 +925,11 @@ class ISOSPEC_EXPORT_SYMBOL IsoLayeredGenerator : public IsoGenerator
     ISOSPEC_FORCE_INLINE double mass()  const override final { return partialMasses[1] + marginalResults[0]->get_mass(lProbs_ptr - lProbs_ptr_start); };
     ISOSPEC_FORCE_INLINE double prob()  const override final { return partialProbs[1] * marginalResults[0]->get_prob(lProbs_ptr - lProbs_ptr_start); };
 
+    //! Same as IsoOrderedGenerator::fill(), but emits whole runs of isotopologues differing only in the first marginal at once, using SIMD instructions if possible.
+    size_t fill(double* _masses, double* _probs, double* _lprobs, int* _confs, size_t capacity);
+
+    template<typename GenType> friend size_t fill_runs(GenType& gen, double* masses, double* probs, double* lprobs, int* confs, size_t capacity);
+
     //! Block the subsequent search of isotopologues.
     void terminate_search();
 
@@ -533,8 +951,33 @@ class ISOSPEC_EXPORT_SYMBOL IsoLayeredGenerator : public IsoGenerator
 
     bool nextLayer(double offset);
 
+    //! Plan the offset for nextLayer(), so that the next layer holds about target_confs isotopologues.
+    /*!
+        The number of isotopologues above a log-probability threshold is estimated from the Gaussian approximations
+        of the marginals (see Marginal::getLogSizeEstimate()) until measured: then it is extrapolated from
+        the measurements, with the growth observed between the last ones. This is a rough estimate, off by a
+        small factor, and it is more accurate for the large layers.
+        \param confs_so_far The number of isotopologues in the layers up to the current one (inclusive), as counted by the caller.
+        \param target_confs The number of isotopologues to aim at in the next layer.
+        \return The offset to pass to nextLayer(), negative.
+    */
+    double plan_layer_offset(size_t confs_so_far, double target_confs);
+
+    //! Has plan_layer_offset() measured the number of isotopologues yet? Before, it only probes with small layers, as its estimates may be far off.
+    inline bool layer_sizes_measured() const { return observedConfs > 0; }
+
+    //! Save the estimates of plan_layer_offset() and the thresholds of all the layers entered so far to layer_state.
+    void save_layer_state(std::vector<double>& layer_state) const;
+
+    //! Skip the rest of the current layer: advanceToNextConfigurationWithinLayer() returns false until nextLayer() is called.
+    void skip_layer();
+
+    //! Get the marginal distribution of the idx-th element of the formula.
+    inline const Marginal& get_marginal(int idx) const { return *marginalResultsUnsorted[idx]; }
+
  private:
     bool carry();
+    void enterLayer(double new_threshold);
 };
 
 
@@ -562,6 +1005,9 @@ class IsoStochasticGenerator : public IsoGenerator
 
     ISOSPEC_FORCE_INLINE void get_conf_signature(int* space) const override final { ILG.get_conf_signature(space); }
 
+    //! Same as IsoOrderedGenerator::fill().
+    size_t fill(double* _masses, double* _probs, double* _lprobs, int* _confs, size_t capacity) { return fill_impl<IsoStochasticGenerator>(*this, _masses, _probs, _lprobs, _confs, capacity); }
+
     ISOSPEC_FORCE_INLINE bool advanceToNextConfiguration() override final
     {
         /* This function will be used mainly in very small, tight loops, therefore it makes sense to
@@ -0,0 +1,184 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+#include "marginalCache.h"
+#include <cmath>
+#include <utility>
+#include <vector>
+
+
+namespace IsoSpec
+{
+
+static size_t marginal_memory(const PrecalculatedMarginal& m)
+{
+    return sizeof(PrecalculatedMarginal) + static_cast<size_t>(m.get_no_confs()) * (m.get_isotopeNo()*sizeof(int) + sizeof(Conf) + 3*sizeof(double));
+}
+
+MarginalCache::MarginalCache(size_t _max_memory) :
+max_memory(_max_memory),
+used_memory(0),
+no_hits(0),
+no_misses(0),
+no_evictions(0),
+no_mapped(0)
+{}
+
+std::shared_ptr<const PrecalculatedMarginal> MarginalCache::get(const Marginal& m, double lCutOff, int tabSize)
+{
+    std::string key = marginal_key(m);
+    std::shared_ptr<const MarginalTables> attached;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if(it != index.end() && it->second->lCutOff <= lCutOff)
+        {
+            no_hits++;
+            entries.splice(entries.begin(), entries, it->second);
+            return it->second->marginal;
+        }
+        no_misses++;
+        attached = tables;
+    }
+
+    double grid_lCutOff = std::floor(lCutOff / ISOSPEC_MARGINAL_CACHE_GRID) * ISOSPEC_MARGINAL_CACHE_GRID;
+
+    std::shared_ptr<const PrecalculatedMarginal> marginal;
+    if(attached)
+        marginal = attached->get(m, lCutOff, &grid_lCutOff);
+    const bool from_tables = static_cast<bool>(marginal);
+    if(!from_tables)
+        marginal = std::make_shared<const PrecalculatedMarginal>(Marginal(m), grid_lCutOff, true, tabSize);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if(from_tables)
+        no_mapped++;
+
+    auto it = index.find(key);
+    if(it != index.end())
+    {
+        // Another thread might have cached a deeper one in the meantime
+        if(it->second->lCutOff <= grid_lCutOff)
+            return marginal;
+        used_memory -= it->second->memory;
+        entries.erase(it->second);
+        index.erase(it);
+    }
+
+    Entry entry;
+    entry.key = key;
+    entry.lCutOff = grid_lCutOff;
+    entry.marginal = marginal;
+    entry.memory = from_tables ? sizeof(MappedMarginal) : marginal_memory(*marginal);
+    used_memory += entry.memory;
+
+    entries.push_front(std::move(entry));
+    index[std::move(key)] = entries.begin();
+
+    evict();
+
+    return marginal;
+}
+
+void MarginalCache::evict()
+{
+    while(used_memory > max_memory && !entries.empty())
+    {
+        used_memory -= entries.back().memory;
+        index.erase(entries.back().key);
+        entries.pop_back();
+        no_evictions++;
+    }
+}
+
+void MarginalCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    index.clear();
+    used_memory = 0;
+}
+
+size_t MarginalCache::hits() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return no_hits;
+}
+
+size_t MarginalCache::misses() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return no_misses;
+}
+
+size_t MarginalCache::evictions() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return no_evictions;
+}
+
+size_t MarginalCache::mapped() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return no_mapped;
+}
+
+size_t MarginalCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+size_t MarginalCache::memory_usage() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return used_memory;
+}
+
+void MarginalCache::attach(std::shared_ptr<const MarginalTables> _tables)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    tables = std::move(_tables);
+}
+
+void MarginalCache::save(const char* path) const
+{
+    std::vector<std::shared_ptr<const PrecalculatedMarginal> > marginals;
+    std::vector<const PrecalculatedMarginal*> pointers;
+    std::vector<double> lCutOffs;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for(const Entry& entry : entries)
+        {
+            marginals.push_back(entry.marginal);
+            pointers.push_back(entry.marginal.get());
+            lCutOffs.push_back(entry.lCutOff);
+        }
+    }
+
+    MarginalTables::write(path, pointers.data(), lCutOffs.data(), pointers.size());
+}
+
+MarginalCache& MarginalCache::global()
+{
+    static MarginalCache cache;
+    return cache;
+}
+
+}  // namespace IsoSpec
@@ -0,0 +1,113 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "platform.h"
+#include "marginalTrek++.h"
+#include "marginalTables.h"
+
+/*
+ * The cut-offs of the cached marginals are rounded down to multiples of this (in the log-probability space), so that
+ * molecules with slightly different cut-offs for the same element share the marginal.
+ */
+#ifndef ISOSPEC_MARGINAL_CACHE_GRID
+#define ISOSPEC_MARGINAL_CACHE_GRID 1.0
+#endif
+
+namespace IsoSpec
+{
+
+//! A thread-safe cache of precalculated marginal distributions, to be shared by many IsoThresholdGenerators.
+/*!
+    The marginals are identified by the masses and probabilities of the isotopes and the number of atoms. A marginal
+    requested with a given cut-off is served from the cache if it was computed down to that cut-off or a lower one,
+    so it may also hold subisotopologues below the requested cut-off (at the end, as the marginals are sorted).
+    Cached marginals are never modified, and stay valid as long as their users hold them, even after being evicted.
+    The least recently used marginals are evicted once the memory they use exceeds the limit.
+*/
+class ISOSPEC_EXPORT_SYMBOL MarginalCache
+{
+ private:
+    struct Entry
+    {
+        std::string key;
+        double lCutOff;
+        std::shared_ptr<const PrecalculatedMarginal> marginal;
+        size_t memory;
+    };
+
+    mutable std::mutex mutex;
+    std::list<Entry> entries;           /*!< The most recently used first. */
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t max_memory;
+    size_t used_memory;
+    size_t no_hits;
+    size_t no_misses;
+    size_t no_evictions;
+    size_t no_mapped;
+    std::shared_ptr<const MarginalTables> tables;
+
+    void evict();
+
+ public:
+    //! Constructor.
+    /*!
+        \param _max_memory The (approximate) limit on the memory used by the cached marginals, in bytes.
+    */
+    explicit MarginalCache(size_t _max_memory = 256*1024*1024);
+
+    MarginalCache(const MarginalCache& other) = delete;
+    MarginalCache& operator=(const MarginalCache& other) = delete;
+
+    //! Get the sorted marginal distribution of m, holding at least the subisotopologues with log-probability at least lCutOff.
+    /*!
+        The marginal is computed (outside of the lock, so concurrent misses don't wait for each other) if it isn't cached yet.
+        m must have its mode subisotopologue computed.
+    */
+    std::shared_ptr<const PrecalculatedMarginal> get(const Marginal& m, double lCutOff, int tabSize = 1000);
+
+    //! Drop all the cached marginals (their users may still use them). The counters are not reset.
+    void clear();
+
+    //! Serve the misses from precalculated tables, when they hold deep enough marginals, instead of computing them.
+    /*!
+        The marginals served from the tables use the mapped memory directly (see MarginalTables), and count
+        towards the memory limit with their bookkeeping only. Pass null to detach the tables.
+    */
+    void attach(std::shared_ptr<const MarginalTables> _tables);
+
+    //! Write all the cached marginals to a marginal tables file, to be loaded by MarginalTables.
+    void save(const char* path) const;
+
+    size_t hits() const;
+    size_t misses() const;
+    size_t evictions() const;
+    size_t mapped() const;          /*!< The number of misses served from the attached tables. */
+    size_t size() const;
+    size_t memory_usage() const;
+
+    //! A process-wide cache, for users who don't need to manage their own.
+    static MarginalCache& global();
+};
+
+}  // namespace IsoSpec
@@ -0,0 +1,333 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+#include "marginalTables.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include "compactConfTable.h"
+
+#if ISOSPEC_GOT_SYSTEM_MMAN
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace IsoSpec
+{
+
+static const char marginal_tables_magic[8] = {'I', 's', 'o', 'S', 'p', 'e', 'c', 'M'};
+static const uint32_t marginal_tables_byte_order = 0x01020304;
+
+/*
+ * The layout of the file (all the sections start at multiples of 8 bytes):
+ *   header:    magic[8], uint32 version, uint32 byte order marker, uint64 number of tables
+ *   per table: TableHeader, double atom_masses[isotopeNo], double atom_lProbs[isotopeNo], int32 base[isotopeNo],
+ *              double lProbs[no_confs+1] (-inf terminated), double probs[no_confs], double masses[no_confs],
+ *              offsets[no_confs*isotopeNo], width bytes each
+ */
+struct MarginalTablesHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t no_tables;
+};
+
+struct MarginalTableHeader
+{
+    int32_t isotopeNo;
+    int32_t atomCnt;
+    uint64_t no_confs;
+    double lCutOff;
+    int32_t width;
+    int32_t reserved;
+};
+
+static inline size_t padded(size_t size) { return (size + 7) & ~static_cast<size_t>(7); }
+
+std::string marginal_key(const Marginal& m)
+{
+    const int isotopeNo = m.get_isotopeNo();
+    const int atomCnt = m.get_atomCnt();
+
+    std::string key;
+    key.append(reinterpret_cast<const char*>(&isotopeNo), sizeof(int));
+    key.append(reinterpret_cast<const char*>(&atomCnt), sizeof(int));
+    key.append(reinterpret_cast<const char*>(m.get_atom_masses()), isotopeNo*sizeof(double));
+    key.append(reinterpret_cast<const char*>(m.get_lProbs()), isotopeNo*sizeof(double));
+    return key;
+}
+
+
+// The infinite cut-off makes the base class start with an empty table, which is then replaced by the mapped one
+MappedMarginal::MappedMarginal(Marginal&& m, double lCutOff, unsigned int _no_confs, const double* _lProbs, const double* _probs,
+                               const double* _masses, const int* base, int width, const void* offsets, std::shared_ptr<const void> _storage) :
+PrecalculatedMarginal(std::move(m), std::numeric_limits<double>::infinity(), true, 1),
+storage(std::move(_storage))
+{
+    delete[] probs;
+    delete[] masses;
+
+    // Never written to: all the modifying methods are either overridden or unreachable for a marginal with a compact table
+    lProbs_data = const_cast<double*>(_lProbs);
+    probs = const_cast<double*>(_probs);
+    masses = const_cast<double*>(_masses);
+    no_confs = _no_confs;
+    stored_lCutOff = lCutOff;
+    compact_table.reset(new CompactConfTable(isotopeNo, base, width, _no_confs, offsets));
+    confs = nullptr;
+}
+
+MappedMarginal::~MappedMarginal()
+{
+    // Owned by the storage
+    probs = nullptr;
+    masses = nullptr;
+}
+
+void MappedMarginal::retarget(double)
+{
+    throw std::logic_error("Marginals on top of mapped tables cannot be retargeted");
+}
+
+
+MarginalTables::MarginalTables(const char* path)
+{
+    size_t size;
+
+#if ISOSPEC_GOT_SYSTEM_MMAN
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error(std::string("Cannot open the marginal tables file: ") + path);
+
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw std::runtime_error(std::string("Cannot stat the marginal tables file: ") + path);
+    }
+    size = static_cast<size_t>(st.st_size);
+
+    if(size < sizeof(MarginalTablesHeader))
+    {
+        close(fd);
+        throw std::runtime_error(std::string("Not a marginal tables file: ") + path);
+    }
+
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED)
+        throw std::runtime_error(std::string("Cannot map the marginal tables file: ") + path);
+
+    storage = std::shared_ptr<const void>(mapping, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+#else
+    FILE* file = fopen(path, "rb");
+    if(file == nullptr)
+        throw std::runtime_error(std::string("Cannot open the marginal tables file: ") + path);
+
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    // malloc'ed memory is suitably aligned for doubles
+    void* buffer = file_size > 0 ? malloc(static_cast<size_t>(file_size)) : nullptr;
+    if(buffer == nullptr || fread(buffer, 1, static_cast<size_t>(file_size), file) != static_cast<size_t>(file_size))
+    {
+        free(buffer);
+        fclose(file);
+        throw std::runtime_error(std::string("Cannot read the marginal tables file: ") + path);
+    }
+    fclose(file);
+    size = static_cast<size_t>(file_size);
+
+    storage = std::shared_ptr<const void>(buffer, [](const void* p) { free(const_cast<void*>(p)); });
+#endif
+
+    const char* data = static_cast<const char*>(storage.get());
+    size_t pos = 0;
+
+    auto take = [&](size_t bytes) -> const char*
+    {
+        if(padded(bytes) > size - pos)
+            throw std::runtime_error(std::string("Truncated marginal tables file: ") + path);
+        const char* ret = data + pos;
+        pos += padded(bytes);
+        return ret;
+    };
+
+    const MarginalTablesHeader* header = reinterpret_cast<const MarginalTablesHeader*>(take(sizeof(MarginalTablesHeader)));
+    if(memcmp(header->magic, marginal_tables_magic, sizeof(marginal_tables_magic)) != 0)
+        throw std::runtime_error(std::string("Not a marginal tables file: ") + path);
+    if(header->byte_order != marginal_tables_byte_order)
+        throw std::runtime_error(std::string("The marginal tables file was written on a machine with another byte order: ") + path);
+    if(header->version != ISOSPEC_MARGINAL_TABLES_VERSION)
+        throw std::runtime_error(std::string("Unsupported version of the marginal tables file: ") + path);
+
+    for(uint64_t ii = 0; ii < header->no_tables; ii++)
+    {
+        const MarginalTableHeader* th = reinterpret_cast<const MarginalTableHeader*>(take(sizeof(MarginalTableHeader)));
+        if(th->isotopeNo <= 0 || th->atomCnt < 0 || (th->width != 1 && th->width != 2 && th->width != 4) ||
+           th->no_confs >= std::numeric_limits<unsigned int>::max() || th->no_confs > size)
+            throw std::runtime_error(std::string("Corrupted marginal tables file: ") + path);
+
+        const size_t isotopeNo = static_cast<size_t>(th->isotopeNo);
+        const size_t no_confs = static_cast<size_t>(th->no_confs);
+
+        std::string key;
+        key.append(reinterpret_cast<const char*>(&th->isotopeNo), sizeof(int));
+        key.append(reinterpret_cast<const char*>(&th->atomCnt), sizeof(int));
+        key.append(take(isotopeNo*sizeof(double)), isotopeNo*sizeof(double));
+        key.append(take(isotopeNo*sizeof(double)), isotopeNo*sizeof(double));
+
+        Table table;
+        table.lCutOff = th->lCutOff;
+        table.no_confs = static_cast<unsigned int>(no_confs);
+        table.base = reinterpret_cast<const int*>(take(isotopeNo*sizeof(int32_t)));
+        table.lProbs = reinterpret_cast<const double*>(take((no_confs+1)*sizeof(double)));
+        table.probs = reinterpret_cast<const double*>(take(no_confs*sizeof(double)));
+        table.masses = reinterpret_cast<const double*>(take(no_confs*sizeof(double)));
+        table.width = th->width;
+        table.offsets = take(no_confs*isotopeNo*static_cast<size_t>(th->width));
+
+        tables[std::move(key)] = table;
+    }
+}
+
+// A name next to path, unique among the processes and threads writing it at once
+static std::string temporary_path(const char* path)
+{
+    static std::atomic<unsigned long> counter(0);
+    std::string ret(path);
+    ret += ".tmp.";
+#if ISOSPEC_GOT_SYSTEM_MMAN
+    ret += std::to_string(static_cast<long>(getpid()));
+    ret += '.';
+#endif
+    ret += std::to_string(counter.fetch_add(1));
+    return ret;
+}
+
+void MarginalTables::write(const char* path, const PrecalculatedMarginal* const* marginals, const double* lCutOffs, size_t size)
+{
+    // The file is written aside and renamed over path: the processes which still map the old one keep it
+    const std::string tmp_path = temporary_path(path);
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if(file == nullptr)
+        throw std::runtime_error(std::string("Cannot open the marginal tables file for writing: ") + path);
+
+    bool ok = true;
+    auto put = [&](const void* src, size_t bytes)
+    {
+        static const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        ok = ok && fwrite(src, 1, bytes, file) == bytes;
+        ok = ok && fwrite(zeros, 1, padded(bytes) - bytes, file) == padded(bytes) - bytes;
+    };
+
+    MarginalTablesHeader header;
+    memcpy(header.magic, marginal_tables_magic, sizeof(marginal_tables_magic));
+    header.version = ISOSPEC_MARGINAL_TABLES_VERSION;
+    header.byte_order = marginal_tables_byte_order;
+    header.no_tables = size;
+    put(&header, sizeof(header));
+
+    for(size_t ii = 0; ii < size; ii++)
+    {
+        const PrecalculatedMarginal& m = *marginals[ii];
+        if(!m.is_sorted())
+        {
+            fclose(file);
+            remove(tmp_path.c_str());
+            throw std::invalid_argument("Only sorted marginals can be written to a marginal tables file");
+        }
+
+        const int isotopeNo = m.get_isotopeNo();
+        const unsigned int no_confs = m.get_no_confs();
+
+        // The most probable subisotopologue is the base of the offsets
+        pod_vector<int> base;
+        base.resize(isotopeNo);
+        if(no_confs > 0)
+            m.get_conf(0, base.data());
+        else
+            memset(base.data(), 0, isotopeNo*sizeof(int));
+
+        CompactConfTable compact(isotopeNo, base.data());
+        compact.reserve(no_confs);
+        pod_vector<int> space;
+        space.resize(isotopeNo);
+        for(unsigned int jj = 0; jj < no_confs; jj++)
+        {
+            m.get_conf(jj, space.data());
+            compact.push_back(space.data());
+        }
+
+        MarginalTableHeader th;
+        th.isotopeNo = isotopeNo;
+        th.atomCnt = m.get_atomCnt();
+        th.no_confs = no_confs;
+        th.lCutOff = lCutOffs[ii];
+        th.width = compact.bytes_per_count();
+        th.reserved = 0;
+        put(&th, sizeof(th));
+
+        const double guardian = -std::numeric_limits<double>::infinity();
+
+        put(m.get_atom_masses(), isotopeNo*sizeof(double));
+        put(m.get_lProbs(), isotopeNo*sizeof(double));
+        put(base.data(), isotopeNo*sizeof(int));
+        put(m.get_lProbs_ptr(), no_confs*sizeof(double));
+        put(&guardian, sizeof(double));
+        put(m.get_probs_ptr(), no_confs*sizeof(double));
+        put(m.get_masses_ptr(), no_confs*sizeof(double));
+        put(compact.data(), static_cast<size_t>(no_confs)*isotopeNo*compact.bytes_per_count());
+    }
+
+    ok = fclose(file) == 0 && ok;
+#if !ISOSPEC_GOT_SYSTEM_MMAN
+    // rename() does not replace existing files everywhere
+    if(ok)
+        remove(path);
+#endif
+    ok = ok && rename(tmp_path.c_str(), path) == 0;
+    if(!ok)
+    {
+        remove(tmp_path.c_str());
+        throw std::runtime_error(std::string("Cannot write the marginal tables file: ") + path);
+    }
+}
+
+std::shared_ptr<const PrecalculatedMarginal> MarginalTables::get(const Marginal& m, double lCutOff, double* table_lCutOff) const
+{
+    auto it = tables.find(marginal_key(m));
+    if(it == tables.end() || it->second.lCutOff > lCutOff)
+        return std::shared_ptr<const PrecalculatedMarginal>();
+
+    const Table& table = it->second;
+    if(table_lCutOff != nullptr)
+        *table_lCutOff = table.lCutOff;
+
+    return std::make_shared<const MappedMarginal>(Marginal(m), table.lCutOff, table.no_confs, table.lProbs, table.probs,
+                                                  table.masses, table.base, table.width, table.offsets, storage);
+}
+
+}  // namespace IsoSpec
@@ -0,0 +1,129 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "platform.h"
+#include "marginalTrek++.h"
+
+/*
+ * The version of the format of the marginal table files. Files written with another version are rejected.
+ */
+#define ISOSPEC_MARGINAL_TABLES_VERSION 1
+
+namespace IsoSpec
+{
+
+//! The key identifying a marginal distribution: the masses and probabilities of the isotopes and the number of atoms.
+std::string marginal_key(const Marginal& m);
+
+//! A PrecalculatedMarginal on top of tables stored elsewhere (in a MarginalTables file), which it doesn't copy.
+/*!
+    The subisotopologues are stored compactly (see PrecalculatedMarginal::compact_confs()). The tables are read-only:
+    retarget() is not supported.
+*/
+class MappedMarginal : public PrecalculatedMarginal
+{
+ private:
+    std::shared_ptr<const void> storage;    /*!< Keeps the tables alive. */
+
+ public:
+    //! Constructor.
+    /*!
+        \param m The marginal distribution the tables were computed for.
+        \param lCutOff The cut-off the tables were computed with.
+        \param _no_confs The number of subisotopologues in the tables, sorted by descending probability.
+        \param _lProbs The log-probabilities of the subisotopologues, followed by a -inf guardian.
+        \param _probs, _masses The probabilities and the masses of the subisotopologues.
+        \param base, width, offsets The subisotopologues, as in the read-only CompactConfTable constructor.
+        \param _storage The owner of all the tables.
+    */
+    MappedMarginal(Marginal&& m, double lCutOff, unsigned int _no_confs, const double* _lProbs, const double* _probs,
+                   const double* _masses, const int* base, int width, const void* offsets, std::shared_ptr<const void> _storage);
+
+    MappedMarginal(const MappedMarginal& other) = delete;
+    MappedMarginal& operator=(const MappedMarginal& other) = delete;
+
+    ~MappedMarginal();
+
+    void retarget(double lCutOff) override;
+};
+
+//! A file of precalculated marginal tables, memory-mapped read-only.
+/*!
+    Marginals built on top of the file (see get()) use the mapped tables directly, so that the processes using
+    the same file share one physical copy of them, and nothing is recomputed on startup. The usual way of using
+    it is attaching it to a MarginalCache used by the IsoThresholdGenerators. The file (written by write() or
+    MarginalCache::save()) holds the log-probabilities, probabilities, masses and compactly stored subisotopologues
+    of each marginal, in the byte order of the machine that wrote it. Where memory-mapping isn't available, the
+    file is read into memory instead.
+*/
+class ISOSPEC_EXPORT_SYMBOL MarginalTables
+{
+ private:
+    struct Table
+    {
+        double lCutOff;
+        unsigned int no_confs;
+        const double* lProbs;
+        const double* probs;
+        const double* masses;
+        const int* base;
+        int width;
+        const void* offsets;
+    };
+
+    std::shared_ptr<const void> storage;
+    std::unordered_map<std::string, Table> tables;
+
+ public:
+    //! Map the file.
+    /*!
+        \param path The file, written by write() or MarginalCache::save().
+        Throws std::runtime_error if the file can't be read or isn't a valid marginal table file of this version.
+    */
+    explicit MarginalTables(const char* path);
+
+    MarginalTables(const MarginalTables& other) = delete;
+    MarginalTables& operator=(const MarginalTables& other) = delete;
+
+    //! Write the tables of marginals to a file.
+    /*!
+        \param path The file to be (over)written.
+        \param marginals The marginals, which must be sorted, and hold all the subisotopologues above the corresponding cut-offs.
+        \param lCutOffs The cut-offs the marginals were computed with: their tables are used for requests with cut-offs at least this.
+        \param size The number of marginals.
+        Throws std::runtime_error if the file can't be written.
+    */
+    static void write(const char* path, const PrecalculatedMarginal* const* marginals, const double* lCutOffs, size_t size);
+
+    //! Get the marginal distribution of m on top of the mapped tables, if they hold all its subisotopologues above lCutOff.
+    /*!
+        \param m The marginal distribution. Must have its mode subisotopologue computed.
+        \param table_lCutOff If not null, is set to the cut-off of the found tables.
+        \return The marginal, or null if there are no tables for m, or they were computed with a higher cut-off.
+    */
+    std::shared_ptr<const PrecalculatedMarginal> get(const Marginal& m, double lCutOff, double* table_lCutOff = nullptr) const;
+
+    //! The number of marginals in the file.
+    inline size_t size() const { return tables.size(); }
+};
+
+}  // namespace IsoSpec
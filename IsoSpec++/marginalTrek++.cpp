@@ -38,6 +38,38 @@
 namespace IsoSpec
 {
 
+//! Move the atoms of the subisotopologue between isotopes, one at a time, as long as its probability increases.
+static void hillclimb_to_mode(const int isotopeNo, const double* lprobs, int* res)
+{
+    bool modified = true;
+    double LP = unnormalized_logProb(res, lprobs, isotopeNo);
+    double NLP;
+
+    while(modified)
+    {
+        modified = false;
+        for(int ii = 0; ii < isotopeNo; ii++)
+            for(int jj = 0; jj < isotopeNo; jj++)
+                if(ii != jj && res[ii] > 0)
+                {
+                    res[ii]--;
+                    res[jj]++;
+                    NLP = unnormalized_logProb(res, lprobs, isotopeNo);
+                    if(NLP > LP || (NLP == LP && ii > jj))
+                    {
+                        modified = true;
+                        LP = NLP;
+                    }
+                    else
+                    {
+                        res[ii]++;
+                        res[jj]--;
+                    }
+                }
+    }
+}
+
+
 //! Find one of the most probable subisotopologues.
 /*!
     The algorithm uses the hill-climbing algorithm.
@@ -89,36 +121,9 @@ void writeInitialConfiguration(const int atomCnt, const int isotopeNo, const dou
     }
 
     // What we computed so far will be very close to the mode: hillclimb the rest of the way
-
-    bool modified = true;
-    double LP = unnormalized_logProb(res, lprobs, isotopeNo);
-    double NLP;
-
-    while(modified)
-    {
-        modified = false;
-        for(int ii = 0; ii < isotopeNo; ii++)
-            for(int jj = 0; jj < isotopeNo; jj++)
-                if(ii != jj && res[ii] > 0)
-                {
-                    res[ii]--;
-                    res[jj]++;
-                    NLP = unnormalized_logProb(res, lprobs, isotopeNo);
-                    if(NLP > LP || (NLP == LP && ii > jj))
-                    {
-                        modified = true;
-                        LP = NLP;
-                    }
-                    else
-                    {
-                        res[ii]++;
-                        res[jj]--;
-                    }
-                }
-    }
+    hillclimb_to_mode(isotopeNo, lprobs, res);
 }
 
-
 double* getMLogProbs(const double* probs, int isoNo)
 {
     /*!
@@ -149,13 +154,13 @@ double* getMLogProbs(const double* probs, int isoNo)
 double get_loggamma_nominator(int x)
 {
     // calculate log gamma of the nominator calculated in the binomial exression.
-    double ret = lgamma(x+1);
+    double ret = safe_lgamma(x+1);
     return ret;
 }
 
 int verify_atom_cnt(int atomCnt)
 {
-    #if !ISOSPEC_BUILDING_OPENMS
+    #if !ISOSPEC_LFACT_TABLE_BOUNDED
     if(ISOSPEC_G_FACT_TABLE_SIZE-1 <= atomCnt)
         throw std::length_error("Subisotopologue too large, size limit (that is, the maximum number of atoms of a single element in a molecule) is: " + std::to_string(ISOSPEC_G_FACT_TABLE_SIZE-1));
     #endif
@@ -178,6 +183,30 @@ mode_conf(nullptr)
 // Deliberately not initializing mode_lprob
 {}
 
+static double* verify_lProbs(const double* lProbs, int isoNo)
+{
+    for(int ii = 0; ii < isoNo; ii++)
+        if(!(lProbs[ii] <= 0.0) || std::isinf(lProbs[ii]))
+            throw std::invalid_argument("All isotope log-probabilities lp must fulfill: -inf < lp <= 0.0");
+    return array_copy<double>(lProbs, isoNo);
+}
+
+Marginal::Marginal(int _isotopeNo, int _atomCnt, const double* _masses, const double* _lProbs) :
+disowned(false),
+isotopeNo(_isotopeNo),
+atomCnt(verify_atom_cnt(_atomCnt)),
+atom_lProbs(verify_lProbs(_lProbs, _isotopeNo)),
+atom_masses(array_copy<double>(_masses, _isotopeNo)),
+loggamma_nominator(get_loggamma_nominator(_atomCnt)),
+mode_conf(nullptr)
+// Deliberately not initializing mode_lprob
+{}
+
+Marginal Marginal::FromLProbs(const double* _masses, const double* _lProbs, int _isotopeNo, int _atomCnt)
+{
+    return Marginal(_isotopeNo, _atomCnt, _masses, _lProbs);
+}
+
 Marginal::Marginal(const Marginal& other) :
 disowned(false),
 isotopeNo(other.isotopeNo),
@@ -221,6 +250,65 @@ loggamma_nominator(other.loggamma_nominator)
     }
 }
 
+static int derived_atom_cnt(int atomCnt, int delta)
+{
+    if(atomCnt + delta < 0)
+        throw std::invalid_argument("Cannot derive a marginal with a negative number of atoms");
+    return verify_atom_cnt(atomCnt + delta);
+}
+
+Marginal::Marginal(const Marginal& other, int delta) :
+disowned(false),
+isotopeNo(other.isotopeNo),
+atomCnt(derived_atom_cnt(other.atomCnt, delta)),
+atom_lProbs(array_copy<double>(other.atom_lProbs, isotopeNo)),
+atom_masses(array_copy<double>(other.atom_masses, isotopeNo)),
+loggamma_nominator(get_loggamma_nominator(atomCnt)),
+mode_conf(nullptr)
+{
+    if(other.mode_conf == nullptr || std::abs(delta) > ISOSPEC_DERIVED_MODE_MAX_STEPS)
+    {
+        setupMode();
+        return;
+    }
+
+    mode_conf = array_copy<int>(other.mode_conf, isotopeNo);
+
+    // Adding an atom of the ii-th isotope multiplies the probability by p_ii * (n+1) / (mode_conf[ii]+1):
+    // add the atoms one by one where it's the largest, and remove them where the reverse is the smallest
+    for(; delta > 0; delta--)
+    {
+        unsigned int best = 0;
+        for(unsigned int ii = 1; ii < isotopeNo; ii++)
+            if(atom_lProbs[ii] - log(mode_conf[ii]+1) > atom_lProbs[best] - log(mode_conf[best]+1))
+                best = ii;
+        mode_conf[best]++;
+    }
+    for(; delta < 0; delta++)
+    {
+        unsigned int best = isotopeNo;
+        for(unsigned int ii = 0; ii < isotopeNo; ii++)
+            if(mode_conf[ii] > 0 && (best == isotopeNo || log(mode_conf[ii]) - atom_lProbs[ii] > log(mode_conf[best]) - atom_lProbs[best]))
+                best = ii;
+        mode_conf[best]--;
+    }
+
+    // Already the mode, up to ties and rounding: make it the same as the one found from scratch would be
+    hillclimb_to_mode(isotopeNo, atom_lProbs, mode_conf);
+    mode_lprob = logProb(mode_conf);
+}
+
+Marginal::Marginal(const Marginal& first, const Marginal& second) :
+disowned(false),
+isotopeNo(first.isotopeNo + second.isotopeNo),
+atomCnt(first.atomCnt + second.atomCnt),
+atom_lProbs(array_concat<double>(first.atom_lProbs, first.isotopeNo, second.atom_lProbs, second.isotopeNo)),
+atom_masses(array_concat<double>(first.atom_masses, first.isotopeNo, second.atom_masses, second.isotopeNo)),
+loggamma_nominator(first.loggamma_nominator + second.loggamma_nominator),
+mode_conf(array_concat<int>(first.mode_conf, first.isotopeNo, second.mode_conf, second.isotopeNo)),
+mode_lprob(first.mode_lprob + second.mode_lprob)
+{}
+
 Marginal::~Marginal()
 {
     if(!disowned)
@@ -286,6 +374,24 @@ double Marginal::getAtomAverageMass() const
     return ret;
 }
 
+template<int N> static void compute_masses_n(const Conf* confs, size_t count, const double* atom_masses, int dim, double* out)
+{
+    for(size_t ii = 0; ii < count; ii++)
+        out[ii] = calc_mass<N>(confs[ii], atom_masses, dim);
+}
+
+void Marginal::compute_masses(const Conf* confs, size_t count, double* out) const
+{
+    switch(isotopeNo)
+    {
+        case 1: compute_masses_n<1>(confs, count, atom_masses, isotopeNo, out); break;
+        case 2: compute_masses_n<2>(confs, count, atom_masses, isotopeNo, out); break;
+        case 3: compute_masses_n<3>(confs, count, atom_masses, isotopeNo, out); break;
+        case 4: compute_masses_n<4>(confs, count, atom_masses, isotopeNo, out); break;
+        default: compute_masses_n<0>(confs, count, atom_masses, isotopeNo, out);
+    }
+}
+
 double Marginal::variance() const
 {
     double ret = 0.0;
@@ -311,9 +417,9 @@ double Marginal::getLogSizeEstimate(double logEllipsoidRadius) const
     for(int jj = 0; jj < i; jj++)
         sum_lprobs += atom_lProbs[jj];
 
-    double log_V_simplex = k * log(n) - lgamma(i);
-    double log_N_simplex = lgamma(n+i) - lgamma(n+1.0) - lgamma(i);
-    double log_V_ellipsoid = (k * (log(n) + logpi + logEllipsoidRadius) + sum_lprobs) * 0.5 - lgamma((i+1)*0.5);
+    double log_V_simplex = k * log(n) - safe_lgamma(i);
+    double log_N_simplex = safe_lgamma(n+i) - safe_lgamma(n+1.0) - safe_lgamma(i);
+    double log_V_ellipsoid = (k * (log(n) + logpi + logEllipsoidRadius) + sum_lprobs) * 0.5 - safe_lgamma((i+1)*0.5);
 
     return log_N_simplex + log_V_ellipsoid - log_V_simplex;
 }
@@ -446,19 +552,108 @@ PrecalculatedMarginal::PrecalculatedMarginal(Marginal&& m,
     int tabSize,
     int
 ) : Marginal(std::move(m)),
-allocator(isotopeNo, tabSize)
+allocator(isotopeNo, tabSize),
+stored_lCutOff(lCutOff),
+hidden_lProb(0.0),
+sorted(sort),
+fringe_ready(false),
+binomial_lo(mode_conf[0]),
+binomial_hi(mode_conf[0]-1)
+{
+    setup(lCutOff, 0);
+}
+
+PrecalculatedMarginal* PrecalculatedMarginal::derive(int delta, double lCutOff, bool sort, int tabSize) const
+{
+    return new PrecalculatedMarginal(*this, Marginal(*this, delta), lCutOff, sort, tabSize);
+}
+
+PrecalculatedMarginal::PrecalculatedMarginal(const PrecalculatedMarginal& neighbour, Marginal&& m, double lCutOff, bool sort, int tabSize) :
+Marginal(std::move(m)),
+allocator(isotopeNo, tabSize),
+stored_lCutOff(lCutOff),
+hidden_lProb(0.0),
+sorted(sort),
+fringe_ready(false),
+binomial_lo(mode_conf[0]),
+binomial_hi(mode_conf[0]-1)
+{
+    // The neighbouring marginals have tables of similar sizes
+    setup(lCutOff, neighbour.stored_no_confs());
+}
+
+void PrecalculatedMarginal::setup(double lCutOff, size_t size_hint)
 {
-    Conf currentConf = allocator.makeCopy(mode_conf);
-    if(logProb(currentConf) >= lCutOff)
+    configurations.reserve(size_hint);
+    lProbs.reserve(size_hint+1);
+
+    if(isotopeNo == 2)
+        // Comes out sorted, without any search
+        extend_binomial(lCutOff);
+    else
     {
-        configurations.push_back(currentConf);
-        lProbs.push_back(mode_lprob);
+        Conf currentConf = allocator.makeCopy(mode_conf);
+        if(logProb(currentConf) >= lCutOff)
+        {
+            configurations.push_back(currentConf);
+            lProbs.push_back(mode_lprob);
+        }
+
+        explore<true, false>(0, lCutOff);
     }
 
-    unsigned int idx = 0;
+    no_confs = configurations.size();
+    confs  = configurations.data();
+
+    if(sorted && no_confs > 0 && isotopeNo != 2)
+        radix_sort_descending(lProbs.data(), confs, no_confs);
+
+    probs = new double[no_confs];
+    masses = new double[no_confs];
+
+
+    for(unsigned int ii = 0; ii < no_confs; ii++)
+    {
+        probs[ii] = exp(lProbs[ii]);
+        masses[ii] = calc_mass(confs[ii], atom_masses, isotopeNo);
+    }
+
+    lProbs.push_back(-std::numeric_limits<double>::infinity());
+    lProbs_data = lProbs.data();
+}
+
+/*
+ * Walk the configurations[idx:] (including the ones appended during the walk) and compute their
+ * neighbours further away from the mode. Every subisotopologue has exactly one such predecessor,
+ * so no hashing is necessary. Neighbours above lCutOff are appended to configurations (if keep_accepted),
+ * the others are put in the fringe (if keep_rejected).
+ */
+template<bool keep_accepted, bool keep_rejected> void PrecalculatedMarginal::explore(unsigned int idx, double lCutOff)
+{
+    // Two-isotope elements don't get here, and single-isotope ones have no neighbours
+    switch(isotopeNo)
+    {
+        case 3: explore_n<keep_accepted, keep_rejected, 3>(idx, lCutOff); break;
+        case 4: explore_n<keep_accepted, keep_rejected, 4>(idx, lCutOff); break;
+        default: explore_n<keep_accepted, keep_rejected, 0>(idx, lCutOff);
+    }
+}
 
-    std::unique_ptr<double[]> prob_partials(new double[isotopeNo]);
-    std::unique_ptr<double[]> prob_part_acc(new double[isotopeNo+1]);
+/*
+ * The body of explore(), for N isotopes (or isotopeNo of them if N is 0): with N known at compile
+ * time the loops over isotopes are unrolled and the partial sums are kept on the stack.
+ */
+template<bool keep_accepted, bool keep_rejected, int N> void PrecalculatedMarginal::explore_n(unsigned int idx, double lCutOff)
+{
+    const unsigned int dim = N > 0 ? N : isotopeNo;
+    Conf currentConf;
+
+    double partials_stack[N > 0 ? N : 1];
+    double part_acc_stack[N+1];
+    std::unique_ptr<double[]> partials_heap(N > 0 ? nullptr : new double[isotopeNo]);
+    std::unique_ptr<double[]> part_acc_heap(N > 0 ? nullptr : new double[isotopeNo+1]);
+    double* prob_partials = N > 0 ? partials_stack : partials_heap.get();
+    double* prob_part_acc = N > 0 ? part_acc_stack : part_acc_heap.get();
     prob_part_acc[0] = loggamma_nominator;
 
     while(idx < configurations.size())
@@ -466,10 +661,10 @@ allocator(isotopeNo, tabSize)
         currentConf = configurations[idx];
         idx++;
 
-        for(size_t ii = 0; ii < isotopeNo; ii++)
+        for(size_t ii = 0; ii < dim; ii++)
             prob_partials[ii] = minuslogFactorial(currentConf[ii]) + currentConf[ii] * atom_lProbs[ii];
 
-        for(unsigned int ii = 0; ii < isotopeNo; ii++ )
+        for(unsigned int ii = 0; ii < dim; ii++ )
         {
             if(currentConf[ii] > mode_conf[ii])
                 continue;
@@ -480,7 +675,7 @@ allocator(isotopeNo, tabSize)
                 currentConf[ii]--;
                 prob_partials[ii] = minuslogFactorial(currentConf[ii]) + currentConf[ii] * atom_lProbs[ii];
 
-                for(unsigned int jj = 0; jj < isotopeNo; jj++ )
+                for(unsigned int jj = 0; jj < dim; jj++ )
                 {
                     prob_part_acc[jj+1] = prob_part_acc[jj] + prob_partials[jj];
 
@@ -490,15 +685,25 @@ allocator(isotopeNo, tabSize)
                     if( ii != jj )
                     {
                         double logp = prob_part_acc[jj] + minuslogFactorial(1+currentConf[jj]) + (1+currentConf[jj]) * atom_lProbs[jj];
-                        for(size_t kk = jj+1; kk < isotopeNo; kk++)
+                        for(size_t kk = jj+1; kk < dim; kk++)
                             logp += prob_partials[kk];
 
                         if (logp >= lCutOff)
+                        {
+                            constexpr_if(keep_accepted)
+                            {
+                                auto tmp = allocator.makeCopy(currentConf);
+                                tmp[jj]++;
+                                configurations.push_back(tmp);
+                                lProbs.push_back(logp);
+                            }
+                        }
+                        else constexpr_if(keep_rejected)
                         {
                             auto tmp = allocator.makeCopy(currentConf);
                             tmp[jj]++;
-                            configurations.push_back(tmp);
-                            lProbs.push_back(logp);
+                            fringe.push_back(tmp);
+                            fringe_lProbs.push_back(logp);
                         }
                     }
                     else
@@ -515,30 +720,239 @@ allocator(isotopeNo, tabSize)
                 break;
         }
     }
+}
+
+void PrecalculatedMarginal::retarget(double lCutOff)
+{
+    set_no_confs(stored_no_confs());
+
+    const bool sort_all = !sorted && no_confs > 0 && lCutOff > stored_lCutOff;
+    const bool recompact = compact_table && (lCutOff < stored_lCutOff || sort_all);
+
+    // Extending and sorting need the subisotopologues as they are
+    if(recompact)
+        expand_confs();
+
+    if(lCutOff < stored_lCutOff)
+        extend(lCutOff);
+    else if(sort_all)
+        sort_stored(0);
+
+    if(recompact)
+        compact_confs();
+
+    if(!sorted)
+        return;
+
+    // Subisotopologues are stored by descending probability: find the first one below the cut-off
+    const double* lProbs_end = std::lower_bound(lProbs.data(), lProbs.data() + no_confs, lCutOff,
+                                                [](double lprob, double cutoff) { return lprob >= cutoff; });
+
+    set_no_confs(lProbs_end - lProbs.data());
+}
+
+void PrecalculatedMarginal::compact_confs()
+{
+    if(compact_table)
+        return;
+
+    compact_table.reset(new CompactConfTable(isotopeNo, mode_conf));
+    compact_table->reserve(configurations.size());
+    for(size_t ii = 0; ii < configurations.size(); ii++)
+        compact_table->push_back(configurations[ii]);
+
+    // The fringe points into the allocator as well: it will be rebuilt by the next extend()
+    pod_vector<Conf> empty_configurations, empty_fringe;
+    pod_vector<double> empty_fringe_lProbs;
+    configurations.swap(empty_configurations);
+    fringe.swap(empty_fringe);
+    fringe_lProbs.swap(empty_fringe_lProbs);
+    fringe_ready = false;
+    allocator.clear();
+    confs = nullptr;
+}
+
+void PrecalculatedMarginal::expand_confs()
+{
+    configurations.reserve(compact_table->size());
+    for(size_t ii = 0; ii < compact_table->size(); ii++)
+    {
+        Conf conf = allocator.newConf();
+        compact_table->get(ii, conf);
+        configurations.push_back(conf);
+    }
+    confs = configurations.data();
+    compact_table.reset();
+}
 
+void PrecalculatedMarginal::set_no_confs(unsigned int new_no_confs)
+{
+    // lProbs[no_confs] is the -inf guardian. If it isn't the last element it overwrites a stored value.
+    const unsigned int stored = stored_no_confs();
+    if(no_confs < stored)
+        lProbs[no_confs] = hidden_lProb;
+
+    no_confs = new_no_confs;
+
+    if(no_confs < stored)
+    {
+        hidden_lProb = lProbs[no_confs];
+        lProbs[no_confs] = -std::numeric_limits<double>::infinity();
+    }
+}
+
+void PrecalculatedMarginal::extend_binomial(double lCutOff)
+{
+    extend_binomial_range(binomial_lo, binomial_hi, lCutOff - loggamma_nominator, [this](int k, double unn_lprob)
+    {
+        Conf conf = allocator.newConf();
+        conf[0] = k;
+        conf[1] = atomCnt - k;
+        configurations.push_back(conf);
+        lProbs.push_back(unn_lprob + loggamma_nominator);
+    });
+}
+
+void PrecalculatedMarginal::extend_from_fringe(unsigned int old_size, double lCutOff)
+{
+    if(!fringe_ready)
+    {
+        if(old_size == 0)
+        {
+            fringe.push_back(allocator.makeCopy(mode_conf));
+            fringe_lProbs.push_back(mode_lprob);
+        }
+        else
+            explore<false, true>(0, stored_lCutOff);
+        fringe_ready = true;
+    }
+
+    pod_vector<Conf> new_fringe;
+    pod_vector<double> new_fringe_lProbs;
+
+    for(size_t ii = 0; ii < fringe.size(); ii++)
+        if(fringe_lProbs[ii] >= lCutOff)
+        {
+            configurations.push_back(fringe[ii]);
+            lProbs.push_back(fringe_lProbs[ii]);
+        }
+        else
+        {
+            new_fringe.push_back(fringe[ii]);
+            new_fringe_lProbs.push_back(fringe_lProbs[ii]);
+        }
+
+    fringe.swap(new_fringe);
+    fringe_lProbs.swap(new_fringe_lProbs);
+
+    explore<true, true>(old_size, lCutOff);
+}
+
+void PrecalculatedMarginal::extend(double lCutOff)
+{
+    const unsigned int old_size = configurations.size();
+
+    lProbs.pop_back();  // Remove the -inf guardian
+
+    if(isotopeNo == 2)
+        extend_binomial(lCutOff);
+    else
+        extend_from_fringe(old_size, lCutOff);
+
+    stored_lCutOff = lCutOff;
     no_confs = configurations.size();
-    confs  = configurations.data();
+    confs = configurations.data();
+
+    if(sorted)
+        sort_stored(old_size);
+    else
+    {
+        lProbs.push_back(-std::numeric_limits<double>::infinity());
+        lProbs_data = lProbs.data();
+        recompute_probs_and_masses();
+    }
+}
+
+/*
+ * Sort the stored subisotopologues by descending probability, given that the first
+ * sorted_prefix of them are already sorted. The -inf guardian must not be present
+ * (unless sorted_prefix is zero), it is restored afterwards.
+ */
+void PrecalculatedMarginal::sort_stored(unsigned int sorted_prefix)
+{
+    if(sorted_prefix == 0 && lProbs.size() > no_confs)
+        lProbs.pop_back();
+
+    const size_t new_size = no_confs - sorted_prefix;
+
+    if(new_size > 0)
+        radix_sort_descending(lProbs.data() + sorted_prefix, confs + sorted_prefix, new_size);
 
-    if(sort && no_confs > 0)
+    if(sorted_prefix > 0 && new_size > 0)
     {
-            std::unique_ptr<size_t[]> order_arr(get_inverse_order(lProbs.data(), no_confs));
-            impose_order(order_arr.get(), no_confs, lProbs.data(), confs);
+        // Merge the two sorted runs. Ties are resolved in favour of the older subisotopologues.
+        std::unique_ptr<size_t[]> order_arr(new size_t[no_confs]);
+        size_t left = 0, right = sorted_prefix;
+        for(size_t ii = 0; ii < no_confs; ii++)
+            if(right >= no_confs || (left < sorted_prefix && lProbs[left] >= lProbs[right]))
+                order_arr[ii] = left++;
+            else
+                order_arr[ii] = right++;
+        impose_order(order_arr.get(), no_confs, lProbs.data(), confs);
     }
 
+    sorted = true;
+    lProbs.push_back(-std::numeric_limits<double>::infinity());
+    lProbs_data = lProbs.data();
+    recompute_probs_and_masses();
+}
+
+void PrecalculatedMarginal::recompute_probs_and_masses()
+{
+    delete[] probs;
+    delete[] masses;
+
     probs = new double[no_confs];
     masses = new double[no_confs];
 
-
     for(unsigned int ii = 0; ii < no_confs; ii++)
-    {
         probs[ii] = exp(lProbs[ii]);
-        masses[ii] = calc_mass(confs[ii], atom_masses, isotopeNo);
+
+    compute_masses(confs, no_confs, masses);
+}
+
+
+PrecalculatedMarginal::PrecalculatedMarginal(const PrecalculatedMarginal& other, unsigned int start, unsigned int end) :
+Marginal(other),
+allocator(isotopeNo, end - start + 1),
+stored_lCutOff(other.stored_lCutOff),
+hidden_lProb(0.0),
+sorted(other.sorted),
+fringe_ready(false),
+binomial_lo(0),
+binomial_hi(-1)
+{
+    no_confs = end - start;
+
+    probs = new double[no_confs];
+    masses = new double[no_confs];
+
+    for(unsigned int ii = start; ii < end; ii++)
+    {
+        Conf conf = allocator.newConf();
+        other.get_conf(ii, conf);
+        configurations.push_back(conf);
+        lProbs.push_back(other.lProbs_data[ii]);
     }
 
+    confs = configurations.data();
+    memcpy(probs, other.probs + start, no_confs*sizeof(double));
+    memcpy(masses, other.masses + start, no_confs*sizeof(double));
+
     lProbs.push_back(-std::numeric_limits<double>::infinity());
+    lProbs_data = lProbs.data();
 }
 
-
 PrecalculatedMarginal::~PrecalculatedMarginal()
 {
     if(masses != nullptr)
@@ -548,30 +962,117 @@ PrecalculatedMarginal::~PrecalculatedMarginal()
 }
 
 
+// The infinite cut-off makes the base class start with an empty table, which is then filled by combine()
+FusedMarginal::FusedMarginal(PrecalculatedMarginal* _first, PrecalculatedMarginal* _second, double lCutOff) :
+PrecalculatedMarginal(Marginal(*_first, *_second), std::numeric_limits<double>::infinity(), true, 1),
+first(_first),
+second(_second)
+{
+    combine(lCutOff);
+}
+
+FusedMarginal::~FusedMarginal()
+{
+    delete first;
+    delete second;
+}
+
+void FusedMarginal::retarget(double lCutOff)
+{
+    first->retarget(lCutOff - mode_lprob + first->getModeLProb());
+    second->retarget(lCutOff - mode_lprob + second->getModeLProb());
+    combine(lCutOff);
+}
+
+void FusedMarginal::combine(double lCutOff)
+{
+    // Both marginals are sorted and terminated with -inf guardians, so the loops can stop at the first pair below the cut-off
+    pod_vector<double> new_lProbs;
+    pod_vector<unsigned int> pairs;
+
+    for(unsigned int ii = 0; first->get_lProb(ii) + second->get_lProb(0) >= lCutOff; ii++)
+        for(unsigned int jj = 0; first->get_lProb(ii) + second->get_lProb(jj) >= lCutOff; jj++)
+        {
+            new_lProbs.push_back(first->get_lProb(ii) + second->get_lProb(jj));
+            pairs.push_back(ii);
+            pairs.push_back(jj);
+        }
+
+    no_confs = new_lProbs.size();
+
+    const unsigned int first_isotopeNo = first->get_isotopeNo();
+    const unsigned int second_isotopeNo = second->get_isotopeNo();
+
+    pod_vector<int> new_conf_storage;
+    pod_vector<Conf> new_configurations;
+    new_conf_storage.resize(static_cast<size_t>(no_confs) * isotopeNo);
+    new_configurations.reserve(no_confs);
+
+    for(unsigned int ii = 0; ii < no_confs; ii++)
+    {
+        Conf conf = new_conf_storage.data() + static_cast<size_t>(ii) * isotopeNo;
+        memcpy(conf, first->get_conf(pairs[2*ii]), first_isotopeNo*sizeof(int));
+        memcpy(conf + first_isotopeNo, second->get_conf(pairs[2*ii+1]), second_isotopeNo*sizeof(int));
+        new_configurations.push_back(conf);
+    }
+
+    conf_storage.swap(new_conf_storage);
+    configurations.swap(new_configurations);
+    lProbs.swap(new_lProbs);
+    confs = configurations.data();
+
+    if(no_confs > 0)
+        radix_sort_descending(lProbs.data(), confs, no_confs);
+
+    lProbs.push_back(-std::numeric_limits<double>::infinity());
+    lProbs_data = lProbs.data();
+    stored_lCutOff = lCutOff;
+    hidden_lProb = 0.0;
+
+    recompute_probs_and_masses();
+}
+
+
 
 
 
 
 
-LayeredMarginal::LayeredMarginal(Marginal&& m, int tabSize, int)
-: Marginal(std::move(m)), current_threshold(1.0), allocator(isotopeNo, tabSize),
-equalizer(isotopeNo), keyHasher(isotopeNo)
+LayeredMarginal::LayeredMarginal(Marginal&& m, int tabSize, int, int _fine_bins)
+: Marginal(std::move(m)), current_threshold(1.0), binomial_lo(mode_conf[0]), binomial_hi(mode_conf[0]-1),
+allocator(isotopeNo, tabSize), equalizer(isotopeNo), keyHasher(isotopeNo), fine_bins(_fine_bins)
 {
-    fringe.push_back(mode_conf);
+    if(fine_bins > 0)
+    {
+        aggregate();
+        // The top bin gathers many subisotopologues: it's more probable than the mode
+        mode_lprob = aggregated_lProbs[0];
+    }
+    // Two-isotope marginals are extended by walking the binomial range instead
+    else if(isotopeNo != 2)
+    {
+        fringe.push_back(mode_conf);
+        fringe_unn_lprobs.push_back(unnormalized_logProb(mode_conf));
+    }
     lProbs.push_back(std::numeric_limits<double>::infinity());
-    fringe_unn_lprobs.push_back(unnormalized_logProb(mode_conf));
     lProbs.push_back(-std::numeric_limits<double>::infinity());
     guarded_lProbs = lProbs.data()+1;
 }
 
-bool LayeredMarginal::extend(double new_threshold, bool do_sort)
+void LayeredMarginal::extend_from_fringe(double new_threshold)
 {
-    new_threshold -= loggamma_nominator;
-    if(fringe.empty())
-        return false;
-
-    lProbs.pop_back();  // Remove the +inf guardian
+    // Two-isotope elements don't get here, and single-isotope ones have no neighbours
+    switch(isotopeNo)
+    {
+        case 3: extend_from_fringe_n<3>(new_threshold); break;
+        case 4: extend_from_fringe_n<4>(new_threshold); break;
+        default: extend_from_fringe_n<0>(new_threshold);
+    }
+}
 
+template<int N> void LayeredMarginal::extend_from_fringe_n(double new_threshold)
+{
+    const unsigned int dim = N > 0 ? N : isotopeNo;
     pod_vector<Conf> new_fringe;
     pod_vector<double> new_fringe_unn_lprobs;
 
@@ -593,7 +1094,7 @@ bool LayeredMarginal::extend(double new_threshold, bool do_sort)
         {
             configurations.push_back(currentConf);
             lProbs.push_back(opc+loggamma_nominator);
-            for(unsigned int ii = 0; ii < isotopeNo; ii++ )
+            for(unsigned int ii = 0; ii < dim; ii++ )
             {
                 if(currentConf[ii] > mode_conf[ii])
                     continue;
@@ -601,7 +1102,7 @@ bool LayeredMarginal::extend(double new_threshold, bool do_sort)
                 if(currentConf[ii] > 0)
                 {
                     currentConf[ii]--;
-                    for(unsigned int jj = 0; jj < isotopeNo; jj++ )
+                    for(unsigned int jj = 0; jj < dim; jj++ )
                     {
                         if(currentConf[jj] < mode_conf[jj])
                             continue;
@@ -611,7 +1112,7 @@ bool LayeredMarginal::extend(double new_threshold, bool do_sort)
                             Conf nc = allocator.makeCopy(currentConf);
                             nc[jj]++;
 
-                            double lpc = unnormalized_logProb(nc);
+                            double lpc = IsoSpec::unnormalized_logProb<N>(nc, atom_lProbs, dim);
                             if(lpc >= new_threshold)
                             {
                                 fringe.push_back(nc);
@@ -636,21 +1137,247 @@ bool LayeredMarginal::extend(double new_threshold, bool do_sort)
         }
     }
 
-    current_threshold = new_threshold;
     fringe.swap(new_fringe);
     fringe_unn_lprobs.swap(new_fringe_unn_lprobs);
+}
+
+/*
+ * A distribution of the numbers of extra neutrons (over the lightest isotopes), each split into the fine-structure bins
+ * by the mass defect per extra neutron. Dense in the range of numbers of neutrons [k_lo, k_hi].
+ */
+struct AggregatedDistribution
+{
+    int k_lo;
+    int k_hi;
+    std::vector<double> probs;          // at (k - k_lo) * fine_bins + fine bin
+    std::vector<double> mass_sums;      // The masses (over atomCnt lightest isotopes) weighted by the probabilities
+};
+
+class AggregatedConvolution
+{
+    const int fine_bins;
+    const double defect_min;            // The range of the mass defects per extra neutron
+    const double defect_span;
+    const double min_prob;
+
+ public:
+    AggregatedConvolution(int _fine_bins, double _defect_min, double _defect_span, double _min_prob) :
+    fine_bins(_fine_bins), defect_min(_defect_min), defect_span(_defect_span), min_prob(_min_prob) {}
+
+    ISOSPEC_FORCE_INLINE int fine_bin(int k, double mass) const
+    {
+        if(k == 0 || defect_span <= 0.0)
+            return 0;
+        int ret = static_cast<int>(((mass - k) / k - defect_min) / defect_span * fine_bins);
+        return ret < 0 ? 0 : (ret >= fine_bins ? fine_bins - 1 : ret);
+    }
+
+    //! Add a bin to the distribution, which must cover k.
+    ISOSPEC_FORCE_INLINE void add(AggregatedDistribution& dist, int k, double prob, double mass) const
+    {
+        size_t idx = static_cast<size_t>(k - dist.k_lo) * fine_bins + fine_bin(k, mass);
+        dist.probs[idx] += prob;
+        dist.mass_sums[idx] += prob * mass;
+    }
+
+    void convolve(const AggregatedDistribution& a, const AggregatedDistribution& b, AggregatedDistribution& out) const
+    {
+        out.k_lo = a.k_lo + b.k_lo;
+        out.k_hi = a.k_hi + b.k_hi;
+        const size_t size = static_cast<size_t>(out.k_hi - out.k_lo + 1) * fine_bins;
+        out.probs.assign(size, 0.0);
+        out.mass_sums.assign(size, 0.0);
+
+        // Both are mostly empty: gather the bins of b once
+        std::vector<int> b_ks;
+        std::vector<double> b_probs, b_masses;
+        for(size_t ii = 0; ii < b.probs.size(); ii++)
+            if(b.probs[ii] > 0.0)
+            {
+                b_ks.push_back(b.k_lo + static_cast<int>(ii / fine_bins));
+                b_probs.push_back(b.probs[ii]);
+                b_masses.push_back(b.mass_sums[ii] / b.probs[ii]);
+            }
+
+        for(size_t ii = 0; ii < a.probs.size(); ii++)
+        {
+            const double a_prob = a.probs[ii];
+            if(a_prob <= 0.0)
+                continue;
+            const int a_k = a.k_lo + static_cast<int>(ii / fine_bins);
+            const double a_mass = a.mass_sums[ii] / a_prob;
+            for(size_t jj = 0; jj < b_ks.size(); jj++)
+                add(out, a_k + b_ks[jj], a_prob * b_probs[jj], a_mass + b_masses[jj]);
+        }
+
+        prune(out);
+    }
+
+    //! Drop the bins below min_prob, and shrink the range of numbers of neutrons to the remaining ones.
+    void prune(AggregatedDistribution& dist) const
+    {
+        size_t first = dist.probs.size();
+        size_t last = 0;
+        for(size_t ii = 0; ii < dist.probs.size(); ii++)
+        {
+            if(dist.probs[ii] < min_prob)
+            {
+                dist.probs[ii] = 0.0;
+                dist.mass_sums[ii] = 0.0;
+            }
+            else
+            {
+                if(first > ii)
+                    first = ii;
+                last = ii;
+            }
+        }
+
+        if(first > last)
+        {
+            dist.k_hi = dist.k_lo - 1;
+            dist.probs.clear();
+            dist.mass_sums.clear();
+            return;
+        }
+
+        const size_t k_first = first / fine_bins;
+        const size_t k_last = last / fine_bins;
+        dist.probs.erase(dist.probs.begin() + (k_last + 1) * fine_bins, dist.probs.end());
+        dist.probs.erase(dist.probs.begin(), dist.probs.begin() + k_first * fine_bins);
+        dist.mass_sums.erase(dist.mass_sums.begin() + (k_last + 1) * fine_bins, dist.mass_sums.end());
+        dist.mass_sums.erase(dist.mass_sums.begin(), dist.mass_sums.begin() + k_first * fine_bins);
+        dist.k_hi = dist.k_lo + static_cast<int>(k_last);
+        dist.k_lo += static_cast<int>(k_first);
+    }
+};
+
+void LayeredMarginal::aggregate()
+{
+    const double lightest = *std::min_element(atom_masses, atom_masses + isotopeNo);
+
+    double defect_min = std::numeric_limits<double>::infinity();
+    double defect_max = -std::numeric_limits<double>::infinity();
+    for(unsigned int ii = 0; ii < isotopeNo; ii++)
+    {
+        const int neutrons = static_cast<int>(std::lround(atom_masses[ii] - lightest));
+        if(neutrons > 0)
+        {
+            const double defect = (atom_masses[ii] - lightest - neutrons) / neutrons;
+            defect_min = (std::min)(defect_min, defect);
+            defect_max = (std::max)(defect_max, defect);
+        }
+    }
+    if(defect_min > defect_max)
+        defect_min = defect_max = 0.0;
+
+    // Nudge the top of the range inside the last bin
+    const double defect_span = (defect_max - defect_min) * (1.0 + 1e-9);
+
+    const AggregatedConvolution conv(fine_bins, defect_min, defect_span, exp(ISOSPEC_AGGREGATED_MARGINAL_LCUTOFF - 10.0));
+
+    AggregatedDistribution atom;
+    atom.k_lo = 0;
+    atom.k_hi = 0;
+    for(unsigned int ii = 0; ii < isotopeNo; ii++)
+        atom.k_hi = (std::max)(atom.k_hi, static_cast<int>(std::lround(atom_masses[ii] - lightest)));
+    atom.probs.assign(static_cast<size_t>(atom.k_hi + 1) * fine_bins, 0.0);
+    atom.mass_sums.assign(atom.probs.size(), 0.0);
+    for(unsigned int ii = 0; ii < isotopeNo; ii++)
+        conv.add(atom, static_cast<int>(std::lround(atom_masses[ii] - lightest)), exp(atom_lProbs[ii]), atom_masses[ii] - lightest);
+
+    // No atoms: a single bin holding the empty subisotopologue
+    AggregatedDistribution result;
+    result.k_lo = 0;
+    result.k_hi = 0;
+    result.probs.assign(fine_bins, 0.0);
+    result.mass_sums.assign(fine_bins, 0.0);
+    result.probs[0] = 1.0;
+
+    // Left-to-right binary exponentiation: only the squarings are costly, multiplying by a single atom is cheap
+    AggregatedDistribution tmp;
+    bool started = false;
+    for(int bit = 31; bit >= 0; bit--)
+    {
+        if(started)
+        {
+            conv.convolve(result, result, tmp);
+            std::swap(result, tmp);
+        }
+        if((atomCnt >> bit) & 1u)
+        {
+            conv.convolve(result, atom, tmp);
+            std::swap(result, tmp);
+            started = true;
+        }
+    }
+
+    for(size_t ii = 0; ii < result.probs.size(); ii++)
+    {
+        const double lprob = result.probs[ii] > 0.0 ? log(result.probs[ii]) : -std::numeric_limits<double>::infinity();
+        if(lprob >= ISOSPEC_AGGREGATED_MARGINAL_LCUTOFF)
+        {
+            aggregated_lProbs.push_back(lprob);
+            aggregated_masses.push_back(atomCnt * lightest + result.mass_sums[ii] / result.probs[ii]);
+        }
+    }
+
+    radix_sort_descending(aggregated_lProbs.data(), aggregated_masses.data(), aggregated_lProbs.size());
+}
+
+bool LayeredMarginal::extend(double new_threshold, bool do_sort)
+{
+    if(fine_bins > 0)
+    {
+        // All the bins are already there, sorted: just reveal the next ones
+        if(probs.size() == aggregated_lProbs.size())
+            return false;
+        lProbs.pop_back();  // Remove the -inf guardian
+        for(size_t ii = probs.size(); ii < aggregated_lProbs.size() && aggregated_lProbs[ii] >= new_threshold; ii++)
+        {
+            lProbs.push_back(aggregated_lProbs[ii]);
+            probs.push_back(exp(aggregated_lProbs[ii]));
+            masses.push_back(aggregated_masses[ii]);
+        }
+        lProbs.push_back(-std::numeric_limits<double>::infinity());  // Restore guardian
+        guarded_lProbs = lProbs.data()+1;
+        current_threshold = new_threshold;
+        return true;
+    }
+
+    new_threshold -= loggamma_nominator;
+
+    if(isotopeNo == 2)
+    {
+        if(binomial_lo == 0 && binomial_hi == static_cast<int>(atomCnt))
+            return false;
+        lProbs.pop_back();  // Remove the -inf guardian
+        // Comes out sorted, without any search
+        extend_binomial_range(binomial_lo, binomial_hi, new_threshold, [this](int k, double unn_lprob)
+        {
+            Conf conf = allocator.newConf();
+            conf[0] = k;
+            conf[1] = atomCnt - k;
+            configurations.push_back(conf);
+            lProbs.push_back(unn_lprob + loggamma_nominator);
+        });
+        do_sort = false;
+    }
+    else
+    {
+        if(fringe.empty())
+            return false;
+        lProbs.pop_back();  // Remove the -inf guardian
+        extend_from_fringe(new_threshold);
+    }
+
+    current_threshold = new_threshold;
 
     if(do_sort)
     {
         size_t to_sort_size = configurations.size() - probs.size();
         if(to_sort_size > 0)
-        {
-            std::unique_ptr<size_t[]> order_arr(get_inverse_order(lProbs.data()+1+probs.size(), to_sort_size));
-            double* P = lProbs.data()+1+probs.size();
-            Conf* C = configurations.data()+probs.size();
-            size_t* O = order_arr.get();
-            impose_order(O, to_sort_size, P, C);
-        }
+            radix_sort_descending(lProbs.data()+1+probs.size(), configurations.data()+probs.size(), to_sort_size);
     }
 
     if(probs.capacity() * 2 < configurations.size() + 2)
@@ -662,11 +1389,12 @@ bool LayeredMarginal::extend(double new_threshold, bool do_sort)
        // but don't reallocate on every call
 
 //    printVector(lProbs);
-    for(unsigned int ii = probs.size(); ii < configurations.size(); ii++)
-    {
+    const size_t old_size = probs.size();
+    for(size_t ii = old_size; ii < configurations.size(); ii++)
         probs.push_back(exp(lProbs[ii+1]));
-        masses.push_back(calc_mass(configurations[ii], atom_masses, isotopeNo));
-    }
+
+    masses.resize(configurations.size());
+    compute_masses(configurations.data() + old_size, configurations.size() - old_size, masses.data() + old_size);
 
     lProbs.push_back(-std::numeric_limits<double>::infinity());  // Restore guardian
 
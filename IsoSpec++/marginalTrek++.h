@@ -16,18 +16,37 @@
 
 #pragma once
 
+#include <cstring>
 #include <queue>
 #include <algorithm>
 #include <vector>
 #include <functional>
+#include <memory>
 #include <utility>
 #include "conf.h"
 #include "allocator.h"
+#include "compactConfTable.h"
 #include "operators.h"
 #include "summator.h"
 #include "pod_vector.h"
 
 
+/*
+ * The aggregated LayeredMarginals hold only the bins with log-probability at least this, and drop the intermediate
+ * ones a bit below it while they are computed.
+ */
+#ifndef ISOSPEC_AGGREGATED_MARGINAL_LCUTOFF
+#define ISOSPEC_AGGREGATED_MARGINAL_LCUTOFF -50.0
+#endif
+
+/*
+ * Marginals derived for atom counts differing by at most this much find their mode starting from the mode of
+ * the original one. Larger differences start from the mean, as marginals constructed from scratch do.
+ */
+#ifndef ISOSPEC_DERIVED_MODE_MAX_STEPS
+#define ISOSPEC_DERIVED_MODE_MAX_STEPS 64
+#endif
+
 namespace IsoSpec
 {
 
@@ -43,6 +62,10 @@ class Marginal
 {
  private:
     bool disowned;
+
+    //! See FromLProbs().
+    Marginal(int _isotopeNo, int _atomCnt, const double* _masses, const double* _lProbs);
+
  protected:
     const unsigned int isotopeNo;       /*!< The number of isotopes of the given element. */
     const unsigned int atomCnt;         /*!< The number of atoms of the given element. */
@@ -69,6 +92,13 @@ class Marginal
         int _atomCnt
     );
 
+    //! Construct the marginal distribution from the log-probabilities of the isotopes (as get_lProbs() gives them) instead of their frequencies.
+    /*!
+        Unlike the frequencies, which are converted to log-probabilities, these are taken as they are: this reproduces
+        a marginal exactly, e.g. from a saved TotalProbState. The parameters are the same as the constructor's, but for _lProbs.
+    */
+    static Marginal FromLProbs(const double* _masses, const double* _lProbs, int _isotopeNo, int _atomCnt);
+
     // Get rid of the C++ generated assignment constructor.
     Marginal& operator= (const Marginal& other) = delete;
 
@@ -78,6 +108,27 @@ class Marginal
     //! Move constructor.
     Marginal(Marginal&& other);
 
+    //! Construct the marginal distribution of the same element with a different number of atoms.
+    /*!
+        The mode subisotopologue is found starting from the mode of other (if computed), instead of from scratch,
+        and the isotope data is copied as it is. This is meant for series of molecules differing by a few atoms
+        (polymer or peptide ladders, adduct series). The PrecalculatedMarginal and LayeredMarginal of the derived
+        marginal are obtained with their move constructors (see also PrecalculatedMarginal::derive()). Not meaningful
+        for joint distributions of several elements.
+        \param other The marginal distribution of the element.
+        \param delta The number of atoms to add to (or, if negative, remove from) the atom count of other.
+        \return An instance of the Marginal class, with its mode subisotopologue computed.
+    */
+    Marginal(const Marginal& other, int delta);
+
+    //! Construct the joint distribution of two marginals, whose subisotopologues are the concatenations of theirs.
+    /*!
+        Only the (log-)probabilities and masses of such subisotopologues are meaningful: the methods relying on
+        the distribution being multinomial (like computeModeConf() or variance()) are not. Both marginals must
+        have their mode subisotopologues computed.
+    */
+    Marginal(const Marginal& first, const Marginal& second);
+
     //! Destructor.
     virtual ~Marginal();
 
@@ -89,6 +140,11 @@ class Marginal
 
     inline const double* get_lProbs() const { return atom_lProbs; }
 
+    inline const double* get_atom_masses() const { return atom_masses; }
+
+    //! Get the number of atoms of the investigated element.
+    inline int get_atomCnt() const { return atomCnt; }
+
     //! Get the mass of the lightest subisotopologue.
     /*! This is trivially obtained by considering all atomNo atoms to be the lightest isotope possible.
         \return The mass of the lightiest subisotopologue.
@@ -121,7 +177,7 @@ class Marginal
     inline double getModeLProb() { ensureModeConf(); return mode_lprob; }
 
     //! Get the log-probability of the mode subisotopologue. Results undefined if ensureModeConf() wasn't called before.
-    inline double fastGetModeLProb() { return mode_lprob; }
+    inline double fastGetModeLProb() const { return mode_lprob; }
 
     //! The the probability of the mode subisotopologue.
     /*!
@@ -158,6 +214,46 @@ class Marginal
  protected:
     ISOSPEC_FORCE_INLINE double unnormalized_logProb(Conf conf) const { double ret = 0.0; for(size_t ii = 0; ii < isotopeNo; ii++) ret += minuslogFactorial(conf[ii]) + conf[ii] * atom_lProbs[ii]; return ret; }
     ISOSPEC_FORCE_INLINE double logProb(Conf conf) const { return loggamma_nominator + unnormalized_logProb(conf); }
+
+    //! Compute the masses of count subisotopologues, with the loop specialized for the number of isotopes.
+    void compute_masses(const Conf* confs, size_t count, double* out) const;
+
+    //! Walk the subisotopologues of a two-isotope element outwards from the ones already visited.
+    /*!
+        The subisotopologues are (k, atomCnt-k), and their log-probabilities decrease monotonically on both sides of the mode,
+        so the ones above a threshold form a range of k around it. The visited range [lo, hi] is extended with all the
+        subisotopologues with unnormalized log-probability at least unn_threshold, and these are passed to emit(k, unn_lprob)
+        by descending probability. Start with lo = mode_conf[0] and hi = lo - 1.
+    */
+    template<typename Emit> void extend_binomial_range(int& lo, int& hi, double unn_threshold, Emit emit) const
+    {
+        const int n = atomCnt;
+        int conf[2];
+        auto unn_lprob = [&](int k) { conf[0] = k; conf[1] = n - k; return unnormalized_logProb(conf); };
+
+        double left = lo > 0 ? unn_lprob(lo - 1) : 0.0;
+        double right = hi < n ? unn_lprob(hi + 1) : 0.0;
+
+        while(lo > 0 || hi < n)
+        {
+            const bool go_left = hi >= n || (lo > 0 && left >= right);
+            const double lprob = go_left ? left : right;
+            if(lprob < unn_threshold)
+                return;
+            if(go_left)
+            {
+                lo--;
+                emit(lo, lprob);
+                left = lo > 0 ? unn_lprob(lo - 1) : 0.0;
+            }
+            else
+            {
+                hi++;
+                emit(hi, lprob);
+                right = hi < n ? unn_lprob(hi + 1) : 0.0;
+            }
+        }
+    }
  public:
     //! Calculate the variance of the theoretical distribution describing the subisotopologue
     double variance() const;
@@ -256,8 +352,18 @@ class PrecalculatedMarginal : public Marginal
     unsigned int no_confs;
     double* masses;
     pod_vector<double> lProbs;
+    double* lProbs_data;            /*!< lProbs.data(), or the log-probabilities stored elsewhere (see MappedMarginal). */
     double* probs;
     Allocator<int> allocator;
+    double stored_lCutOff;          /*!< The lowest cut-off for which the subisotopologues have been computed so far. */
+    double hidden_lProb;            /*!< The log-probability overwritten by the -inf guardian if not all stored subisotopologues are in use. */
+    bool sorted;
+    bool fringe_ready;
+    pod_vector<Conf> fringe;        /*!< Subisotopologues adjacent to the stored ones, below stored_lCutOff. Built lazily by retarget(). */
+    pod_vector<double> fringe_lProbs;
+    int binomial_lo;                /*!< For two-isotope elements: the stored subisotopologues are (k, atomCnt-k) for k in [binomial_lo, binomial_hi]. */
+    int binomial_hi;
+    std::unique_ptr<CompactConfTable> compact_table;    /*!< If set, holds the subisotopologues instead of configurations. */
  public:
     //! The move constructor (disowns the Marginal).
     /*!
@@ -275,6 +381,15 @@ class PrecalculatedMarginal : public Marginal
         int hashSize = 1000
     );
 
+    //! Construct a marginal holding a contiguous part of the subisotopologues of another one.
+    /*!
+        \param other The marginal to take the subisotopologues from.
+        \param start The index (in other) of the first subisotopologue to be copied.
+        \param end The index (in other) one past the last subisotopologue to be copied.
+        \return An instance of the PrecalculatedMarginal class, independent of other.
+    */
+    PrecalculatedMarginal(const PrecalculatedMarginal& other, unsigned int start, unsigned int end);
+
     PrecalculatedMarginal(const PrecalculatedMarginal& other) = delete;
     PrecalculatedMarginal& operator=(const PrecalculatedMarginal& other) = delete;
 
@@ -292,7 +407,7 @@ class PrecalculatedMarginal : public Marginal
         \param idx The number of the considered subisotopologue.
         \return The log-probability of the idx-th subisotopologue.
     */
-    inline const double& get_lProb(int idx) const { return lProbs[idx]; }
+    inline const double& get_lProb(int idx) const { return lProbs_data[idx]; }
 
     //! Get the probability of the idx-th subisotopologue.
     /*!
@@ -312,7 +427,7 @@ class PrecalculatedMarginal : public Marginal
     /*!
         \return Pointer to the first element in the table storing log-probabilities of subisotopologues.
     */
-    inline const double* get_lProbs_ptr() const { return lProbs.data(); }
+    inline const double* get_lProbs_ptr() const { return lProbs_data; }
 
     //! Get the table of the masses of subisotopologues.
     /*!
@@ -320,6 +435,12 @@ class PrecalculatedMarginal : public Marginal
     */
     inline const double* get_masses_ptr() const { return masses; }
 
+    //! Get the table of the probabilities of subisotopologues.
+    /*!
+        \return Pointer to the first element in the table storing probabilities of subisotopologues.
+    */
+    inline const double* get_probs_ptr() const { return probs; }
+
 
     //! Get the counts of isotopes that define the subisotopologue.
     /*!
@@ -328,6 +449,43 @@ class PrecalculatedMarginal : public Marginal
     */
     inline const Conf& get_conf(int idx) const { return confs[idx]; }
 
+    //! Get the counts of isotopes that define the subisotopologue, in any storage mode.
+    /*!
+        \param idx The number of the considered subisotopologue.
+        \param space The table (of size get_isotopeNo()) to store the counts of isotopes in.
+    */
+    ISOSPEC_FORCE_INLINE void get_conf(int idx, int* space) const
+    {
+        if(compact_table)
+            compact_table->get(idx, space);
+        else
+            memcpy(space, confs[idx], isotopeNo*sizeof(int));
+    }
+
+    //! Switch to storing the subisotopologues compactly, as narrow offsets from the mode (see CompactConfTable).
+    /*!
+        This saves most of the memory taken by the subisotopologues of large marginals, at the cost of
+        decoding them on each get_conf(idx, space) call. get_conf(idx) is not available afterwards.
+        Retargeting to a lower cut-off temporarily decodes the stored subisotopologues.
+    */
+    virtual void compact_confs();
+
+    //! Are the subisotopologues stored compactly?
+    inline bool has_compact_confs() const { return static_cast<bool>(compact_table); }
+
+    //! Construct the marginal of the same element with a different number of atoms.
+    /*!
+        See the derivation constructor of Marginal. The tables are computed anew, sized after those of this marginal.
+        \param delta The number of atoms to add to (or, if negative, remove from) the atom count.
+        \param lCutOff The lower limit on the log-probability of the precomputed subisotopologues.
+        \param sort Should the subisotopologues be stored with descending probability ?
+        \return A new instance of the PrecalculatedMarginal class, independent of this one, owned by the caller.
+    */
+    PrecalculatedMarginal* derive(int delta, double lCutOff, bool sort = true, int tabSize = 1000) const;
+
+    //! Are the subisotopologues stored with descending probability?
+    inline bool is_sorted() const { return sorted; }
+
     //! Get the number of precomputed subisotopologues.
     /*!
         \return The number of precomputed subisotopologues.
@@ -339,6 +497,70 @@ class PrecalculatedMarginal : public Marginal
         \return The log-probability of a/the most probable subisotopologue.
     */
     inline double getModeLProb() const { return mode_lprob; }
+
+    //! Change the lower limit on the log-probability of the precomputed subisotopologues.
+    /*!
+        Raising the cut-off only hides the subisotopologues that fall below it (they are kept for later use).
+        Lowering it below any cut-off used so far extends the table, starting from the fringe of the
+        subisotopologues computed so far, instead of recomputing it from scratch. The pointers obtained
+        from the get_*_ptr() methods and get_conf() are invalidated.
+        Not supported on marginals constructed as a part of another one.
+        \param lCutOff The new lower limit on the log-probability of the precomputed subisotopologues.
+    */
+    virtual void retarget(double lCutOff);
+
+ protected:
+    void recompute_probs_and_masses();
+
+ private:
+    PrecalculatedMarginal(const PrecalculatedMarginal& neighbour, Marginal&& m, double lCutOff, bool sort, int tabSize);
+    void setup(double lCutOff, size_t size_hint);
+    template<bool keep_accepted, bool keep_rejected> void explore(unsigned int idx, double lCutOff);
+    template<bool keep_accepted, bool keep_rejected, int N> void explore_n(unsigned int idx, double lCutOff);
+    void set_no_confs(unsigned int new_no_confs);
+    void extend(double lCutOff);
+    void extend_from_fringe(unsigned int old_size, double lCutOff);
+    void extend_binomial(double lCutOff);
+    void sort_stored(unsigned int sorted_prefix);
+    void expand_confs();
+    inline unsigned int stored_no_confs() const { return compact_table ? compact_table->size() : configurations.size(); }
+};
+
+
+//! The joint distribution of two PrecalculatedMarginals, above a given threshold.
+/*!
+    The subisotopologues are the concatenations of the subisotopologues of the two marginals (first, then second),
+    stored with descending probability. Used to replace a few small marginals by a single one, so that fewer of
+    them have to be iterated over.
+*/
+class FusedMarginal : public PrecalculatedMarginal
+{
+ private:
+    PrecalculatedMarginal* first;
+    PrecalculatedMarginal* second;
+    pod_vector<int> conf_storage;
+
+    void combine(double lCutOff);
+
+ public:
+    //! Constructor, taking the ownership of the two marginals.
+    /*!
+        \param _first, _second The marginals to be combined. They must be sorted, and must store all the
+                               subisotopologues which can be a part of one above lCutOff.
+        \param lCutOff The lower limit on the log-probability of the stored subisotopologues.
+    */
+    FusedMarginal(PrecalculatedMarginal* _first, PrecalculatedMarginal* _second, double lCutOff);
+
+    FusedMarginal(const FusedMarginal& other) = delete;
+    FusedMarginal& operator=(const FusedMarginal& other) = delete;
+
+    virtual ~FusedMarginal();
+
+    //! Retarget both the marginals and recombine them. See PrecalculatedMarginal::retarget().
+    void retarget(double lCutOff) override;
+
+    //! Fused marginals are small, so their subisotopologues are always stored as they are.
+    void compact_confs() override {}
 };
 
 
@@ -352,6 +574,8 @@ class LayeredMarginal : public Marginal
  private:
     double current_threshold;
     pod_vector<Conf> configurations;
+    int binomial_lo;                /*!< For two-isotope elements, which have no fringe: see PrecalculatedMarginal::binomial_lo. */
+    int binomial_hi;
     pod_vector<Conf> fringe;
     pod_vector<double> fringe_unn_lprobs;
     Allocator<int> allocator;
@@ -361,14 +585,28 @@ class LayeredMarginal : public Marginal
     pod_vector<double> probs;
     pod_vector<double> masses;
     double* guarded_lProbs;
+    const int fine_bins;                /*!< The number of fine-structure bins per nominal mass in the aggregated mode, 0 if the subisotopologues are enumerated. */
+    pod_vector<double> aggregated_lProbs;   /*!< In the aggregated mode: the log-probabilities of all the bins, sorted descending. */
+    pod_vector<double> aggregated_masses;   /*!< In the aggregated mode: the average masses of the subisotopologues in the bins. */
+
+    void extend_from_fringe(double new_threshold);
+    template<int N> void extend_from_fringe_n(double new_threshold);
+    void aggregate();
 
  public:
     //! Move constructor: specializes the Marginal class.
     /*!
         \param tabSize The size of the table used to store configurations in the allocator.
         \param hashSize The size of the hash table used to store visited subisotopologues.
+        \param _fine_bins If positive, the marginal is aggregated: instead of the subisotopologues, it holds bins of them,
+               one per number of extra neutrons and fine-structure bin, with _fine_bins fine-structure bins per nominal mass
+               (splitting the range of possible mass defects evenly). Each bin has the total probability and the average mass
+               of its subisotopologues. The bins are computed by repeated squaring of the distribution of a single atom,
+               without ever enumerating the subisotopologues, so this works for any number of atoms (the cost only depends
+               on the width of the distribution), down to the log-probability ISOSPEC_AGGREGATED_MARGINAL_LCUTOFF.
+               The configurations (get_conf()) are not available in the aggregated mode.
     */
-    LayeredMarginal(Marginal&& m, int tabSize = 1000, int hashSize = 1000);  // NOLINT(runtime/explicit) - constructor deliberately left usable as a conversion
+    LayeredMarginal(Marginal&& m, int tabSize = 1000, int hashSize = 1000, int _fine_bins = 0);  // NOLINT(runtime/explicit) - constructor deliberately left usable as a conversion
 
     LayeredMarginal(const LayeredMarginal& other) = delete;
     LayeredMarginal& operator=(const LayeredMarginal& other) = delete;
@@ -392,11 +630,23 @@ class LayeredMarginal : public Marginal
     //! get the pointer to lProbs array. Accessing index -1 is legal and returns a guardian of -inf. Warning: The pointer gets invalidated on calls to extend()
     inline const double* get_lProbs_ptr() const { return lProbs.data()+1; }
 
+    //! get the pointer to masses array. Warning: The pointer gets invalidated on calls to extend()
+    inline const double* get_masses_ptr() const { return masses.data(); }
+
+    //! get the pointer to probs array. Warning: The pointer gets invalidated on calls to extend()
+    inline const double* get_probs_ptr() const { return probs.data(); }
+
     //! get the counts of isotopes that define the subisotopologue, see details in @ref PrecalculatedMarginal::get_conf.
     inline const Conf& get_conf(int idx) const { return configurations[idx]; }
 
-    //! Get the number of precomputed subisotopologues, see details in @ref PrecalculatedMarginal::get_no_confs.
-    inline unsigned int get_no_confs() const { return configurations.size(); }
+    //! Get the number of precomputed subisotopologues (or bins, in the aggregated mode), see details in @ref PrecalculatedMarginal::get_no_confs.
+    inline unsigned int get_no_confs() const { return probs.size(); }
+
+    //! Is the marginal aggregated into bins (see the constructor)?
+    inline bool is_aggregated() const { return fine_bins > 0; }
+
+    //! Get the lowest log-probability that extend() can ever reach: of the least probable subisotopologue, or bin in the aggregated mode.
+    inline double getLowestLProb() const { return fine_bins > 0 ? aggregated_lProbs.back() : getSmallestLProb(); }
 
     //! Get the minimal mass in current layer
     double get_min_mass() const;
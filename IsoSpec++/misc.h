@@ -19,7 +19,12 @@
 #include <iostream>
 #include <vector>
 #include <cstring>
+#include <cstdint>
 #include <algorithm>
+#include <memory>
+#include <thread>
+#include <exception>
+#include "platform.h"
 #include "isoMath.h"
 #include "pod_vector.h"
 
@@ -80,6 +85,36 @@ inline double calc_mass(const int* conf, const double* masses, int dim)
     return res;
 }
 
+/*
+ * Variants of the above for a number of isotopes known at compile time (N), so that the
+ * loops get unrolled. N == 0 stands for the generic case, using the runtime dim.
+ */
+template<int N> ISOSPEC_FORCE_INLINE double unnormalized_logProb(const int* conf, const double* logProbs, int dim)
+{
+    constexpr_if(N > 0)
+        dim = N;
+
+    double res = 0.0;
+
+    for(int i = 0; i < dim; i++)
+        res += minuslogFactorial(conf[i]) + conf[i] * logProbs[i];
+
+    return res;
+}
+
+template<int N> ISOSPEC_FORCE_INLINE double calc_mass(const int* conf, const double* masses, int dim)
+{
+    constexpr_if(N > 0)
+        dim = N;
+
+    double res = 0.0;
+
+    for(int i = 0; i < dim; i++)
+        res += conf[i] * masses[i];
+
+    return res;
+}
+
 
 
 template<typename T> void printArray(const T* array, int size, const char* prefix = "")
@@ -123,6 +158,14 @@ template <typename T> inline static T* array_copy(const T* A, int size)
     return ret;
 }
 
+template <typename T> inline static T* array_concat(const T* A, int sizeA, const T* B, int sizeB)
+{
+    T* ret = new T[sizeA + sizeB];
+    memcpy(ret, A, sizeA*sizeof(T));
+    memcpy(ret + sizeA, B, sizeB*sizeof(T));
+    return ret;
+}
+
 template <typename T> static T* array_copy_nptr(const T* A, int size)
 {
     if(A == nullptr)
@@ -154,7 +197,7 @@ template<typename T> size_t* get_order(T* order_array, size_t N)
     for(size_t ii = 0; ii < N; ii++)
         arr[ii] = ii;
 
-    std::sort(arr, arr + N, [&](int i, int j) { return order_array[i] < order_array[j]; });
+    std::sort(arr, arr + N, [&](size_t i, size_t j) { return order_array[i] < order_array[j]; });
 
     return arr;
 }
@@ -165,7 +208,7 @@ template<typename T> size_t* get_inverse_order(T* order_array, size_t N)
     for(size_t ii = 0; ii < N; ii++)
         arr[ii] = ii;
 
-    std::sort(arr, arr + N, [&](int i, int j) { return order_array[i] > order_array[j]; });
+    std::sort(arr, arr + N, [&](size_t i, size_t j) { return order_array[i] > order_array[j]; });
 
     return arr;
 }
@@ -195,5 +238,132 @@ template<typename TA, typename TB> void impose_order(size_t* O, size_t N, TA* A,
     }
 }
 
+// Maps doubles (other than NaNs) to integers whose unsigned order is the descending order of the doubles
+// Negative zeros get the key of positive zeros, as they compare equal to them
+ISOSPEC_FORCE_INLINE uint64_t descending_radix_key(double d)
+{
+    const uint64_t sign = static_cast<uint64_t>(1) << 63;
+    uint64_t u;
+    memcpy(&u, &d, sizeof(u));
+    if(u == sign)
+        u = 0;
+    return (u & sign) ? u : ~u & ~sign;
+}
+
+ISOSPEC_FORCE_INLINE double descending_radix_key_inverse(uint64_t u)
+{
+    const uint64_t sign = static_cast<uint64_t>(1) << 63;
+    u = (u & sign) ? u : ~u & ~sign;
+    double d;
+    memcpy(&d, &u, sizeof(d));
+    return d;
+}
+
+//! Sort the keys by descending value, carrying the values along, in linear time.
+/*!
+    This is a least-significant-digit radix sort on the bit patterns of the keys, with 11-bit digits. The digits
+    that are the same for all the keys (like the sign and most of the exponent, for log-probabilities
+    of similar magnitudes) are skipped. Small arrays are sorted by comparisons instead. NaNs are not allowed.
+    The sort is stable for the large arrays; negative zeros are tied with positive ones, and come out as positive zeros.
+*/
+template<typename TB> void radix_sort_descending(double* keys, TB* values, size_t N)
+{
+    if(N < 4096)
+    {
+        std::unique_ptr<size_t[]> order_arr(get_inverse_order(keys, N));
+        impose_order(order_arr.get(), N, keys, values);
+        return;
+    }
+
+    std::unique_ptr<uint64_t[]> bits(new uint64_t[2*N]);
+    std::unique_ptr<TB[]> values_tmp(new TB[N]);
+    uint64_t* src_bits = bits.get();
+    uint64_t* dst_bits = bits.get() + N;
+    TB* src_values = values;
+    TB* dst_values = values_tmp.get();
+
+    const int digit_bits = 11;
+    const int no_digits = 6;
+    const size_t radix = static_cast<size_t>(1) << digit_bits;
+    const uint64_t mask = radix - 1;
+
+    // The histograms of all the digits are computed in a single pass
+    std::unique_ptr<size_t[]> counts(new size_t[no_digits*radix]());
+    for(size_t ii = 0; ii < N; ii++)
+    {
+        const uint64_t key = descending_radix_key(keys[ii]);
+        src_bits[ii] = key;
+        for(int digit = 0; digit < no_digits; digit++)
+            counts[digit*radix + ((key >> (digit_bits*digit)) & mask)]++;
+    }
+
+    for(int digit = 0; digit < no_digits; digit++)
+    {
+        size_t* count = counts.get() + digit*radix;
+        const int shift = digit_bits*digit;
+
+        if(count[(src_bits[0] >> shift) & mask] == N)
+            continue;
+
+        size_t offset = 0;
+        for(size_t ii = 0; ii < radix; ii++)
+        {
+            const size_t c = count[ii];
+            count[ii] = offset;
+            offset += c;
+        }
+
+        for(size_t ii = 0; ii < N; ii++)
+        {
+            const size_t pos = count[(src_bits[ii] >> shift) & mask]++;
+            dst_bits[pos] = src_bits[ii];
+            dst_values[pos] = src_values[ii];
+        }
+
+        std::swap(src_bits, dst_bits);
+        std::swap(src_values, dst_values);
+    }
+
+    if(src_values != values)
+        memcpy(values, src_values, N*sizeof(TB));
+
+    for(size_t ii = 0; ii < N; ii++)
+        keys[ii] = descending_radix_key_inverse(src_bits[ii]);
+}
+
+// Run f(thread_id) for thread_id in [0, no_threads), in as many threads (the calling one included), and rethrow the first exception
+template<typename F> void run_in_threads(unsigned int no_threads, F f)
+{
+    if(no_threads <= 1)
+    {
+        f(0U);
+        return;
+    }
+
+    std::unique_ptr<std::exception_ptr[]> errors(new std::exception_ptr[no_threads]);
+    auto guarded = [&](unsigned int thread_id)
+    {
+        try
+        {
+            f(thread_id);
+        }
+        catch(...)
+        {
+            errors[thread_id] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(unsigned int ii = 1; ii < no_threads; ii++)
+        threads.emplace_back(guarded, ii);
+    guarded(0);
+    for(std::thread& thread : threads)
+        thread.join();
+
+    for(unsigned int ii = 0; ii < no_threads; ii++)
+        if(errors[ii])
+            std::rethrow_exception(errors[ii]);
+}
+
 
 }  // namespace IsoSpec
@@ -0,0 +1,248 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+#include "parallelOrdered.h"
+#include <algorithm>
+#include <utility>
+
+namespace IsoSpec
+{
+
+// An isotopologue of a layer being sorted
+struct LayerEntry
+{
+    double lprob;
+    size_t pos;         /*!< The position in the layer, in the order of the chunks: breaks the ties independently of the scheduling. */
+    double mass;
+    double prob;
+    const int* conf;    /*!< The counts of isotopes, if stored, are gathered after sorting. */
+};
+
+static inline bool layer_entry_before(const LayerEntry& a, const LayerEntry& b)
+{
+    return a.lprob > b.lprob || (a.lprob == b.lprob && a.pos < b.pos);
+}
+
+
+IsoParallelOrderedGenerator::IsoParallelOrderedGenerator(Iso&& iso, unsigned int _n_threads, size_t _layer_size, size_t _max_queued_layers, bool _get_confs) :
+IsoGenerator(std::move(iso), false),
+layered(std::move(*this)),
+n_threads(_n_threads > 0 ? _n_threads : (std::max)(1U, std::thread::hardware_concurrency())),
+layer_size((std::max<size_t>)(1, _layer_size)),
+max_queued_layers((std::max<size_t>)(1, _max_queued_layers)),
+get_confs(_get_confs),
+current_idx(0),
+current_size(0),
+producer_done(false),
+stop(false)
+{
+    producer = std::thread(&IsoParallelOrderedGenerator::produce, this);
+}
+
+IsoParallelOrderedGenerator::~IsoParallelOrderedGenerator()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    layer_taken.notify_all();
+    producer.join();
+}
+
+bool IsoParallelOrderedGenerator::next_layer()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    layer_ready.wait(lock, [this]() { return !queue.empty() || producer_done; });
+
+    if(queue.empty())
+    {
+        current.reset();
+        current_size = 0;
+        if(error)
+            std::rethrow_exception(error);
+        return false;
+    }
+
+    current = std::move(queue.front());
+    queue.pop_front();
+    current_idx = 0;
+    current_size = current->lprobs.size();
+    lock.unlock();
+    layer_taken.notify_one();
+    return true;
+}
+
+void IsoParallelOrderedGenerator::produce()
+{
+    try
+    {
+        // The layered generator starts at its first layer, just below the mode
+        size_t confs_so_far = 0;
+        double layer_delta;
+        do
+        {
+            std::unique_ptr<Layer> layer(new Layer);
+            compute_layer(*layer);
+
+            confs_so_far += layer->lprobs.size();
+            layer_delta = layered.plan_layer_offset(confs_so_far, static_cast<double>(layer_size));
+
+            if(layer->lprobs.empty())
+                continue;
+
+            std::unique_lock<std::mutex> lock(mutex);
+            layer_taken.wait(lock, [this]() { return stop || queue.size() < max_queued_layers; });
+            if(stop)
+                break;
+            queue.push_back(std::move(layer));
+            lock.unlock();
+            layer_ready.notify_one();
+        } while(!stop && layered.nextLayer(layer_delta));
+    }
+    catch(...)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        error = std::current_exception();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        producer_done = true;
+    }
+    layer_ready.notify_one();
+}
+
+void IsoParallelOrderedGenerator::compute_layer(Layer& layer)
+{
+    std::vector<int> chunks;
+    int no_ranges;
+    const size_t no_chunks = layered.split_layer(ISOSPEC_CHUNKS_PER_THREAD * n_threads, chunks, &no_ranges);
+    if(no_chunks == 0)
+        return;
+    const unsigned int no_workers = static_cast<unsigned int>((std::min<size_t>)(n_threads, no_chunks));
+
+    // Walk through the chunks of the layer. The threads balance the load by grabbing the next unprocessed chunk once they are done with the last one
+    std::vector<Layer> partials(no_workers);
+    std::unique_ptr<unsigned int[]> chunk_thread(new unsigned int[no_chunks]);
+    std::unique_ptr<size_t[]> chunk_start(new size_t[no_chunks]);
+    std::unique_ptr<size_t[]> chunk_end(new size_t[no_chunks]);
+    std::atomic<size_t> next_chunk(0);
+
+    run_in_threads(no_workers, [&](unsigned int thread_id)
+    {
+        Layer& partial = partials[thread_id];
+        std::vector<int> conf(get_confs ? allDim : 0);
+        size_t chunk_idx;
+        while(!stop && (chunk_idx = next_chunk.fetch_add(1)) < no_chunks)
+        {
+            IsoLayeredGenerator chunk_generator(layered, chunks.data() + chunk_idx * 2 * no_ranges, no_ranges);
+            chunk_thread[chunk_idx] = thread_id;
+            chunk_start[chunk_idx] = partial.lprobs.size();
+            while(chunk_generator.advanceToNextConfigurationWithinLayer())
+            {
+                partial.lprobs.push_back(chunk_generator.lprob());
+                partial.masses.push_back(chunk_generator.mass());
+                partial.probs.push_back(chunk_generator.prob());
+                if(get_confs)
+                {
+                    chunk_generator.get_conf_signature(conf.data());
+                    partial.confs.insert(partial.confs.end(), conf.begin(), conf.end());
+                }
+            }
+            chunk_end[chunk_idx] = partial.lprobs.size();
+        }
+    });
+
+    if(stop)
+        return;
+
+    size_t size = 0;
+    for(const Layer& partial : partials)
+        size += partial.lprobs.size();
+
+    if(size == 0)
+        return;
+
+    // Sort the layer: the threads sort contiguous parts of it, which are then merged pairwise
+    const unsigned int no_sorters = size >= ISOSPEC_PARALLEL_SORT_MIN_SIZE ? n_threads : 1;
+    std::vector<LayerEntry> entries(size);
+    std::vector<size_t> chunk_pos(no_chunks);
+    for(size_t ii = 0, pos = 0; ii < no_chunks; ii++)
+    {
+        chunk_pos[ii] = pos;
+        pos += chunk_end[ii] - chunk_start[ii];
+    }
+
+    run_in_threads(no_sorters, [&](unsigned int thread_id)
+    {
+        for(size_t ii = thread_id; ii < no_chunks; ii += no_sorters)
+        {
+            const Layer& partial = partials[chunk_thread[ii]];
+            for(size_t jj = chunk_start[ii]; jj < chunk_end[ii]; jj++)
+            {
+                LayerEntry& entry = entries[chunk_pos[ii] + jj - chunk_start[ii]];
+                entry.lprob = partial.lprobs[jj];
+                entry.pos = chunk_pos[ii] + jj - chunk_start[ii];
+                entry.mass = partial.masses[jj];
+                entry.prob = partial.probs[jj];
+                entry.conf = get_confs ? partial.confs.data() + jj * allDim : nullptr;
+            }
+        }
+    });
+
+    std::vector<size_t> bounds(no_sorters + 1);
+    for(unsigned int ii = 0; ii <= no_sorters; ii++)
+        bounds[ii] = size * ii / no_sorters;
+
+    run_in_threads(no_sorters, [&](unsigned int thread_id)
+    {
+        std::sort(entries.begin() + bounds[thread_id], entries.begin() + bounds[thread_id+1], layer_entry_before);
+    });
+
+    std::vector<LayerEntry> merged(no_sorters > 1 ? size : 0);
+    for(unsigned int width = 1; width < no_sorters; width *= 2)
+    {
+        const unsigned int no_merges = (no_sorters + 2*width - 1) / (2*width);
+        run_in_threads(no_merges, [&](unsigned int merge_id)
+        {
+            const size_t start = bounds[merge_id * 2 * width];
+            const size_t middle = bounds[(std::min)(no_sorters, (merge_id * 2 + 1) * width)];
+            const size_t end = bounds[(std::min)(no_sorters, (merge_id * 2 + 2) * width)];
+            std::merge(entries.begin() + start, entries.begin() + middle, entries.begin() + middle, entries.begin() + end, merged.begin() + start, layer_entry_before);
+        });
+        entries.swap(merged);
+    }
+
+    layer.lprobs.resize(size);
+    layer.masses.resize(size);
+    layer.probs.resize(size);
+    if(get_confs)
+        layer.confs.resize(size * allDim);
+
+    run_in_threads(no_sorters, [&](unsigned int thread_id)
+    {
+        for(size_t ii = bounds[thread_id]; ii < bounds[thread_id+1]; ii++)
+        {
+            layer.lprobs[ii] = entries[ii].lprob;
+            layer.masses[ii] = entries[ii].mass;
+            layer.probs[ii] = entries[ii].prob;
+            if(get_confs)
+                memcpy(layer.confs.data() + ii * allDim, entries[ii].conf, allDim * sizeof(int));
+        }
+    });
+}
+
+}  // namespace IsoSpec
@@ -0,0 +1,134 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "platform.h"
+#include "isoSpec++.h"
+
+/*
+ * The default number of isotopologues IsoParallelOrderedGenerator aims at putting in each layer.
+ */
+#ifndef ISOSPEC_PARALLEL_ORDERED_LAYER_SIZE
+#define ISOSPEC_PARALLEL_ORDERED_LAYER_SIZE 262144
+#endif
+
+/*
+ * The layers of IsoParallelOrderedGenerator with fewer isotopologues are sorted by a single thread.
+ */
+#ifndef ISOSPEC_PARALLEL_SORT_MIN_SIZE
+#define ISOSPEC_PARALLEL_SORT_MIN_SIZE 65536
+#endif
+
+namespace IsoSpec
+{
+
+//! The generator of isotopologues in order of descending probability, computed by many threads.
+/*!
+    It gives the same isotopologues, in the same order (up to ties), as IsoOrderedGenerator, but computes them
+    layer by layer, like IsoLayeredGenerator: the isotopologues between two subsequent log-probability thresholds
+    are enumerated by several threads, each walking through a part of the layer, then sorted in parallel. The
+    thresholds are spaced so that the layers hold about layer_size isotopologues (see IsoLayeredGenerator::plan_layer_offset()). A
+    background thread prepares the next layers (at most max_queued_layers of them) while the current one is
+    being consumed, so the isotopologues are buffered one layer at a time: each layer has to be computed whole
+    before its first isotopologue is given. The isotopologues with equal log-probabilities are ordered the same
+    way regardless of the number of threads.
+*/
+class ISOSPEC_EXPORT_SYMBOL IsoParallelOrderedGenerator : public IsoGenerator
+{
+ private:
+    struct Layer
+    {
+        std::vector<double> lprobs;
+        std::vector<double> masses;
+        std::vector<double> probs;
+        std::vector<int> confs;         /*!< allDim counts per isotopologue, if they are stored. */
+    };
+
+    IsoLayeredGenerator layered;        /*!< Owns the marginals, and is moved to the subsequent layers by the producer thread only. */
+    const unsigned int n_threads;
+    const size_t layer_size;
+    const size_t max_queued_layers;
+    const bool get_confs;
+
+    std::unique_ptr<Layer> current;     /*!< The layer being consumed. */
+    size_t current_idx;
+    size_t current_size;
+
+    std::mutex mutex;
+    std::condition_variable layer_ready;    /*!< Signalled when a layer is queued, or the producer is done. */
+    std::condition_variable layer_taken;    /*!< Signalled when a layer is taken from the queue, or stop is set. */
+    std::deque<std::unique_ptr<Layer> > queue;
+    bool producer_done;
+    std::exception_ptr error;           /*!< Thrown by the producer thread, rethrown to the consumer after the queued layers. */
+    std::atomic<bool> stop;             /*!< Set on destruction, to have the producer and the workers quit early. */
+    std::thread producer;
+
+    void produce();
+    void compute_layer(Layer& layer);
+    bool next_layer();
+
+ public:
+    IsoParallelOrderedGenerator(const IsoParallelOrderedGenerator& other) = delete;
+    IsoParallelOrderedGenerator& operator=(const IsoParallelOrderedGenerator& other) = delete;
+
+    //! Constructor.
+    /*!
+        \param iso An instance of the Iso class.
+        \param _n_threads The number of threads enumerating and sorting each layer (0: one per hardware thread).
+        \param _layer_size The number of isotopologues to aim at in each layer. Larger layers parallelize better,
+                           but take more memory, and delay their first isotopologues more.
+        \param _max_queued_layers The number of layers which may be computed in advance of the consumed one.
+        \param _get_confs Should the counts of isotopes be stored? If not, get_conf_signature() must not be used.
+    */
+    IsoParallelOrderedGenerator(Iso&& iso, unsigned int _n_threads = 0, size_t _layer_size = ISOSPEC_PARALLEL_ORDERED_LAYER_SIZE, size_t _max_queued_layers = 2, bool _get_confs = true);  // NOLINT(runtime/explicit) - constructor deliberately left to be used as a conversion
+
+    //! Destructor. Stops the computation of the layers not consumed yet.
+    virtual ~IsoParallelOrderedGenerator();
+
+    //! Advance to the next isotopologue. Blocks until its layer is computed, and rethrows the exceptions thrown while computing it.
+    ISOSPEC_FORCE_INLINE bool advanceToNextConfiguration() override final
+    {
+        current_idx++;
+        if(ISOSPEC_LIKELY(current_idx < current_size))
+            return true;
+        return next_layer();
+    }
+
+    ISOSPEC_FORCE_INLINE double lprob() const override final { return current->lprobs[current_idx]; }
+    ISOSPEC_FORCE_INLINE double mass()  const override final { return current->masses[current_idx]; }
+    ISOSPEC_FORCE_INLINE double prob()  const override final { return current->probs[current_idx]; }
+
+    inline void get_conf_signature(int* space) const override final
+    {
+        memcpy(space, current->confs.data() + current_idx * allDim, allDim * sizeof(int));
+    }
+
+    //! Same as IsoOrderedGenerator::fill().
+    size_t fill(double* _masses, double* _probs, double* _lprobs, int* _confs, size_t capacity) { return fill_impl<IsoParallelOrderedGenerator>(*this, _masses, _probs, _lprobs, _confs, capacity); }
+};
+
+}  // namespace IsoSpec
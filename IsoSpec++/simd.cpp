@@ -0,0 +1,163 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+#include "simd.h"
+
+#if ISOSPEC_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace IsoSpec
+{
+
+static size_t scalar_count_at_least(const double* arr, size_t max_len, double threshold)
+{
+    size_t ii = 0;
+    while(ii < max_len && arr[ii] >= threshold)
+        ii++;
+    return ii;
+}
+
+static void scalar_add_scalar(const double* src, double add, double* dst, size_t len)
+{
+    for(size_t ii = 0; ii < len; ii++)
+        dst[ii] = src[ii] + add;
+}
+
+static void scalar_mul_scalar(const double* src, double mul, double* dst, size_t len)
+{
+    for(size_t ii = 0; ii < len; ii++)
+        dst[ii] = src[ii] * mul;
+}
+
+#if ISOSPEC_SIMD_X86
+
+__attribute__((target("avx2"))) static size_t avx2_count_at_least(const double* arr, size_t max_len, double threshold)
+{
+    const __m256d thr = _mm256_set1_pd(threshold);
+    size_t ii = 0;
+    for(; ii + 4 <= max_len; ii += 4)
+    {
+        const int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(arr + ii), thr, _CMP_GE_OQ));
+        if(mask != 0xF)
+            return ii + __builtin_ctz(~mask);
+    }
+    return ii + scalar_count_at_least(arr + ii, max_len - ii, threshold);
+}
+
+__attribute__((target("avx2"))) static void avx2_add_scalar(const double* src, double add, double* dst, size_t len)
+{
+    const __m256d a = _mm256_set1_pd(add);
+    size_t ii = 0;
+    for(; ii + 4 <= len; ii += 4)
+        _mm256_storeu_pd(dst + ii, _mm256_add_pd(_mm256_loadu_pd(src + ii), a));
+    scalar_add_scalar(src + ii, add, dst + ii, len - ii);
+}
+
+__attribute__((target("avx2"))) static void avx2_mul_scalar(const double* src, double mul, double* dst, size_t len)
+{
+    const __m256d m = _mm256_set1_pd(mul);
+    size_t ii = 0;
+    for(; ii + 4 <= len; ii += 4)
+        _mm256_storeu_pd(dst + ii, _mm256_mul_pd(_mm256_loadu_pd(src + ii), m));
+    scalar_mul_scalar(src + ii, mul, dst + ii, len - ii);
+}
+
+__attribute__((target("avx512f"))) static size_t avx512_count_at_least(const double* arr, size_t max_len, double threshold)
+{
+    const __m512d thr = _mm512_set1_pd(threshold);
+    size_t ii = 0;
+    for(; ii + 8 <= max_len; ii += 8)
+    {
+        const unsigned int mask = _mm512_cmp_pd_mask(_mm512_loadu_pd(arr + ii), thr, _CMP_GE_OQ);
+        if(mask != 0xFF)
+            return ii + __builtin_ctz(~mask);
+    }
+    return ii + scalar_count_at_least(arr + ii, max_len - ii, threshold);
+}
+
+__attribute__((target("avx512f"))) static void avx512_add_scalar(const double* src, double add, double* dst, size_t len)
+{
+    const __m512d a = _mm512_set1_pd(add);
+    size_t ii = 0;
+    for(; ii + 8 <= len; ii += 8)
+        _mm512_storeu_pd(dst + ii, _mm512_add_pd(_mm512_loadu_pd(src + ii), a));
+    scalar_add_scalar(src + ii, add, dst + ii, len - ii);
+}
+
+__attribute__((target("avx512f"))) static void avx512_mul_scalar(const double* src, double mul, double* dst, size_t len)
+{
+    const __m512d m = _mm512_set1_pd(mul);
+    size_t ii = 0;
+    for(; ii + 8 <= len; ii += 8)
+        _mm512_storeu_pd(dst + ii, _mm512_mul_pd(_mm512_loadu_pd(src + ii), m));
+    scalar_mul_scalar(src + ii, mul, dst + ii, len - ii);
+}
+
+#endif /* ISOSPEC_SIMD_X86 */
+
+namespace {
+
+struct SimdKernels
+{
+    size_t (*count_at_least)(const double*, size_t, double);
+    void (*add_scalar)(const double*, double, double*, size_t);
+    void (*mul_scalar)(const double*, double, double*, size_t);
+    const char* name;
+};
+
+SimdKernels select_kernels()
+{
+#if ISOSPEC_SIMD_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f"))
+        return SimdKernels{avx512_count_at_least, avx512_add_scalar, avx512_mul_scalar, "avx512f"};
+    if(__builtin_cpu_supports("avx2"))
+        return SimdKernels{avx2_count_at_least, avx2_add_scalar, avx2_mul_scalar, "avx2"};
+#endif
+    return SimdKernels{scalar_count_at_least, scalar_add_scalar, scalar_mul_scalar, "scalar"};
+}
+
+// Function-local static, so that the kernels are usable from other static initializers, too
+const SimdKernels& kernels()
+{
+    static const SimdKernels selected = select_kernels();
+    return selected;
+}
+
+}  // namespace
+
+size_t simd_count_at_least(const double* arr, size_t max_len, double threshold)
+{
+    return kernels().count_at_least(arr, max_len, threshold);
+}
+
+void simd_add_scalar(const double* src, double add, double* dst, size_t len)
+{
+    kernels().add_scalar(src, add, dst, len);
+}
+
+void simd_mul_scalar(const double* src, double mul, double* dst, size_t len)
+{
+    kernels().mul_scalar(src, mul, dst, len);
+}
+
+const char* simd_instruction_set()
+{
+    return kernels().name;
+}
+
+}  // namespace IsoSpec
@@ -0,0 +1,49 @@
+/*
+ *   Copyright (C) 2015-2020 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include "platform.h"
+
+/*
+ * Vectorized kernels used for emitting whole runs of isotopologues that differ only in the subisotopologue
+ * of the innermost marginal. The best implementation supported by the CPU (AVX-512, AVX2 or plain scalar
+ * code) is picked at runtime. Define ISOSPEC_NO_SIMD to always use the scalar code.
+ */
+
+#if !defined(ISOSPEC_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ISOSPEC_SIMD_X86 true
+#else
+#define ISOSPEC_SIMD_X86 false
+#endif
+
+namespace IsoSpec
+{
+
+//! Get the length of the longest prefix of arr[0..max_len) consisting of values >= threshold.
+size_t simd_count_at_least(const double* arr, size_t max_len, double threshold);
+
+//! Compute dst[i] = src[i] + add for i in [0, len).
+void simd_add_scalar(const double* src, double add, double* dst, size_t len);
+
+//! Compute dst[i] = src[i] * mul for i in [0, len).
+void simd_mul_scalar(const double* src, double mul, double* dst, size_t len);
+
+//! Get the name of the instruction set used by the kernels on this machine: "avx512f", "avx2" or "scalar".
+const char* simd_instruction_set();
+
+}  // namespace IsoSpec
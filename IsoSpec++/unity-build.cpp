@@ -26,15 +26,19 @@
 // ignore cpplint's complaints about it.
 
 #include "allocator.cpp"        // NOLINT(build/include)
-#include "dirtyAllocator.cpp"   // NOLINT(build/include)
 #include "isoSpec++.cpp"        // NOLINT(build/include)
 #include "isoMath.cpp"          // NOLINT(build/include)
 #include "marginalTrek++.cpp"   // NOLINT(build/include)
+#include "marginalCache.cpp"    // NOLINT(build/include)
+#include "compactConfTable.cpp" // NOLINT(build/include)
+#include "marginalTables.cpp"   // NOLINT(build/include)
+#include "parallelOrdered.cpp"  // NOLINT(build/include)
 #include "operators.cpp"        // NOLINT(build/include)
 #include "element_tables.cpp"   // NOLINT(build/include)
 #include "fasta.cpp"            // NOLINT(build/include)
 #include "cwrapper.cpp"         // NOLINT(build/include)
 #include "fixedEnvelopes.cpp"   // NOLINT(build/include)
 #include "misc.cpp"             // NOLINT(build/include)
+#include "simd.cpp"             // NOLINT(build/include)
 
 #endif
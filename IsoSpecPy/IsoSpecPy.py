@@ -600,6 +600,34 @@ def IsoThreshold(threshold,
     return ido
 
 
+def IsoThresholdInMassRange(threshold,
+                 mass_lower,
+                 mass_upper,
+                 formula="",
+                 absolute=False,
+                 get_confs=False,
+                 **kwargs):
+    """Initialize the IsoDistribution isotopic distribution by threshold, keeping only the peaks within a mass window.
+
+    This gives the same peaks as IsoThreshold followed by filtering by mass, but parts of the distribution
+    which cannot fall into the window are not computed at all.
+
+    Args:
+        threshold (float): value of the absolute or relative threshold.
+        mass_lower (float): the lowest reported mass (inclusive).
+        mass_upper (float): the highest reported mass (inclusive).
+        formula (str): a chemical formula, e.g. "C2H6O1" or "C2H6O".
+        absolute (boolean): should we report peaks with probabilities above an absolute probability threshold, or above a relative threshold amounting to a given proportion of the most probable peak?
+        get_confs (boolean): should we report counts of isotopologues?
+        **kwds: named arguments to IsoSpectrum.
+    """
+    iso = Iso(formula = formula, get_confs = get_confs, **kwargs)
+    tabulator = isoFFI.clib.setupThresholdInMassRangeFixedEnvelope(iso.iso, threshold, mass_lower, mass_upper, absolute, get_confs)
+    ido = IsoDistribution(cobject = tabulator, get_confs = get_confs, iso = iso)
+    isoFFI.clib.deleteFixedEnvelope(tabulator, False)
+    return ido
+
+
 def IsoTotalProb(prob_to_cover,
                  formula="",
                  get_minimal_pset=True,
@@ -621,6 +649,25 @@ def IsoTotalProb(prob_to_cover,
         return ido
 
 
+def IsoTopK(k,
+            formula="",
+            get_confs=False,
+            **kwargs):
+        """Initialize the IsoDistribution isotopic distribution with exactly k most probable peaks.
+
+        Args:
+            k (int): the number of peaks to report. Fewer are reported only if the molecule does not have that many.
+            formula (str): a chemical formula, e.g. "C2H6O1" or "C2H6O".
+            get_confs (boolean): should we report the counts of isotopologues?
+            **kwargs: named arguments to the superclass.
+        """
+        iso = Iso(formula=formula, get_confs=get_confs, **kwargs)
+        tabulator = isoFFI.clib.setupTopKFixedEnvelope(iso.iso, k, get_confs)
+        ido = IsoDistribution(cobject = tabulator, get_confs = get_confs, iso = iso)
+        isoFFI.clib.deleteFixedEnvelope(tabulator, False)
+        return ido
+
+
 def IsoStochastic(no_molecules,
                  formula="",
                  precision=0.9999,
@@ -681,21 +728,57 @@ class IsoGenerator(Iso):
         """
         self.cgen = None
         super(IsoGenerator, self).__init__(formula=formula, get_confs=get_confs, **kwargs)
-        self.conf_space = isoFFI.ffi.new("int[" + str(sum(self.isotopeNumbers)) + "]")
+        self.sum_isotope_numbers = sum(self.isotopeNumbers)
+        self.conf_space = isoFFI.ffi.new("int[" + str(self.sum_isotope_numbers) + "]")
         self.firstuse = True
 
-    def __iter__(self):
+    def _fill_chunks(self, chunk_size):
+        # Fetches the isotopologues from the C++ generator in batches, instead of doing several FFI calls per peak
         if not self.firstuse:
             raise NotImplementedError("Multiple iterations through the same IsoGenerator object are not supported. Either create a new (identical) generator for a second loop-through, or use one of the non-generator classes, which do support being re-used.")
         self.firstuse = False
-        cgen = self.cgen
+        masses = isoFFI.ffi.new("double[" + str(chunk_size) + "]")
+        probs = isoFFI.ffi.new("double[" + str(chunk_size) + "]")
+        confs = isoFFI.ffi.new("int[" + str(chunk_size * self.sum_isotope_numbers) + "]") if self.get_confs else isoFFI.ffi.NULL
+        while True:
+            filled = self.filler(self.cgen, masses, probs, isoFFI.ffi.NULL, confs, chunk_size)
+            if filled > 0:
+                yield (filled, masses, probs, confs)
+            if filled < chunk_size:
+                return
+
+    def __iter__(self):
         if self.get_confs:
-            while self.advancer(cgen):
-                self.conf_getter(cgen, self.conf_space)
-                yield (self.mass_getter(cgen), self.xprob_getter(cgen), self.parse_conf(self.conf_space))
+            for filled, masses, probs, confs in self._fill_chunks(1024):
+                for i in xrange(filled):
+                    yield (masses[i], probs[i], self.parse_conf(confs, starting_with = i * self.sum_isotope_numbers))
         else:
-            while self.advancer(cgen):
-                yield (self.mass_getter(cgen), self.xprob_getter(cgen))
+            for filled, masses, probs, _ in self._fill_chunks(1024):
+                for i in xrange(filled):
+                    yield (masses[i], probs[i])
+
+    def np_chunks(self, chunk_size = 65536):
+        """Iterate over the isotopic distribution in chunks of numpy arrays.
+
+        Args:
+            chunk_size (int): the maximal number of peaks in a single chunk.
+
+        Yields:
+            Tuples (masses, probs) of numpy arrays, or (masses, probs, confs) if get_confs was set, where confs
+            is a 2D array with a row of isotope counts for each peak.
+        """
+        try:
+            import numpy as np
+        except ImportError as e:
+            raise Exception(e.msg + "\nThis requires numpy to be installed.")
+        for filled, masses, probs, confs in self._fill_chunks(chunk_size):
+            np_masses = np.frombuffer(isoFFI.ffi.buffer(masses, filled * 8), dtype=np.float64).copy()
+            np_probs = np.frombuffer(isoFFI.ffi.buffer(probs, filled * 8), dtype=np.float64).copy()
+            if self.get_confs:
+                np_confs = np.frombuffer(isoFFI.ffi.buffer(confs, filled * self.sum_isotope_numbers * isoFFI.ffi.sizeof("int")), dtype=np.intc).reshape((filled, self.sum_isotope_numbers)).copy()
+                yield (np_masses, np_probs, np_confs)
+            else:
+                yield (np_masses, np_probs)
 
     def __del__(self):
         super(IsoGenerator, self).__del__()
@@ -728,6 +811,7 @@ class IsoThresholdGenerator(IsoGenerator):
         self.xprob_getter = self.ffi.probIsoThresholdGenerator
         self.mass_getter = self.ffi.massIsoThresholdGenerator
         self.conf_getter = self.ffi.get_conf_signatureIsoThresholdGenerator
+        self.filler = self.ffi.fillIsoThresholdGenerator
 
     def __del__(self):
         """Destructor."""
@@ -757,6 +841,7 @@ class IsoLayeredGenerator(IsoGenerator):
         self.xprob_getter = self.ffi.probIsoLayeredGenerator
         self.mass_getter = self.ffi.massIsoLayeredGenerator
         self.conf_getter = self.ffi.get_conf_signatureIsoLayeredGenerator
+        self.filler = self.ffi.fillIsoLayeredGenerator
 
     def __del__(self):
         try:
@@ -790,6 +875,7 @@ class IsoOrderedGenerator(IsoGenerator):
         self.xprob_getter = self.ffi.probIsoOrderedGenerator
         self.mass_getter = self.ffi.massIsoOrderedGenerator
         self.conf_getter = self.ffi.get_conf_signatureIsoOrderedGenerator
+        self.filler = self.ffi.fillIsoOrderedGenerator
 
     def __del__(self):
         try:
@@ -814,6 +900,7 @@ class IsoStochasticGenerator(IsoGenerator):
         self.xprob_getter = self.ffi.probIsoStochasticGenerator
         self.mass_getter = self.ffi.massIsoStochasticGenerator
         self.conf_getter = self.ffi.get_conf_signatureIsoStochasticGenerator
+        self.filler = self.ffi.fillIsoStochasticGenerator
 
     def __del__(self):
         """Destructor."""
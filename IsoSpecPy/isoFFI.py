@@ -37,7 +37,7 @@ class IsoFFI:
                                          int _tabSize,
                                          int _hashSize,
                                          bool reorder_marginals);
-        double massIsoThresholdGenerator(void* generator); double lprobIsoThresholdGenerator(void* generator); double probIsoThresholdGenerator(void* generator); void methodIsoThresholdGenerator(void* generator); bool advanceToNextConfigurationIsoThresholdGenerator(void* generator); void deleteIsoThresholdGenerator(void* generator); void get_conf_signatureIsoThresholdGenerator(void* generator, int* space);
+        double massIsoThresholdGenerator(void* generator); double lprobIsoThresholdGenerator(void* generator); double probIsoThresholdGenerator(void* generator); void methodIsoThresholdGenerator(void* generator); bool advanceToNextConfigurationIsoThresholdGenerator(void* generator); void deleteIsoThresholdGenerator(void* generator); void get_conf_signatureIsoThresholdGenerator(void* generator, int* space); size_t fillIsoThresholdGenerator(void* generator, double* masses, double* probs, double* lprobs, int* confs, size_t capacity);
 
 
 
@@ -46,30 +46,41 @@ class IsoFFI:
                                        int _hashSize,
                                        bool reorder_marginals,
                                        double t_prob_hint);
-        double massIsoLayeredGenerator(void* generator); double lprobIsoLayeredGenerator(void* generator); double probIsoLayeredGenerator(void* generator); void methodIsoLayeredGenerator(void* generator); bool advanceToNextConfigurationIsoLayeredGenerator(void* generator); void deleteIsoLayeredGenerator(void* generator); void get_conf_signatureIsoLayeredGenerator(void* generator, int* space);
+        double massIsoLayeredGenerator(void* generator); double lprobIsoLayeredGenerator(void* generator); double probIsoLayeredGenerator(void* generator); void methodIsoLayeredGenerator(void* generator); bool advanceToNextConfigurationIsoLayeredGenerator(void* generator); void deleteIsoLayeredGenerator(void* generator); void get_conf_signatureIsoLayeredGenerator(void* generator, int* space); size_t fillIsoLayeredGenerator(void* generator, double* masses, double* probs, double* lprobs, int* confs, size_t capacity);
 
 
         void* setupIsoOrderedGenerator(void* iso,
                                        int _tabSize,
                                        int _hashSize);
-        double massIsoOrderedGenerator(void* generator); double lprobIsoOrderedGenerator(void* generator); double probIsoOrderedGenerator(void* generator); void methodIsoOrderedGenerator(void* generator); bool advanceToNextConfigurationIsoOrderedGenerator(void* generator); void deleteIsoOrderedGenerator(void* generator); void get_conf_signatureIsoOrderedGenerator(void* generator, int* space);
+        double massIsoOrderedGenerator(void* generator); double lprobIsoOrderedGenerator(void* generator); double probIsoOrderedGenerator(void* generator); void methodIsoOrderedGenerator(void* generator); bool advanceToNextConfigurationIsoOrderedGenerator(void* generator); void deleteIsoOrderedGenerator(void* generator); void get_conf_signatureIsoOrderedGenerator(void* generator, int* space); size_t fillIsoOrderedGenerator(void* generator, double* masses, double* probs, double* lprobs, int* confs, size_t capacity);
 
         void* setupIsoStochasticGenerator(void* iso,
                                    size_t no_molecules,
                                    double precision,
                                    double beta_bias);
-        double massIsoStochasticGenerator(void* generator); double lprobIsoStochasticGenerator(void* generator); double probIsoStochasticGenerator(void* generator); void methodIsoStochasticGenerator(void* generator); bool advanceToNextConfigurationIsoStochasticGenerator(void* generator); void deleteIsoStochasticGenerator(void* generator); void get_conf_signatureIsoStochasticGenerator(void* generator, int* space);
+        double massIsoStochasticGenerator(void* generator); double lprobIsoStochasticGenerator(void* generator); double probIsoStochasticGenerator(void* generator); void methodIsoStochasticGenerator(void* generator); bool advanceToNextConfigurationIsoStochasticGenerator(void* generator); void deleteIsoStochasticGenerator(void* generator); void get_conf_signatureIsoStochasticGenerator(void* generator, int* space); size_t fillIsoStochasticGenerator(void* generator, double* masses, double* probs, double* lprobs, int* confs, size_t capacity);
 
         void* setupThresholdFixedEnvelope(void* iso,
                                     double threshold,
                                     bool absolute,
                                     bool get_confs);
 
+        void* setupThresholdInMassRangeFixedEnvelope(void* iso,
+                                    double threshold,
+                                    double mass_lower,
+                                    double mass_upper,
+                                    bool absolute,
+                                    bool get_confs);
+
         void* setupTotalProbFixedEnvelope(void* iso,
                                       double taget_coverage,
                                       bool optimize,
                                       bool get_confs);
 
+        void* setupTopKFixedEnvelope(void* iso,
+                                     size_t k,
+                                     bool get_confs);
+
         void* setupStochasticFixedEnvelope(void* iso,
                                      size_t no_molecules,
                                      double precision,
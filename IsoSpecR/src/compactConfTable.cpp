@@ -0,0 +1 @@
+../../IsoSpec++/compactConfTable.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../IsoSpec++/compactConfTable.h
\ No newline at end of file
@@ -1 +0,0 @@
-../../IsoSpec++/dirtyAllocator.cpp
\ No newline at end of file
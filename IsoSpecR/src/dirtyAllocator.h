@@ -1 +0,0 @@
-../../IsoSpec++/dirtyAllocator.h
\ No newline at end of file
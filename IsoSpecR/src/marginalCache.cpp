@@ -0,0 +1 @@
+../../IsoSpec++/marginalCache.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../IsoSpec++/marginalCache.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../IsoSpec++/marginalTables.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../IsoSpec++/marginalTables.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../IsoSpec++/parallelOrdered.cpp
\ No newline at end of file
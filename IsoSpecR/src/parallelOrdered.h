@@ -0,0 +1 @@
+../../IsoSpec++/parallelOrdered.h
\ No newline at end of file
@@ -32,3 +32,7 @@
 #if !defined(ISOSPEC_BUILDING_OPENMS)
 #define ISOSPEC_BUILDING_OPENMS false
 #endif
+
+#if !defined(ISOSPEC_SMALL_LFACT_TABLE)
+#define ISOSPEC_SMALL_LFACT_TABLE false
+#endif
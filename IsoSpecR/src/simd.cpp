@@ -0,0 +1 @@
+../../IsoSpec++/simd.cpp
\ No newline at end of file
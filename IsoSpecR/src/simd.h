@@ -0,0 +1 @@
+../../IsoSpec++/simd.h
\ No newline at end of file
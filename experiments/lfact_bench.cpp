@@ -0,0 +1,84 @@
+// Compares the log-factorial table (filled in blocks, safe to use from many threads) with the
+// previous lazily filled one, plain lgamma and the Stirling series used beyond small tables.
+//
+// g++ -std=c++17 -O3 -pthread lfact_bench.cpp -o lfact_bench && ./lfact_bench
+// g++ -std=c++17 -O3 -pthread -DISOSPEC_SMALL_LFACT_TABLE=true lfact_bench.cpp -o lfact_bench_small && ./lfact_bench_small
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include "../IsoSpec++/unity-build.cpp"
+
+using namespace IsoSpec;
+
+// The way the table used to be filled: racy when used from many threads
+static double* legacy_table = reinterpret_cast<double*>(calloc(ISOSPEC_G_FACT_TABLE_SIZE, sizeof(double)));
+
+static inline double legacy_minuslogFactorial(int n)
+{
+    if (n < 2)
+        return 0.0;
+    if (n >= ISOSPEC_G_FACT_TABLE_SIZE)
+        return -lgamma(n+1);
+    if (legacy_table[n] == 0.0)
+        legacy_table[n] = -lgamma(n+1);
+    return legacy_table[n];
+}
+
+template<typename F> static double bench(const char* name, const std::vector<int>& args, int rounds, F f)
+{
+    double acc = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for(int round = 0; round < rounds; round++)
+        for(int n : args)
+            acc += f(n);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "  " << name << ": " << secs * 1e9 / (static_cast<double>(args.size()) * rounds) << " ns/call" << std::endl;
+    return acc;
+}
+
+int main(int argc, char** argv)
+{
+    const int max_n = argc > 1 ? atoi(argv[1]) : 100000;
+    const int rounds = argc > 2 ? atoi(argv[2]) : 20;
+
+    // Uniformly random arguments: the worst case for the tables
+    std::mt19937 rgen(1234);
+    std::uniform_int_distribution<int> dist(0, max_n);
+    std::vector<int> args(1000000);
+    for(int& n : args)
+        n = dist(rgen);
+
+    std::cout << "Table size: " << ISOSPEC_G_FACT_TABLE_SIZE << ", arguments up to " << max_n << std::endl;
+
+    double check = 0.0;
+    check += bench("legacy lazy table", args, rounds, legacy_minuslogFactorial);
+    check += bench("blocked table    ", args, rounds, minuslogFactorial);
+    check += bench("lgamma           ", args, rounds, [](int n) { return -lgamma(n+1); });
+    check += bench("Stirling series  ", args, rounds, [](int n) { return n < 2 ? 0.0 : minuslogFactorialStirling(n); });
+
+    double max_err = 0.0;
+    for(int n = 1024; n <= max_n; n++)
+        max_err = (std::max)(max_err, std::abs(minuslogFactorialStirling(n) + lgamma(n+1)) / lgamma(n+1));
+    std::cout << "Max relative error of the Stirling series above 1024: " << max_err << std::endl;
+
+    const int no_threads = std::thread::hardware_concurrency() > 0 ? std::thread::hardware_concurrency() : 4;
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for(int ii = 0; ii < no_threads; ii++)
+        threads.emplace_back([&]() { double acc = 0.0; for(int n : args) acc += minuslogFactorial(n); if(acc > 0.0) std::cout << acc; });
+    for(std::thread& thread : threads)
+        thread.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "  blocked table, " << no_threads << " threads: " << secs * 1e9 / static_cast<double>(args.size()) << " ns per call per thread" << std::endl;
+
+    // Marginal construction, where the log-factorials are used
+    start = std::chrono::steady_clock::now();
+    size_t confs = IsoThresholdGenerator(Iso("C10000H20000N3000O3000S100"), 1e-12, true).count_confs();
+    secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "C10000H20000N3000O3000S100 above 1e-12: " << confs << " configurations in " << secs << " s" << std::endl;
+
+    return check == 0.0 ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include "isoSpec++.h"
+#include "peaks.h"
+#include "fixedEnvelopes.h"
+#include "enumerate.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_enumerate(const char* formula, double threshold, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./enumerate C10000H1000O1000N1000 0.01" << std::endl;
+		std::cout << "...will stream the configurations with probability above 0.01 and compare them with the ones stored in a FixedEnvelope" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_enumerate(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+size_t test_enumerate(const char* formula, double threshold, bool print_confs)
+{
+	size_t total = 0;
+
+	// Threshold: without confs the stream is consumed in constant memory, whatever the size
+	double stream_prob = 0.0;
+	size_t streamed = enumerate(Iso(formula), ThresholdPolicy(threshold), [&](double, double prob, const int* conf)
+	{
+		assert(conf == nullptr);
+		stream_prob += prob;
+	});
+	assert(streamed == IsoThresholdGenerator(Iso(formula), threshold, true).count_confs());
+	total += streamed;
+
+	if(streamed > max_stored_confs)
+		return total;
+
+	FixedEnvelope reference = FixedEnvelope::FromThreshold(Iso(formula), threshold, true, true);
+	const int allDim = reference.getAllDim();
+
+	size_t idx = 0;
+	enumerate<true>(Iso(formula), ThresholdPolicy(threshold), [&](double mass, double prob, const int* conf)
+	{
+		assert(mass == reference.mass(idx));
+		assert(prob == reference.prob(idx));
+		assert(memcmp(conf, reference.conf(idx), allDim * sizeof(int)) == 0);
+		if(print_confs)
+		{
+			std::cout << "prob: " << prob << " mass: " << mass << " conf: ";
+			printArray<int>(conf, allDim);
+		}
+		idx++;
+	});
+	assert(idx == reference.confs_no());
+
+	idx = 0;
+	enumerate_chunks<true>(Iso(formula), ThresholdPolicy(threshold), [&](const double* masses, const double* probs, const int* confs, size_t n)
+	{
+		assert(n <= 7);
+		assert(memcmp(masses, reference.masses() + idx, n * sizeof(double)) == 0);
+		assert(memcmp(probs, reference.probs() + idx, n * sizeof(double)) == 0);
+		assert(memcmp(confs, reference.confs() + idx * allDim, n * allDim * sizeof(int)) == 0);
+		idx += n;
+	}, 7);
+	assert(idx == reference.confs_no());
+
+	// Mass-ordered
+	double last_mass = -1.0;
+	size_t mass_ordered = enumerate_chunks(Iso(formula), MassOrderedThresholdPolicy(threshold), [&](const double* masses, const double*, const int* confs, size_t n)
+	{
+		assert(confs == nullptr);
+		for(size_t ii = 0; ii < n; ii++)
+		{
+			assert(last_mass <= masses[ii]);
+			last_mass = masses[ii];
+		}
+	});
+	assert(mass_ordered == reference.confs_no());
+
+	// Ordered: the same as the first confs of IsoOrderedGenerator
+	const size_t max_confs = (std::min)(reference.confs_no(), static_cast<size_t>(1000));
+	std::vector<double> ordered_probs;
+	enumerate(Iso(formula), OrderedPolicy(max_confs), [&](double, double prob, const int*) { ordered_probs.push_back(prob); });
+	assert(ordered_probs.size() == max_confs);
+	IsoOrderedGenerator ordered{Iso(formula)};
+	for(size_t ii = 0; ii < max_confs; ii++)
+	{
+		assert(ordered.advanceToNextConfiguration());
+		assert(ordered.prob() == ordered_probs[ii]);
+	}
+
+	// Total probability: stop right after reaching the target
+	const double targets[] = {0.0, 0.5, 0.99};
+	for(double target : targets)
+	{
+		double so_far = 0.0, before_last = 0.0;
+		size_t per_conf = enumerate(Iso(formula), TotalProbPolicy(target), [&](double, double prob, const int*)
+		{
+			before_last = so_far;
+			so_far += prob;
+		});
+		size_t chunked = enumerate_chunks(Iso(formula), TotalProbPolicy(target), [](const double*, const double*, const int*, size_t) {}, 3);
+		assert(per_conf == chunked);
+		if(target > 0.0 && target < 1.0)
+		{
+			assert(so_far >= target || so_far > 0.9999999);
+			assert(before_last < target);
+		}
+		total += per_conf;
+	}
+
+	return total;
+}
@@ -0,0 +1,112 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include "isoSpec++.h"
+#include "fixedEnvelopes.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_binned_aggregated(const char* formula, double total_prob, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./from_formula_binned_aggregated C10000H1000O1000N1000 0.99" << std::endl;
+		std::cout << "...will check that the 1 Da envelope covering 0.99 of probability is the same with aggregated marginals" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_binned_aggregated(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+static double aggregated_total_prob(const FixedEnvelope& envelope)
+{
+	double ret = 0.0;
+	for(size_t ii = 0; ii < envelope.confs_no(); ii++)
+		ret += envelope.probs()[ii];
+	return ret;
+}
+
+static double aggregated_bin_prob(const FixedEnvelope& envelope, double mass)
+{
+	const double* masses = envelope.masses();
+	for(size_t ii = 0; ii < envelope.confs_no(); ii++)
+		if(std::abs(masses[ii] - mass) < 0.25)
+			return envelope.probs()[ii];
+	return 0.0;
+}
+
+size_t test_binned_aggregated(const char* formula, double total_prob, bool print_confs)
+{
+	// The envelopes only differ by what they miss
+	const double target = (std::max)(static_cast<double>(total_prob), 0.9);
+	const double tolerance = 1.0 - target + 1e-9;
+
+	Iso iso(formula);
+	// The fine structure is much narrower than 1 Da: put the bin boundaries between the nominal masses
+	const double bin_middle = iso.getLightestPeakMass() - std::floor(iso.getLightestPeakMass());
+
+	FixedEnvelope exact = FixedEnvelope::Binned(Iso(formula), target, 1.0, bin_middle);
+
+	for(int fine_bins : {1, 8})
+	{
+		FixedEnvelope aggregated = FixedEnvelope::Binned(Iso(formula), target, 1.0, bin_middle, fine_bins);
+		assert(aggregated_total_prob(aggregated) >= target);
+
+		for(size_t ii = 0; ii < exact.confs_no(); ii++)
+			assert(std::abs(aggregated_bin_prob(aggregated, exact.masses()[ii]) - exact.probs()[ii]) <= tolerance);
+		for(size_t ii = 0; ii < aggregated.confs_no(); ii++)
+			assert(std::abs(aggregated_bin_prob(exact, aggregated.masses()[ii]) - aggregated.probs()[ii]) <= tolerance);
+
+		// The bins keep the average masses of their subisotopologues
+		IsoLayeredGenerator generator(Iso(formula), 1000, 1000, true, 0.99, fine_bins);
+		double prob_acc = 0.0;
+		double mass_acc = 0.0;
+		while(prob_acc < target && generator.advanceToNextConfiguration())
+		{
+			prob_acc += generator.prob();
+			mass_acc += generator.prob() * generator.mass();
+		}
+		const double range = iso.getHeaviestPeakMass() - iso.getLightestPeakMass();
+		assert(std::abs(mass_acc / prob_acc - iso.getTheoreticalAverageMass()) <= tolerance / target * range + 1e-9 * iso.getTheoreticalAverageMass());
+
+		// There are no configurations to report
+		if(generator.getDimNumber() > 0)
+		{
+			std::vector<int> conf(generator.getAllDim());
+			bool thrown = false;
+			try
+			{
+				generator.get_conf_signature(conf.data());
+			}
+			catch(std::logic_error&)
+			{
+				thrown = true;
+			}
+			assert(thrown);
+		}
+	}
+
+	if(print_confs)
+		for(size_t ii = 0; ii < exact.confs_no(); ii++)
+			std::cout << "mass: " << exact.masses()[ii] << " prob: " << exact.probs()[ii] << std::endl;
+
+	return exact.confs_no();
+}
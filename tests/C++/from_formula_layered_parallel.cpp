@@ -0,0 +1,79 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include "isoSpec++.h"
+#include "fixedEnvelopes.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_layered_parallel(const char* formula, double total_prob, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./from_formula_layered_parallel C10000H1000O1000N1000 0.9999" << std::endl;
+		std::cout << "...will check the optimal p-sets covering 0.9999 probability, trimmed in several threads" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_layered_parallel(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+size_t test_layered_parallel(const char* formula, double total_prob, bool print_confs)
+{
+	FixedEnvelope reference = FixedEnvelope::FromTotalProb(Iso(formula), total_prob, true, true, 1);
+
+	// The optimal p-set is as large as the prefix of the ordered generator reaching total_prob
+	size_t expected = 0;
+	if(total_prob > 0.0)
+	{
+		IsoOrderedGenerator ordered{Iso(formula)};
+		double prob_so_far = 0.0;
+		while(prob_so_far < total_prob && ordered.advanceToNextConfiguration())
+		{
+			prob_so_far += ordered.prob();
+			expected++;
+		}
+	}
+	assert(reference.confs_no() == expected);
+
+	// The configurations kept, and their order, do not depend on the number of threads
+	for(unsigned int n_threads : {2U, 4U, 0U})
+	{
+		FixedEnvelope parallel = FixedEnvelope::FromTotalProb(Iso(formula), total_prob, true, true, n_threads);
+
+		assert(parallel.confs_no() == reference.confs_no());
+		for(size_t ii = 0; ii < parallel.confs_no(); ii++)
+		{
+			assert(parallel.prob(ii) == reference.prob(ii));
+			assert(parallel.mass(ii) == reference.mass(ii));
+			assert(memcmp(parallel.conf(ii), reference.conf(ii), reference.getAllDim() * sizeof(int)) == 0);
+		}
+	}
+
+	if(print_confs)
+		for(size_t ii = 0; ii < reference.confs_no(); ii++)
+		{
+			std::cout << "prob: " << reference.prob(ii) << " mass: " << reference.mass(ii) << " conf: ";
+			printArray<int>(reference.conf(ii), reference.getAllDim());
+		}
+
+	return reference.confs_no();
+}
@@ -0,0 +1,130 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <set>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include "isoSpec++.h"
+#include "fixedEnvelopes.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_layered_resume(const char* formula, double total_prob, bool print_confs);
+void test_layered_resume_at_end();
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./from_formula_layered_resume C10000H1000O1000N1000 0.9999" << std::endl;
+		std::cout << "...will check the envelopes covering 0.9999 probability, extended from the ones covering half of it" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	test_layered_resume_at_end();
+
+	size_t no_visited = test_layered_resume(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+size_t test_layered_resume(const char* formula, double total_prob, bool print_confs)
+{
+	size_t total = 0;
+
+	for(bool optimize : {true, false})
+	{
+		TotalProbState state;
+		FixedEnvelope first = FixedEnvelope::FromTotalProb(Iso(formula), total_prob * 0.5, optimize, true, 1, &state);
+		const size_t first_confs_no = first.confs_no();
+
+		// Resumed from a saved copy of the state, the envelope is extended in the very same way
+		TotalProbState loaded = TotalProbState::load(state.save());
+		FixedEnvelope copy(first);
+
+		first.extend_total_prob(state, total_prob);
+		copy.extend_total_prob(loaded, total_prob);
+
+		assert(copy.confs_no() == first.confs_no());
+		for(size_t ii = 0; ii < first.confs_no(); ii++)
+		{
+			assert(copy.prob(ii) == first.prob(ii));
+			assert(copy.mass(ii) == first.mass(ii));
+			assert(memcmp(copy.conf(ii), first.conf(ii), first.getAllDim() * sizeof(int)) == 0);
+		}
+
+		// The configurations are only appended, each once
+		assert(first.confs_no() >= first_confs_no);
+		std::set<std::vector<int>> seen;
+		double prob = 0.0;
+		for(size_t ii = 0; ii < first.confs_no(); ii++)
+		{
+			assert(seen.insert(std::vector<int>(first.conf(ii), first.conf(ii) + first.getAllDim())).second);
+			prob += first.prob(ii);
+		}
+		assert(total_prob <= 0.0 || prob >= total_prob * (1.0 - 1e-9));
+
+		if(optimize)
+		{
+			// The optimal p-set, as computed at once (up to the ties)
+			FixedEnvelope direct = FixedEnvelope::FromTotalProb(Iso(formula), total_prob, true, true);
+			assert(direct.confs_no() == first.confs_no());
+			std::vector<double> expected(direct.probs(), direct.probs() + direct.confs_no());
+			std::vector<double> got(first.probs(), first.probs() + first.confs_no());
+			std::sort(expected.begin(), expected.end());
+			std::sort(got.begin(), got.end());
+			for(size_t ii = 0; ii < got.size(); ii++)
+				assert(std::abs(got[ii] - expected[ii]) <= 1e-9 * expected[ii]);
+		}
+
+		if(print_confs)
+			for(size_t ii = 0; ii < first.confs_no(); ii++)
+			{
+				std::cout << "optimize: " << optimize << " prob: " << first.prob(ii) << " mass: " << first.mass(ii) << " conf: ";
+				printArray<int>(first.conf(ii), first.getAllDim());
+			}
+
+		total += first.confs_no();
+	}
+
+	return total;
+}
+
+
+// Saves and loads the states of the envelopes which reached the end of the spectrum: the last layers are empty there
+void test_layered_resume_at_end()
+{
+	for(const char* formula : {"P1C1Sn1", "Xe5", "Se5"})
+		for(bool optimize : {true, false})
+			for(bool get_confs : {true, false})
+			{
+				// Right away...
+				TotalProbState state;
+				FixedEnvelope whole = FixedEnvelope::FromTotalProb(Iso(formula), 1.0, optimize, get_confs, 1, &state);
+				TotalProbState loaded = TotalProbState::load(state.save());
+				FixedEnvelope copy(whole);
+				copy.extend_total_prob(loaded, 1.0);
+				assert(copy.confs_no() == whole.confs_no());
+
+				// ... and through an extension
+				FixedEnvelope extended = FixedEnvelope::FromTotalProb(Iso(formula), 0.5, optimize, get_confs, 1, &state);
+				extended.extend_total_prob(state, 1.0);
+				assert(extended.confs_no() == whole.confs_no());
+				loaded = TotalProbState::load(state.save());
+				extended.extend_total_prob(loaded, 1.0);
+				assert(extended.confs_no() == whole.confs_no());
+			}
+}
@@ -0,0 +1,87 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include <tuple>
+#include <algorithm>
+#include "isoSpec++.h"
+#include "peaks.h"
+#include "fixedEnvelopes.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_mass_ordered(const char* formula, double threshold, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./from_formula_mass_ordered C10000H1000O1000N1000 0.01" << std::endl;
+		std::cout << "...will check that the configurations with probability above 0.01 are generated in ascending mass order" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_mass_ordered(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+static std::vector<std::tuple<double, double, std::vector<int> > > mass_ordered_peaks(FixedEnvelope& envelope)
+{
+	std::vector<std::tuple<double, double, std::vector<int> > > ret;
+	for(size_t ii = 0; ii < envelope.confs_no(); ii++)
+		ret.push_back(std::make_tuple(envelope.mass(ii), envelope.prob(ii),
+			std::vector<int>(envelope.conf(ii), envelope.conf(ii) + envelope.getAllDim())));
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+static std::vector<std::tuple<double, double, std::vector<int> > > mass_ordered_peaks(IsoThresholdGenerator& generator)
+{
+	std::vector<std::tuple<double, double, std::vector<int> > > ret;
+	std::vector<int> conf(generator.getAllDim());
+	while(generator.advanceToNextConfiguration())
+	{
+		generator.get_conf_signature(conf.data());
+		ret.push_back(std::make_tuple(generator.mass(), generator.prob(), conf));
+	}
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+size_t test_mass_ordered(const char* formula, double threshold, bool print_confs)
+{
+	size_t confs_no = count_threshold_confs(formula, threshold);
+	if(confs_no > max_stored_confs)
+		return confs_no;
+
+	FixedEnvelope ordered = FixedEnvelope::FromThresholdMassOrdered(Iso(formula), threshold, true, true);
+	// The reference must sum the marginals in the same order, so it must not fuse them
+	IsoThresholdGenerator reference(Iso(formula), threshold, true, 1000, 1000, true, false);
+
+	assert(ordered.confs_no() == confs_no);
+
+	for(size_t ii = 1; ii < ordered.confs_no(); ii++)
+		assert(ordered.mass(ii-1) <= ordered.mass(ii));
+
+	assert(mass_ordered_peaks(ordered) == mass_ordered_peaks(reference));
+
+	if(print_confs)
+		for(size_t ii = 0; ii < ordered.confs_no(); ii++)
+		{
+			std::cout << "mass: " << ordered.mass(ii) << " prob: " << ordered.prob(ii) << " conf: ";
+			printArray<int>(ordered.conf(ii), ordered.getAllDim());
+		}
+
+	return ordered.confs_no();
+}
@@ -0,0 +1,93 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include "isoSpec++.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_ordered_bucket(const char* formula, double total_prob, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./from_formula_ordered_bucket C10000H1000O1000N1000 0.9999" << std::endl;
+		std::cout << "...will check that the bucket queue and the heap give the same configurations covering 0.9999 probability, in the same order" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_ordered_bucket(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+typedef std::pair<double, std::vector<int> > bucket_peak;
+
+// The configurations covering total_prob, and the ones tied with the last of them
+static std::vector<bucket_peak> bucket_peaks(IsoOrderedGenerator& generator, double total_prob)
+{
+	std::vector<bucket_peak> ret;
+	double acc = 0.0;
+	size_t memory = 0;
+	while(generator.advanceToNextConfiguration())
+	{
+		assert(generator.memory_high_water_mark() >= memory);
+		memory = generator.memory_high_water_mark();
+
+		if(!ret.empty() && acc >= total_prob && generator.lprob() < ret.back().first)
+			break;
+		bucket_peak peak(generator.lprob(), std::vector<int>(generator.getAllDim()));
+		generator.get_conf_signature(peak.second.data());
+		ret.push_back(peak);
+		acc += generator.prob();
+	}
+	return ret;
+}
+
+size_t test_ordered_bucket(const char* formula, double total_prob, bool print_confs)
+{
+	IsoOrderedGenerator bucketed(Iso(formula), 1000, 1000, true);
+	IsoOrderedGenerator heap(Iso(formula), 1000, 1000, false);
+
+	std::vector<bucket_peak> bucketed_peaks = bucket_peaks(bucketed, total_prob);
+	std::vector<bucket_peak> heap_peaks = bucket_peaks(heap, total_prob);
+
+	assert(bucketed_peaks.size() == heap_peaks.size());
+	for(size_t ii = 0; ii < bucketed_peaks.size(); ii++)
+	{
+		// The same log-probabilities, in the same order
+		assert(bucketed_peaks[ii].first == heap_peaks[ii].first);
+		if(ii > 0)
+			assert(bucketed_peaks[ii].first <= bucketed_peaks[ii-1].first);
+	}
+
+	// Ties may come in a different order
+	std::sort(bucketed_peaks.begin(), bucketed_peaks.end());
+	std::sort(heap_peaks.begin(), heap_peaks.end());
+	assert(bucketed_peaks == heap_peaks);
+
+	// The cells of the visited configurations are recycled: none may be overwritten while still queued
+	assert(std::adjacent_find(heap_peaks.begin(), heap_peaks.end()) == heap_peaks.end());
+
+	if(print_confs)
+		for(size_t ii = 0; ii < heap_peaks.size(); ii++)
+		{
+			std::cout << "lprob: " << heap_peaks[ii].first << " conf: ";
+			printArray<int>(heap_peaks[ii].second.data(), heap_peaks[ii].second.size());
+		}
+
+	return heap_peaks.size();
+}
@@ -0,0 +1,101 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <set>
+#include <map>
+#include "isoSpec++.h"
+#include "parallelOrdered.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_parallel_ordered(const char* formula, double total_prob, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./from_formula_parallel_ordered C10000H1000O1000N1000 0.9999" << std::endl;
+		std::cout << "...will check that the parallel ordered generator gives the same configurations covering 0.9999 probability as the ordered one, in the same order" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_parallel_ordered(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+static inline bool parallel_lprobs_close(double a, double b)
+{
+	return std::abs(a - b) <= 1e-9 * (1.0 + std::abs(a));
+}
+
+size_t test_parallel_ordered(const char* formula, double total_prob, bool print_confs)
+{
+	IsoOrderedGenerator ordered(Iso(formula), 1000, 1000);
+	IsoParallelOrderedGenerator single(Iso(formula), 1);
+	IsoParallelOrderedGenerator parallel(Iso(formula), 4, 1000, 1);
+
+	const int dim = ordered.getAllDim();
+	std::vector<int> conf(dim), single_conf(dim);
+	std::vector<double> lprobs;
+	std::map<std::vector<int>, double> ordered_confs;
+	std::set<std::vector<int> > parallel_confs;
+
+	double acc = 0.0;
+	while(acc < total_prob && ordered.advanceToNextConfiguration())
+	{
+		assert(single.advanceToNextConfiguration());
+		assert(parallel.advanceToNextConfiguration());
+
+		// The same isotopologues, up to the order of the ties
+		assert(parallel_lprobs_close(ordered.lprob(), parallel.lprob()));
+		assert(lprobs.empty() || parallel.lprob() <= lprobs.back());
+		lprobs.push_back(parallel.lprob());
+		ordered.get_conf_signature(conf.data());
+		ordered_confs[conf] = ordered.lprob();
+		parallel.get_conf_signature(conf.data());
+		parallel_confs.insert(conf);
+
+		// The order of the ties doesn't depend on the number of threads, nor on the layers
+		assert(single.lprob() == parallel.lprob());
+		assert(single.mass() == parallel.mass());
+		assert(single.prob() == parallel.prob());
+		single.get_conf_signature(single_conf.data());
+		assert(single_conf == conf);
+
+		acc += ordered.prob();
+
+		if(print_confs)
+		{
+			std::cout << "lprob: " << parallel.lprob() << " mass: " << parallel.mass() << " conf: ";
+			printArray<int>(conf.data(), dim);
+		}
+	}
+
+	// Both are exhausted together
+	if(acc < total_prob)
+		assert(!parallel.advanceToNextConfiguration());
+
+	// Only the isotopologues tied with the last one may differ
+	for(const std::pair<const std::vector<int>, double>& ordered_conf : ordered_confs)
+		if(parallel_confs.count(ordered_conf.first) == 0)
+			assert(parallel_lprobs_close(ordered_conf.second, lprobs.back()));
+
+	// The parallel generator can be dropped midway
+	IsoParallelOrderedGenerator dropped(Iso(formula), 2, 10, 1);
+	assert(dropped.advanceToNextConfiguration());
+
+	return lprobs.size();
+}
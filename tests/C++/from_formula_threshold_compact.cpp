@@ -0,0 +1,113 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include "isoSpec++.h"
+#include "peaks.h"
+#include "compactConfTable.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_threshold_compact(const char* formula, double threshold, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./from_formula_threshold_compact C10000H1000O1000N1000 0.01" << std::endl;
+		std::cout << "...will check that storing the subisotopologues compactly doesn't change the configurations with probability above 0.01" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_threshold_compact(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+static void compact_table_widening()
+{
+	const int base[3] = {1000, 0, 50};
+	const int confs[4][3] = {{1000, 0, 50}, {900, 127, -78}, {1000, -300, 30000}, {0, 1 << 20, 50}};
+
+	CompactConfTable table(3, base);
+	const int widths[4] = {1, 1, 2, 4};
+	for(int ii = 0; ii < 4; ii++)
+	{
+		table.push_back(confs[ii]);
+		assert(table.bytes_per_count() == widths[ii]);
+		for(int jj = 0; jj <= ii; jj++)
+		{
+			int space[3];
+			table.get(jj, space);
+			assert(memcmp(space, confs[jj], sizeof(space)) == 0);
+		}
+	}
+	assert(table.size() == 4);
+}
+
+// Both generators visit the subisotopologues in the same order, so everything must match exactly
+static size_t compact_compare(IsoThresholdGenerator& compact, IsoThresholdGenerator& plain, bool print_confs)
+{
+	const int dim = plain.getAllDim();
+	std::vector<int> compact_conf(dim), plain_conf(dim);
+	size_t count = 0;
+
+	while(plain.advanceToNextConfiguration())
+	{
+		bool advanced = compact.advanceToNextConfiguration();
+		assert(advanced);
+		assert(compact.lprob() == plain.lprob());
+		assert(compact.mass() == plain.mass());
+		compact.get_conf_signature(compact_conf.data());
+		plain.get_conf_signature(plain_conf.data());
+		assert(compact_conf == plain_conf);
+
+		if(print_confs)
+		{
+			std::cout << "lprob: " << plain.lprob() << " mass: " << plain.mass() << " conf: ";
+			printArray<int>(plain_conf.data(), dim);
+		}
+
+		count++;
+	}
+	assert(!compact.advanceToNextConfiguration());
+
+	return count;
+}
+
+size_t test_threshold_compact(const char* formula, double threshold, bool print_confs)
+{
+	compact_table_widening();
+
+	size_t confs_no = count_threshold_confs(formula, threshold);
+	if(confs_no > max_stored_confs)
+		return confs_no;
+
+	IsoThresholdGenerator compact(Iso(formula), threshold, true, 1000, 1000, true, true, nullptr, true);
+	IsoThresholdGenerator plain(Iso(formula), threshold, true, 1000, 1000, true, true);
+	assert(compact_compare(compact, plain, print_confs) == confs_no);
+
+	// Raising it only hides some of the stored subisotopologues
+	compact.new_threshold(threshold * 10.0, true);
+	plain.new_threshold(threshold * 10.0, true);
+	compact_compare(compact, plain, false);
+
+	// Lowering the threshold decodes the subisotopologues, extends the marginals and compacts them again
+	IsoThresholdGenerator retargeted(Iso(formula), threshold * 100.0, true, 1000, 1000, true, true, nullptr, true);
+	IsoThresholdGenerator plain_retargeted(Iso(formula), threshold * 100.0, true, 1000, 1000, true, true);
+	retargeted.new_threshold(threshold, true);
+	plain_retargeted.new_threshold(threshold, true);
+	assert(compact_compare(retargeted, plain_retargeted, false) == confs_no);
+
+	return confs_no;
+}
@@ -0,0 +1,68 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include "isoSpec++.h"
+#include "peaks.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_threshold_fused(const char* formula, double threshold, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./from_formula_threshold_fused C10000H1000O1000N1000 0.01" << std::endl;
+		std::cout << "...will check that fusing the marginals doesn't change the configurations with probability above 0.01" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_threshold_fused(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+size_t test_threshold_fused(const char* formula, double threshold, bool print_confs)
+{
+	size_t confs_no = count_threshold_confs(formula, threshold);
+	if(confs_no > max_stored_confs)
+		return confs_no;
+
+	IsoThresholdGenerator unfused(Iso(formula), threshold, true, 1000, 1000, true, false);
+	IsoThresholdGenerator fused(Iso(formula), threshold, true, 1000, 1000, true, true);
+	// The fused marginals must be recombined when the threshold is changed
+	IsoThresholdGenerator retargeted(Iso(formula), threshold * 100.0, true, 1000, 1000, true, true);
+	retargeted.new_threshold(threshold, true);
+
+	assert(unfused.count_confs() == confs_no);
+	assert(retargeted.count_confs() == confs_no);
+
+	std::vector<sorted_peak> reference = sorted_peaks(unfused);
+	assert(reference.size() == confs_no);
+
+	compare_peaks(fused, reference);
+	compare_peaks(retargeted, reference);
+
+	if(print_confs)
+		for(size_t ii = 0; ii < reference.size(); ii++)
+		{
+			std::cout << "prob: " << reference[ii].prob << " mass: " << reference[ii].mass << " conf: ";
+			printArray<int>(reference[ii].conf.data(), reference[ii].conf.size());
+		}
+
+	return confs_no;
+}
@@ -0,0 +1,99 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include "isoSpec++.h"
+#include "peaks.h"
+#include "fixedEnvelopes.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_threshold_mass_range(const char* formula, double threshold, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./from_formula_threshold_mass_range C10000H1000O1000N1000 0.01" << std::endl;
+		std::cout << "...will compare the configurations with probability above 0.01 within several mass windows with the filtered full threshold envelope" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_threshold_mass_range(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+size_t test_threshold_mass_range(const char* formula, double threshold, bool print_confs)
+{
+	Iso iso(formula);
+	const double mode = iso.getModeMass();
+	const double lightest = iso.getLightestPeakMass();
+	const double heaviest = iso.getHeaviestPeakMass();
+
+	size_t confs_no = count_threshold_confs(formula, threshold);
+	if(confs_no > max_stored_confs)
+		return confs_no;
+
+	// The reference must visit the marginals in the same order as the mass range generator, which does not fuse them
+	IsoThresholdGenerator full(Iso(formula), threshold, true, 1000, 1000, true, false);
+	const int allDim = full.getAllDim();
+	std::vector<double> full_masses, full_probs;
+	std::vector<int> full_confs;
+	while(full.advanceToNextConfiguration())
+	{
+		full_masses.push_back(full.mass());
+		full_probs.push_back(full.prob());
+		full_confs.resize(full_confs.size() + allDim);
+		full.get_conf_signature(full_confs.data() + full_confs.size() - allDim);
+	}
+
+	const double windows[][2] = {
+		{mode - 0.5, mode + 0.5},
+		{mode - 3.0, mode + 1.2},
+		{mode + 0.8, mode + 4.5},
+		{lightest - 1.0, heaviest + 1.0},
+		{heaviest + 1.0, heaviest + 2.0},
+		{mode, mode}
+	};
+
+	size_t total = 0;
+
+	for(const double* window : windows)
+	{
+		FixedEnvelope ranged = FixedEnvelope::FromThresholdInMassRange(Iso(formula), threshold, window[0], window[1], true, true);
+
+		size_t jj = 0;
+		for(size_t ii = 0; ii < full_masses.size(); ii++)
+			if(window[0] <= full_masses[ii] && full_masses[ii] <= window[1])
+			{
+				assert(jj < ranged.confs_no());
+				assert(full_masses[ii] == ranged.mass(jj));
+				assert(full_probs[ii] == ranged.prob(jj));
+				assert(memcmp(full_confs.data() + ii * allDim, ranged.conf(jj), allDim * sizeof(int)) == 0);
+				jj++;
+			}
+		assert(jj == ranged.confs_no());
+
+		if(print_confs)
+			for(size_t ii = 0; ii < ranged.confs_no(); ii++)
+			{
+				std::cout << "window: [" << window[0] << ", " << window[1] << "] prob: " << ranged.prob(ii) << " mass: " << ranged.mass(ii) << " conf: ";
+				printArray<int>(ranged.conf(ii), allDim);
+			}
+
+		total += ranged.confs_no();
+	}
+
+	return total;
+}
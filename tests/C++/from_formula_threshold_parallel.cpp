@@ -0,0 +1,64 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include "isoSpec++.h"
+#include "peaks.h"
+#include "fixedEnvelopes.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_threshold_parallel(const char* formula, double threshold, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./from_formula_threshold_parallel C10000H1000O1000N1000 0.01" << std::endl;
+		std::cout << "...will compute the configurations with probability above 0.01 for the above molecule using several threads and compare them with the single-threaded result" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_threshold_parallel(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+size_t test_threshold_parallel(const char* formula, double threshold, bool print_confs)
+{
+	size_t confs_no = count_threshold_confs(formula, threshold);
+	if(confs_no > max_stored_confs)
+		return confs_no;
+
+	FixedEnvelope serial = FixedEnvelope::FromThreshold(Iso(formula), threshold, true, true);
+	assert(serial.confs_no() == confs_no);
+
+	for(unsigned int n_threads = 1; n_threads <= 4; n_threads++)
+	{
+		FixedEnvelope parallel = FixedEnvelope::FromThresholdParallel(Iso(formula), threshold, true, true, n_threads);
+
+		assert(parallel.confs_no() == serial.confs_no());
+		assert(parallel.getAllDim() == serial.getAllDim());
+		assert(memcmp(parallel.masses(), serial.masses(), serial.confs_no() * sizeof(double)) == 0);
+		assert(memcmp(parallel.probs(), serial.probs(), serial.confs_no() * sizeof(double)) == 0);
+		assert(memcmp(parallel.confs(), serial.confs(), serial.confs_no() * serial.getAllDim() * sizeof(int)) == 0);
+	}
+
+	if(print_confs)
+		for(size_t ii = 0; ii < serial.confs_no(); ii++)
+		{
+			std::cout << "prob: " << serial.prob(ii) << " mass: " << serial.mass(ii) << " conf: ";
+			printArray<int>(serial.conf(ii), serial.getAllDim());
+		}
+
+	return serial.confs_no();
+}
@@ -0,0 +1,82 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include "isoSpec++.h"
+#include "peaks.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_threshold_retarget(const char* formula, double threshold, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./from_formula_threshold_retarget C10000H1000O1000N1000 0.01" << std::endl;
+		std::cout << "...will check that re-thresholding a generator down to 0.01 gives the same configurations as a fresh one" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_threshold_retarget(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+static std::vector<std::pair<double, double> > retarget_peaks(IsoThresholdGenerator& generator)
+{
+	std::vector<std::pair<double, double> > ret;
+	while(generator.advanceToNextConfiguration())
+		ret.push_back(std::make_pair(generator.prob(), generator.mass()));
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+size_t test_threshold_retarget(const char* formula, double threshold, bool print_confs)
+{
+	size_t confs_no = count_threshold_confs(formula, threshold);
+	if(confs_no > max_stored_confs)
+		return confs_no;
+
+	// Start empty, then alternately lower and raise the threshold
+	const double thresholds[] = {2.0, threshold * 1000.0, threshold * 10.0, threshold, threshold * 3.0, 2.0, threshold * 100.0, threshold};
+
+	// Marginals are reordered by their sizes at construction time: keep a fixed order so that the probabilities
+	// are multiplied in the same order and can be compared exactly
+	IsoThresholdGenerator retargeted(Iso(formula), thresholds[0], true, 1000, 1000, false);
+	size_t total = 0;
+
+	for(double thr : thresholds)
+	{
+		retargeted.new_threshold(thr, true);
+		IsoThresholdGenerator fresh(Iso(formula), thr, true, 1000, 1000, false);
+
+		size_t count = retargeted.count_confs();
+		assert(count == fresh.count_confs());
+
+		std::vector<std::pair<double, double> > retargeted_peaks = retarget_peaks(retargeted);
+		std::vector<std::pair<double, double> > fresh_peaks = retarget_peaks(fresh);
+		assert(retargeted_peaks.size() == count);
+		assert(retargeted_peaks == fresh_peaks);
+
+		if(print_confs)
+			for(size_t ii = 0; ii < retargeted_peaks.size(); ii++)
+				std::cout << "threshold: " << thr << " prob: " << retargeted_peaks[ii].first << " mass: " << retargeted_peaks[ii].second << std::endl;
+
+		total += count;
+	}
+
+	return total;
+}
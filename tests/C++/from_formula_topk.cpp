@@ -0,0 +1,78 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include "isoSpec++.h"
+#include "fixedEnvelopes.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_topk(const char* formula, double threshold, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./from_formula_topk C10000H1000O1000N1000 0.01" << std::endl;
+		std::cout << "...will check the top-K envelopes for K up to the number of configurations with probability above 0.01" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_topk(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+size_t test_topk(const char* formula, double threshold, bool print_confs)
+{
+	// The reference is computed with the ordered generator, which is slow for many configurations
+	size_t confs_no = IsoThresholdGenerator(Iso(formula), threshold, true).count_confs();
+	if(confs_no > 100000)
+		confs_no = 100000;
+
+	const size_t ks[] = {0, 1, 2, 50, confs_no / 2 + 1, confs_no, confs_no + 7};
+
+	size_t total = 0;
+
+	for(size_t k : ks)
+	{
+		FixedEnvelope topk = FixedEnvelope::FromTopK(Iso(formula), k, true);
+
+		std::vector<double> expected;
+		IsoOrderedGenerator ordered{Iso(formula)};
+		while(expected.size() < k && ordered.advanceToNextConfiguration())
+			expected.push_back(ordered.prob());
+
+		assert(topk.confs_no() == expected.size());
+
+		std::vector<double> got(topk.probs(), topk.probs() + topk.confs_no());
+		std::sort(got.begin(), got.end(), std::greater<double>());
+
+		for(size_t ii = 0; ii < got.size(); ii++)
+			assert(std::abs(got[ii] - expected[ii]) <= 1e-9 * expected[ii]);
+
+		if(print_confs)
+			for(size_t ii = 0; ii < topk.confs_no(); ii++)
+			{
+				std::cout << "k: " << k << " prob: " << topk.prob(ii) << " mass: " << topk.mass(ii) << " conf: ";
+				printArray<int>(topk.conf(ii), topk.getAllDim());
+			}
+
+		total += topk.confs_no();
+	}
+
+	return total;
+}
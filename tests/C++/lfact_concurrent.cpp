@@ -0,0 +1,95 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include "isoSpec++.h"
+#include "isoMath.h"
+#include "marginalTrek++.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_lfact_concurrent(int atom_cnt, unsigned int n_threads);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./lfact_concurrent 1000000 4" << std::endl;
+		std::cout << "...will build the marginals of C1000000, C1000001, ... in 4 threads at once and check the log-factorials they fill in" << std::endl;
+		return -1;
+	}
+
+	size_t no_checked = test_lfact_concurrent(atoi(argv[1]), atoi(argv[2]));
+
+	std::cout << "The number of checked log-factorials is:" << no_checked << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+static const double lfact_carbon_masses[] = {12.0, 13.0033548352};
+static const double lfact_carbon_probs[] = {0.9893, 0.0107};
+
+static std::unique_ptr<IsoSpec::PrecalculatedMarginal> lfact_marginal(int atom_cnt)
+{
+	Marginal m(lfact_carbon_masses, lfact_carbon_probs, 2, atom_cnt);
+	double lCutOff = m.getModeLProb() + log(1e-12);
+	return std::unique_ptr<IsoSpec::PrecalculatedMarginal>(new IsoSpec::PrecalculatedMarginal(std::move(m), lCutOff));
+}
+
+size_t test_lfact_concurrent(int atom_cnt, unsigned int n_threads)
+{
+	// The atom counts are close to each other, so the threads need the same uncached blocks of the table at the same time
+	std::vector<std::unique_ptr<IsoSpec::PrecalculatedMarginal>> parallel(n_threads);
+	std::vector<std::thread> threads;
+	std::atomic<bool> start(false);
+
+	for(unsigned int ii = 0; ii < n_threads; ii++)
+		threads.emplace_back([&, ii]()
+		{
+			while(!start.load())
+				std::this_thread::yield();
+			parallel[ii] = lfact_marginal(atom_cnt + ii);
+		});
+
+	start = true;
+	for(std::thread& thread : threads)
+		thread.join();
+
+	// Whichever thread filled a block, or computed a value while another one was filling it, the marginals are the same
+	for(unsigned int ii = 0; ii < n_threads; ii++)
+	{
+		std::unique_ptr<IsoSpec::PrecalculatedMarginal> serial = lfact_marginal(atom_cnt + ii);
+		assert(parallel[ii]->get_no_confs() == serial->get_no_confs());
+		assert(memcmp(parallel[ii]->get_lProbs_ptr(), serial->get_lProbs_ptr(), serial->get_no_confs() * sizeof(double)) == 0);
+		assert(memcmp(parallel[ii]->get_masses_ptr(), serial->get_masses_ptr(), serial->get_no_confs() * sizeof(double)) == 0);
+	}
+
+	size_t no_checked = 0;
+	for(int block = 0; block * ISOSPEC_LFACT_BLOCK < ISOSPEC_G_FACT_TABLE_SIZE; block++)
+	{
+		if(g_lfact_ready[block].load() != 2)
+			continue;
+		for(int n = block * ISOSPEC_LFACT_BLOCK; n < (block + 1) * ISOSPEC_LFACT_BLOCK && n < ISOSPEC_G_FACT_TABLE_SIZE; n++)
+		{
+			double expected = -lgamma(n + 1.0);
+			assert(g_lfact_table[n] == minuslogFactorial(n));
+			assert(fabs(g_lfact_table[n] - expected) <= 1e-12 * (std::max)(1.0, fabs(expected)));
+			no_checked++;
+		}
+	}
+
+	// The blocks of the most probable numbers of carbon 13 were filled in by the threads
+	int mode_c13 = static_cast<int>(atom_cnt * lfact_carbon_probs[1]);
+	if(mode_c13 < ISOSPEC_G_FACT_TABLE_SIZE)
+		assert(g_lfact_ready[mode_c13 / ISOSPEC_LFACT_BLOCK].load() == 2);
+
+	return no_checked;
+}
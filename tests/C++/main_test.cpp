@@ -3,6 +3,24 @@
 #include "from_formula_ordered.cpp"
 #include "from_formula_threshold.cpp"
 #include "from_formula_threshold_simple.cpp"
+#include "from_formula_threshold_parallel.cpp"
+#include "from_formula_threshold_mass_range.cpp"
+#include "from_formula_threshold_retarget.cpp"
+#include "from_formula_threshold_fused.cpp"
+#include "marginal_cache.cpp"
+#include "lfact_concurrent.cpp"
+#include "radix_sort.cpp"
+#include "marginal_tables.cpp"
+#include "marginal_derive.cpp"
+#include "from_formula_ordered_bucket.cpp"
+#include "from_formula_parallel_ordered.cpp"
+#include "from_formula_threshold_compact.cpp"
+#include "from_formula_binned_aggregated.cpp"
+#include "from_formula_topk.cpp"
+#include "from_formula_layered_parallel.cpp"
+#include "from_formula_layered_resume.cpp"
+#include "from_formula_mass_ordered.cpp"
+#include "enumerate.cpp"
 #include "element_zero.cpp"
 #include "unity-build.cpp"
 #include "empty_iso.cpp"
@@ -31,7 +49,12 @@ int main()
             zero_ok = true;
         }
         assert(zero_ok);
+        // Before the other tests fill in the log-factorials of C10000 and such
+        test_lfact_concurrent(1000000, 4);
+        test_radix_sort(4096, 0);
+        test_radix_sort(100000, 1);
         test_empty_and_print();
+        test_layered_resume_at_end();
         #if !defined(ISOSPEC_SKIP_SLOW_TESTS)
 	char test_formulas[] = "P1 P2 H1 H2 O1 O2 H2O1 C0 P0 C10000P10 F10C10000P10 P10F10O100 C100O0P100 C100 P100 C1 H10C10O10N10S5 Se1 Se10 Sn1 Sn4 Sn4C1 C2H6O1 C1000 C1H1O2N2Se1Sn1P1 P1C1Sn1 Se5 Sn5 Se2Sn2C2O2N2S2B2He2U2Na2Cl2";
         #else
@@ -58,9 +81,28 @@ int main()
 		{
 			TEST(*it_formula, *it_prob, test_threshold_simple);
 			TEST(*it_formula, *it_prob, test_threshold);
+			TEST(*it_formula, *it_prob, test_threshold_parallel);
+			TEST(*it_formula, *it_prob, test_threshold_mass_range);
+			TEST(*it_formula, *it_prob, test_threshold_retarget);
+			TEST(*it_formula, *it_prob, test_threshold_fused);
+			TEST(*it_formula, *it_prob, test_marginal_cache);
+			TEST(*it_formula, *it_prob, test_marginal_tables);
+			TEST(*it_formula, *it_prob, test_marginal_derive);
+			TEST(*it_formula, *it_prob, test_ordered_bucket);
+			TEST(*it_formula, *it_prob, test_parallel_ordered);
+			TEST(*it_formula, *it_prob, test_threshold_compact);
+			TEST(*it_formula, *it_prob, test_binned_aggregated);
+			TEST(*it_formula, *it_prob, test_topk);
+			TEST(*it_formula, *it_prob, test_mass_ordered);
+			TEST(*it_formula, *it_prob, test_enumerate);
 			TEST(*it_formula, *it_prob, test_layered_tabulator);
+			TEST(*it_formula, *it_prob, test_layered_parallel);
+			TEST(*it_formula, *it_prob, test_layered_resume);
 			TEST(*it_formula, *it_prob, test_ordered);
 		}
+	// The layer sizes of FromTotalProb() used to be planned past the whole configuration space of small molecules, and it never finished
+	TEST("P1C1Sn1", 0.99, test_layered_tabulator);
+	TEST("P1C1Sn1", 0.99, test_layered_resume);
 
         #if !defined(ISOSPEC_TESTS_MEMSAN)
 	std::cout << "Total confs considered: " << total << std::endl;
@@ -0,0 +1,98 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include "isoSpec++.h"
+#include "peaks.h"
+#include "fixedEnvelopes.h"
+#include "marginalCache.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_marginal_cache(const char* formula, double threshold, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./marginal_cache C10000H1000O1000N1000 0.01" << std::endl;
+		std::cout << "...will check that generators using cached marginals give the configurations with probability above 0.01" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_marginal_cache(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+size_t test_marginal_cache(const char* formula, double threshold, bool print_confs)
+{
+	size_t confs_no = count_threshold_confs(formula, threshold);
+	if(confs_no > max_stored_confs)
+		return confs_no;
+
+	const int dimNumber = Iso(formula).getDimNumber();
+
+	IsoThresholdGenerator unfused(Iso(formula), threshold, true, 1000, 1000, true, false);
+	std::vector<sorted_peak> reference = sorted_peaks(unfused);
+	assert(reference.size() == confs_no);
+
+	MarginalCache cache;
+
+	IsoThresholdGenerator first(Iso(formula), threshold, true, 1000, 1000, true, true, &cache);
+	assert(first.count_confs() == confs_no);
+	compare_peaks(first, reference);
+	const size_t misses = cache.misses();
+	assert(cache.hits() + misses == static_cast<size_t>(dimNumber));
+
+	// A higher threshold is served from the marginals computed for the lower one
+	IsoThresholdGenerator higher(Iso(formula), threshold * 10.0, true, 1000, 1000, true, true, &cache);
+	assert(higher.count_confs() == IsoThresholdGenerator(Iso(formula), threshold * 10.0, true).count_confs());
+	assert(cache.misses() == misses);
+	assert(cache.hits() + misses == 2 * static_cast<size_t>(dimNumber));
+
+	higher.new_threshold(threshold, true);
+	assert(higher.count_confs() == confs_no);
+	compare_peaks(higher, reference);
+
+	// Marginals evicted right away still work for their users
+	MarginalCache tiny(1);
+	IsoThresholdGenerator evicted(Iso(formula), threshold, true, 1000, 1000, true, true, &tiny);
+	assert(tiny.size() == 0);
+	assert(tiny.evictions() == static_cast<size_t>(dimNumber));
+	compare_peaks(evicted, reference);
+
+	// Concurrent users of the same cache
+	MarginalCache shared;
+	std::vector<size_t> counts(4);
+	std::vector<std::thread> threads;
+	for(size_t ii = 0; ii < counts.size(); ii++)
+		threads.emplace_back([&, ii]() { counts[ii] = FixedEnvelope::FromThreshold(Iso(formula), threshold, true, false, &shared).confs_no(); });
+	for(std::thread& thread : threads)
+		thread.join();
+	for(size_t count : counts)
+		assert(count == confs_no);
+	assert(shared.hits() + shared.misses() == counts.size() * dimNumber);
+
+	if(print_confs)
+		for(size_t ii = 0; ii < reference.size(); ii++)
+		{
+			std::cout << "prob: " << reference[ii].prob << " mass: " << reference[ii].mass << " conf: ";
+			printArray<int>(reference[ii].conf.data(), reference[ii].conf.size());
+		}
+
+	return confs_no;
+}
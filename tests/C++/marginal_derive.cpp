@@ -0,0 +1,133 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+#include "isoSpec++.h"
+#include "element_tables.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_marginal_derive(const char* formula, double threshold, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./marginal_derive C10000H1000O1000N1000 0.01" << std::endl;
+		std::cout << "...will check that the marginals derived for neighbouring atom counts are the same as the ones computed from scratch" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_marginal_derive(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+class DerivationIso : public Iso
+{
+ public:
+	explicit DerivationIso(const char* formula) : Iso(formula) {}
+	Marginal& marginal(int idx) { return *marginals[idx]; }
+};
+
+// The marginal of the element of m with atomCnt atoms, computed from scratch
+static Marginal derive_reference(const Marginal& m, int atomCnt)
+{
+	const int isotopeNo = m.get_isotopeNo();
+	std::vector<double> probs(isotopeNo);
+	for(int ii = 0; ii < isotopeNo; ii++)
+		probs[ii] = exp(m.get_lProbs()[ii]);
+	// Use the exact table values, as Iso does
+	for(int ii = 0; ii + isotopeNo <= ISOSPEC_NUMBER_OF_ISOTOPIC_ENTRIES; ii++)
+		if(memcmp(elem_table_mass + ii, m.get_atom_masses(), isotopeNo*sizeof(double)) == 0)
+		{
+			std::copy(elem_table_probability + ii, elem_table_probability + ii + isotopeNo, probs.begin());
+			break;
+		}
+	Marginal ret(m.get_atom_masses(), probs.data(), isotopeNo, atomCnt);
+	ret.getModeLProb();
+	return ret;
+}
+
+static std::vector<std::vector<int> > derive_confs(const IsoSpec::PrecalculatedMarginal& m)
+{
+	std::vector<std::vector<int> > ret(m.get_no_confs(), std::vector<int>(m.get_isotopeNo()));
+	for(unsigned int ii = 0; ii < m.get_no_confs(); ii++)
+		m.get_conf(ii, ret[ii].data());
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+size_t test_marginal_derive(const char* formula, double threshold, bool print_confs)
+{
+	DerivationIso iso(formula);
+	// Relative to the modes of the marginals: a few of their subisotopologues
+	const double lcut = threshold > 0.0 ? (std::max)(log(threshold), -12.0) : -12.0;
+
+	size_t total = 0;
+	for(int ii = 0; ii < iso.getDimNumber(); ii++)
+	{
+		Marginal& m = iso.marginal(ii);
+		const int atomCnt = m.get_atomCnt();
+		if(atomCnt > 100000)
+			continue;
+		m.getModeLProb();
+
+		IsoSpec::PrecalculatedMarginal base(Marginal(m), m.getModeLProb() + lcut);
+
+		for(int delta : {-100, -3, -1, 0, 1, 2, 7, 100})
+		{
+			// Tables of many-isotope elements grow too fast
+			if(delta > (std::max)(atomCnt, 7))
+				continue;
+
+			if(atomCnt + delta < 0)
+			{
+				bool thrown = false;
+				try { Marginal(m, delta); } catch(std::invalid_argument&) { thrown = true; }
+				assert(thrown);
+				continue;
+			}
+
+			Marginal reference = derive_reference(m, atomCnt + delta);
+			Marginal derived(m, delta);
+			assert(derived.get_atomCnt() == atomCnt + delta);
+			assert(derived.getModeLProb() == reference.getModeLProb());
+			assert(derived.getModeMass() == reference.getModeMass());
+
+			const double cut = reference.getModeLProb() + lcut;
+			IsoSpec::PrecalculatedMarginal reference_table(std::move(reference), cut);
+			std::unique_ptr<IsoSpec::PrecalculatedMarginal> derived_table(base.derive(delta, cut));
+
+			assert(derived_table->get_no_confs() == reference_table.get_no_confs());
+			for(unsigned int jj = 0; jj < reference_table.get_no_confs(); jj++)
+				assert(derived_table->get_lProb(jj) == reference_table.get_lProb(jj));
+			assert(derive_confs(*derived_table) == derive_confs(reference_table));
+
+			IsoSpec::LayeredMarginal layered(Marginal(m, delta));
+			layered.extend(cut);
+			assert(layered.get_no_confs() == reference_table.get_no_confs());
+
+			total += reference_table.get_no_confs();
+
+			if(print_confs)
+				std::cout << "element " << ii << " atoms: " << atomCnt + delta << " confs: " << reference_table.get_no_confs() << std::endl;
+		}
+	}
+
+	return total;
+}
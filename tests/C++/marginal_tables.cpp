@@ -0,0 +1,137 @@
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <unistd.h>
+#include "isoSpec++.h"
+#include "peaks.h"
+#include "fixedEnvelopes.h"
+#include "marginalCache.h"
+#include "marginalTables.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_marginal_tables(const char* formula, double threshold, bool print_confs);
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cout << "Proper usage (for example): ./marginal_tables C10000H1000O1000N1000 0.01" << std::endl;
+		std::cout << "...will check that generators using marginals mapped from a file give the configurations with probability above 0.01" << std::endl;
+		return -1;
+	}
+
+        bool print_confs = false;
+
+        if(argc > 3)
+            print_confs = (strcmp(argv[3], "true") == 0);
+
+	size_t no_visited = test_marginal_tables(argv[1], atof(argv[2]), print_confs);
+
+	std::cout << "The number of visited configurations is:" << no_visited << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+size_t test_marginal_tables(const char* formula, double threshold, bool print_confs)
+{
+	size_t confs_no = count_threshold_confs(formula, threshold);
+	if(confs_no > max_stored_confs)
+		return confs_no;
+
+	// Unique per process: concurrent test runs must not rewrite each other's mapped file
+	const std::string path_string = "marginal_tables_test." + std::to_string(static_cast<long>(getpid())) + ".tmp";
+	const char* path = path_string.c_str();
+	const int dimNumber = Iso(formula).getDimNumber();
+
+	IsoThresholdGenerator unfused(Iso(formula), threshold, true, 1000, 1000, true, false);
+	std::vector<sorted_peak> reference = sorted_peaks(unfused);
+	assert(reference.size() == confs_no);
+
+	{
+		MarginalCache filled;
+		IsoThresholdGenerator(Iso(formula), threshold, true, 1000, 1000, true, true, &filled).count_confs();
+		filled.save(path);
+	}
+
+	std::shared_ptr<const MarginalTables> tables = std::make_shared<const MarginalTables>(path);
+	assert(tables->size() <= static_cast<size_t>(dimNumber));
+
+	MarginalCache cache;
+	cache.attach(tables);
+
+	IsoThresholdGenerator mapped(Iso(formula), threshold, true, 1000, 1000, true, true, &cache);
+	assert(mapped.count_confs() == confs_no);
+	compare_peaks(mapped, reference);
+	assert(cache.mapped() == cache.misses());
+	assert(cache.hits() + cache.misses() == static_cast<size_t>(dimNumber));
+
+	// A higher threshold is served from the same tables
+	MarginalCache higher_cache;
+	higher_cache.attach(tables);
+	assert(FixedEnvelope::FromThreshold(Iso(formula), threshold * 10.0, true, false, &higher_cache).confs_no() ==
+	       IsoThresholdGenerator(Iso(formula), threshold * 10.0, true).count_confs());
+	assert(higher_cache.mapped() == higher_cache.misses());
+
+	// A lower one is not: the marginals are computed as usual
+	MarginalCache lower_cache;
+	lower_cache.attach(tables);
+	assert(IsoThresholdGenerator(Iso(formula), threshold * 0.01, true, 1000, 1000, true, true, &lower_cache).count_confs() ==
+	       IsoThresholdGenerator(Iso(formula), threshold * 0.01, true).count_confs());
+
+	// The mapping outlives the tables object as long as the marginals use it
+	tables.reset();
+	cache.attach(nullptr);
+	IsoThresholdGenerator still_mapped(Iso(formula), threshold, true, 1000, 1000, true, true, &cache);
+	assert(cache.mapped() == cache.misses());
+	compare_peaks(still_mapped, reference);
+
+	// Truncated files are rejected
+	{
+		std::vector<char> contents;
+		FILE* file = fopen(path, "rb");
+		assert(file != nullptr);
+		char buffer[4096];
+		size_t read;
+		while((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+			contents.insert(contents.end(), buffer, buffer + read);
+		fclose(file);
+
+		file = fopen(path, "wb");
+		assert(file != nullptr);
+		fwrite(contents.data(), 1, contents.size() - 1, file);
+		fclose(file);
+
+		bool thrown = false;
+		try
+		{
+			MarginalTables truncated(path);
+		}
+		catch(std::runtime_error&)
+		{
+			thrown = true;
+		}
+		assert(thrown);
+	}
+
+	std::remove(path);
+
+	if(print_confs)
+		for(size_t ii = 0; ii < reference.size(); ii++)
+		{
+			std::cout << "prob: " << reference[ii].prob << " mass: " << reference[ii].mass << " conf: ";
+			printArray<int>(reference[ii].conf.data(), reference[ii].conf.size());
+		}
+
+	return confs_no;
+}
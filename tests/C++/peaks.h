@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "isoSpec++.h"
+
+// The tests keeping all the configurations in memory (sometimes several copies of them) skip the cases with more of them
+static const size_t max_stored_confs = 10000000;
+
+static inline size_t count_threshold_confs(const char* formula, double threshold)
+{
+	return IsoSpec::IsoThresholdGenerator(IsoSpec::Iso(formula), threshold, true).count_confs();
+}
+
+// Configurations of a generator, in an order which does not depend on the way they were enumerated
+
+struct sorted_peak
+{
+	std::vector<int> conf;
+	double prob;
+	double mass;
+
+	bool operator<(const sorted_peak& other) const { return conf < other.conf; }
+};
+
+static inline std::vector<sorted_peak> sorted_peaks(IsoSpec::IsoThresholdGenerator& generator)
+{
+	std::vector<sorted_peak> ret;
+	while(generator.advanceToNextConfiguration())
+	{
+		sorted_peak peak;
+		peak.conf.resize(generator.getAllDim());
+		generator.get_conf_signature(peak.conf.data());
+		peak.prob = generator.prob();
+		peak.mass = generator.mass();
+		ret.push_back(peak);
+	}
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+static inline bool peaks_close(double a, double b)
+{
+	return std::abs(a - b) <= 1e-9 * std::max(std::abs(a), std::abs(b));
+}
+
+static inline void compare_peaks(IsoSpec::IsoThresholdGenerator& generator, const std::vector<sorted_peak>& reference)
+{
+	std::vector<sorted_peak> peaks = sorted_peaks(generator);
+	assert(peaks.size() == reference.size());
+	for(size_t ii = 0; ii < peaks.size(); ii++)
+	{
+		assert(peaks[ii].conf == reference[ii].conf);
+		assert(peaks_close(peaks[ii].prob, reference[ii].prob));
+		assert(peaks_close(peaks[ii].mass, reference[ii].mass));
+	}
+}
@@ -0,0 +1,96 @@
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include "isoSpec++.h"
+#include "misc.h"
+
+using namespace IsoSpec;
+
+#ifndef ISOSPEC_TESTS_SKIP_MAIN
+
+size_t test_radix_sort(size_t N, unsigned int seed);
+
+int main(int argc, char** argv)
+{
+	if(argc < 2)
+	{
+		std::cout << "Proper usage (for example): ./radix_sort 100000" << std::endl;
+		std::cout << "...will sort 100000 random keys, with ties, infinities, denormals and zeros of both signs, and compare the result with std::stable_sort" << std::endl;
+		return -1;
+	}
+
+	unsigned int seed = 0;
+
+	if(argc > 2)
+		seed = atoi(argv[2]);
+
+	size_t no_sorted = test_radix_sort(atoi(argv[1]), seed);
+
+	std::cout << "The number of sorted keys is:" << no_sorted << std::endl;
+
+}
+#endif /* ISOSPEC_TESTS_SKIP_MAIN */
+
+
+size_t test_radix_sort(size_t N, unsigned int seed)
+{
+	const double special[] = {
+		-std::numeric_limits<double>::infinity(),
+		std::numeric_limits<double>::denorm_min(),
+		-std::numeric_limits<double>::denorm_min(),
+		1e-310,
+		-1e-310,
+		0.0,
+		-0.0,
+		std::numeric_limits<double>::lowest(),
+		std::numeric_limits<double>::max()
+	};
+	const size_t no_special = sizeof(special) / sizeof(special[0]);
+
+	std::mt19937 random(seed);
+	std::uniform_real_distribution<double> lprob(-50.0, 0.0);
+	std::uniform_int_distribution<size_t> kind(0, 9);
+	std::uniform_int_distribution<size_t> special_idx(0, no_special - 1);
+
+	std::vector<double> keys(N);
+	std::vector<size_t> values(N);
+	for(size_t ii = 0; ii < N; ii++)
+	{
+		switch(kind(random))
+		{
+			case 0:
+				keys[ii] = special[special_idx(random)];
+				break;
+			case 1:
+			case 2:
+				// Coarse keys, so that there are many ties
+				keys[ii] = std::round(lprob(random));
+				break;
+			default:
+				keys[ii] = lprob(random);
+		}
+		values[ii] = ii;
+	}
+
+	std::vector<size_t> expected(N);
+	for(size_t ii = 0; ii < N; ii++)
+		expected[ii] = ii;
+	std::stable_sort(expected.begin(), expected.end(), [&](size_t i, size_t j) { return keys[i] > keys[j]; });
+
+	std::vector<double> sorted_keys(keys);
+	radix_sort_descending(sorted_keys.data(), values.data(), N);
+
+	for(size_t ii = 0; ii < N; ii++)
+	{
+		// The values are carried along with their keys, and the ties keep their order
+		assert(values[ii] == expected[ii]);
+		assert(sorted_keys[ii] == keys[expected[ii]]);
+	}
+
+	return N;
+}
@@ -0,0 +1,75 @@
+#include <iostream>
+#include <cassert>
+#include <vector>
+#include <cmath>
+#include "../../IsoSpec++/unity-build.cpp"
+
+using std::cout;
+
+#define CHECK_FILL(generatorType, setup_call) \
+{ \
+    void* iso = setupIso(2, isotopeNumbers, atomCounts, isotopeMasses, isotopeProbabilities); \
+    void* p = setup_call; \
+    std::vector<double> masses, probs, lprobs; \
+    std::vector<int> confs; \
+    int conf[5]; \
+    while(advanceToNextConfiguration##generatorType(p)) \
+    { \
+        masses.push_back(mass##generatorType(p)); \
+        probs.push_back(prob##generatorType(p)); \
+        lprobs.push_back(lprob##generatorType(p)); \
+        get_conf_signature##generatorType(p, conf); \
+        confs.insert(confs.end(), conf, conf+5); \
+    } \
+    delete##generatorType(p); \
+    deleteIso(iso); \
+    iso = setupIso(2, isotopeNumbers, atomCounts, isotopeMasses, isotopeProbabilities); \
+    p = setup_call; \
+    size_t total = 0, filled; \
+    do \
+    { \
+        filled = fill##generatorType(p, chunk_masses, chunk_probs, chunk_lprobs, chunk_confs, 7); \
+        for(size_t ii = 0; ii < filled; ii++, total++) \
+        { \
+            assert(total < masses.size()); \
+            assert(chunk_masses[ii] == masses[total]); \
+            assert(std::fabs(chunk_probs[ii] - probs[total]) <= 1e-12 * probs[total]); \
+            assert(chunk_lprobs[ii] == lprobs[total]); \
+            for(int jj = 0; jj < 5; jj++) \
+                assert(chunk_confs[ii*5+jj] == confs[total*5+jj]); \
+        } \
+    } while(filled == 7); \
+    assert(total == masses.size()); \
+    cout << #generatorType << ": " << total << " confs OK" << std::endl; \
+    delete##generatorType(p); \
+    deleteIso(iso); \
+}
+
+int main()
+{
+    int isotopeNumbers[] = {2, 3};
+    int atomCounts[] = {10, 10};
+    double isotopeMasses[] = {1.0, 2.0, 3.0, 4.0, 5.0};
+    double isotopeProbabilities[] = {0.5, 0.5, 0.5, 0.3, 0.2};
+
+    double chunk_masses[7], chunk_probs[7], chunk_lprobs[7];
+    int chunk_confs[7*5];
+
+    CHECK_FILL(IsoThresholdGenerator, setupIsoThresholdGenerator(iso, .0001, true, 1000, 1000, true))
+    CHECK_FILL(IsoLayeredGenerator, setupIsoLayeredGenerator(iso, 1000, 1000, true, 0.99))
+    CHECK_FILL(IsoOrderedGenerator, setupIsoOrderedGenerator(iso, 1000, 1000))
+
+    void* iso = setupIso(2, isotopeNumbers, atomCounts, isotopeMasses, isotopeProbabilities);
+    void* p = setupIsoStochasticGenerator(iso, 1000, 0.9999, 5.0);
+    size_t filled;
+    double counts = 0.0;
+    while((filled = fillIsoStochasticGenerator(p, nullptr, chunk_probs, nullptr, nullptr, 7)) > 0)
+        for(size_t ii = 0; ii < filled; ii++)
+            counts += chunk_probs[ii];
+    assert(counts == 1000.0);
+    cout << "IsoStochasticGenerator: " << counts << " molecules OK" << std::endl;
+    deleteIsoStochasticGenerator(p);
+    deleteIso(iso);
+
+    return 0;
+}
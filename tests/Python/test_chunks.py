@@ -0,0 +1,75 @@
+from __future__ import print_function
+import IsoSpecPy
+import math
+import numpy as np
+
+
+formulas = "H2O1 C100 P1 Se5 Sn4C1 C2H6O1 P1C1Sn1 H10C10O10N10S5".split()
+
+
+def generator_kinds(formula, get_confs):
+    yield "IsoThresholdGenerator", lambda: IsoSpecPy.IsoThresholdGenerator(0.0001, formula=formula, get_confs=get_confs)
+    yield "IsoLayeredGenerator", lambda: IsoSpecPy.IsoLayeredGenerator(formula=formula, get_confs=get_confs)
+    yield "IsoOrderedGenerator", lambda: IsoSpecPy.IsoOrderedGenerator(formula=formula, get_confs=get_confs)
+
+
+def flat_conf(conf):
+    return [count for element in conf for count in element]
+
+
+print("Checking np_chunks against the iteration...", end=' ')
+for formula in formulas:
+    if formula == "H10C10O10N10S5":
+        # The layered and ordered generators go through the whole configuration space
+        continue
+    for get_confs in (False, True):
+        for name, make in generator_kinds(formula, get_confs):
+            expected = list(make())
+            chunks = list(make().np_chunks(7))
+            assert all(len(chunk[0]) <= 7 for chunk in chunks)
+            masses = np.concatenate([chunk[0] for chunk in chunks]) if chunks else np.empty(0)
+            probs = np.concatenate([chunk[1] for chunk in chunks]) if chunks else np.empty(0)
+            assert len(masses) == len(probs) == len(expected), (formula, name)
+            assert list(masses) == [peak[0] for peak in expected], (formula, name)
+            assert list(probs) == [peak[1] for peak in expected], (formula, name)
+            if get_confs:
+                confs = np.concatenate([chunk[2] for chunk in chunks])
+                assert [list(row) for row in confs] == [flat_conf(peak[2]) for peak in expected], (formula, name)
+
+    # The stochastic generator draws different molecules each time: only the number of molecules can be compared
+    for get_confs in (False, True):
+        molecules = sum(peak[1] for peak in IsoSpecPy.IsoStochasticGenerator(1000, formula=formula, get_confs=get_confs))
+        chunks = list(IsoSpecPy.IsoStochasticGenerator(1000, formula=formula, get_confs=get_confs).np_chunks(7))
+        assert math.isclose(molecules, 1000.0)
+        assert math.isclose(sum(chunk[1].sum() for chunk in chunks), 1000.0)
+        if get_confs:
+            assert all(chunk[2].shape == (len(chunk[0]), sum(IsoSpecPy.Iso(formula).isotopeNumbers)) for chunk in chunks)
+print("OK!")
+
+
+print("Checking IsoTopK...", end=' ')
+for formula in formulas:
+    # The optimal p-set holds the most probable peaks
+    full = IsoSpecPy.IsoTotalProb(0.99999, formula=formula)
+    full_probs = sorted(full.probs, reverse=True)
+    for k in sorted(set(min(k, len(full_probs)) for k in (1, 2, 10, len(full_probs)))):
+        top = IsoSpecPy.IsoTopK(k, formula=formula, get_confs=True)
+        assert len(top) == k
+        top_probs = sorted(top.probs, reverse=True)
+        assert all(math.isclose(a, b, rel_tol=1e-9) for a, b in zip(top_probs, full_probs[:k]))
+        assert all(len(flat_conf(peak[2])) == sum(IsoSpecPy.Iso(formula).isotopeNumbers) for peak in top)
+print("OK!")
+
+
+print("Checking IsoThresholdInMassRange...", end=' ')
+for formula in formulas:
+    full = IsoSpecPy.IsoThreshold(0.0001, formula=formula)
+    masses = sorted(full.masses)
+    lowest, highest = masses[0], masses[-1]
+    for lower, upper in ((lowest, highest), (lowest + 1.5, highest - 1.5), (lowest + 0.5, lowest + 0.6), (highest + 1.0, highest + 2.0)):
+        expected = sorted((mass, prob) for mass, prob in zip(full.masses, full.probs) if lower <= mass <= upper)
+        in_range = IsoSpecPy.IsoThresholdInMassRange(0.0001, lower, upper, formula=formula)
+        got = sorted(zip(in_range.masses, in_range.probs))
+        assert len(got) == len(expected), (formula, lower, upper)
+        assert all(math.isclose(a[0], b[0]) and math.isclose(a[1], b[1], rel_tol=1e-9) for a, b in zip(got, expected))
+print("OK!")